@@ -11,23 +11,56 @@
 #include "ring.h"
 #include <archive.h>
 #include <archive_entry.h>
-
+#include <mbedtls/md.h>
+#include <zlib.h>
+#include <bzlib.h>
+#include <lzma.h>
+#include <zstd.h>
+#include <zdict.h>
+#include <lz4frame.h>
+#include <brotli/encode.h>
+#include <brotli/decode.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <process.h>
 #include <io.h>
 #define open _open
 #define read _read
+#define write _write
 #define close _close
+#define lseek _lseeki64
+#define ftruncate _chsize_s
 #define O_RDONLY _O_RDONLY
+#define O_RDWR _O_RDWR
+#define O_CREAT _O_CREAT
+#define O_BINARY _O_BINARY
 typedef int ssize_t;
 #else
+#include <pthread.h>
 #include <unistd.h>
 #endif
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef _MSC_VER
+#define RING_ARCHIVE_THREAD_LOCAL __declspec(thread)
+#else
+#define RING_ARCHIVE_THREAD_LOCAL __thread
+#endif
+
 /* Define mode_t and S_IS* macros for Windows */
 #ifdef _WIN32
 #ifndef mode_t
@@ -36,6 +69,9 @@ typedef unsigned short mode_t;
 #ifndef S_ISDIR
 #define S_ISDIR(m) (((m) & 0170000) == 0040000)
 #endif
+#ifndef S_ISREG
+#define S_ISREG(m) (((m) & 0170000) == 0100000)
+#endif
 #ifndef S_ISLNK
 #define S_ISLNK(m) (((m) & 0170000) == 0120000)
 #endif
@@ -65,6 +101,7 @@ typedef unsigned short mode_t;
 #define RING_COMPRESSION_LZMA 4
 #define RING_COMPRESSION_ZSTD 5
 #define RING_COMPRESSION_LZ4 6
+#define RING_COMPRESSION_BROTLI 7
 
 /* Entry types */
 #define RING_ENTRY_FILE 1
@@ -77,24 +114,6 @@ typedef unsigned short mode_t;
  * ============================================================================
  */
 
-static void free_archive_read(void *pState, void *pPointer)
-{
-	struct archive *a = (struct archive *)pPointer;
-	if (a)
-	{
-		archive_read_free(a);
-	}
-}
-
-static void free_archive_write(void *pState, void *pPointer)
-{
-	struct archive *a = (struct archive *)pPointer;
-	if (a)
-	{
-		archive_write_free(a);
-	}
-}
-
 static void free_archive_entry(void *pState, void *pPointer)
 {
 	struct archive_entry *entry = (struct archive_entry *)pPointer;
@@ -104,756 +123,9140 @@ static void free_archive_entry(void *pState, void *pPointer)
 	}
 }
 
-/* ============================================================================
- * Ring Functions - Archive Reading
- * ============================================================================
- */
-
 /*
- * archive_read_new() -> pArchive
- *
- * Create a new archive reader.
+ * Options are passed from Ring as a hash-like list, e.g. [:dedup = true],
+ * which arrives here as a list of [cKey, vValue] pairs.
  */
-RING_FUNC(ring_archive_read_new)
+static List *archive_option_find(List *pOptions, const char *key)
 {
-	struct archive *a = archive_read_new();
-	if (!a)
+	if (!pOptions)
 	{
-		RING_API_ERROR("Failed to create archive reader");
-		return;
+		return NULL;
 	}
-	RING_API_RETMANAGEDCPOINTER(a, "archive_read", free_archive_read);
+	int nSize = ring_list_getsize(pOptions);
+	for (int i = 1; i <= nSize; i++)
+	{
+		if (!ring_list_islist(pOptions, i))
+			continue;
+		List *pPair = ring_list_getlist(pOptions, i);
+		if (ring_list_getsize(pPair) == 2 && ring_list_isstring(pPair, 1) &&
+			strcmp(ring_list_getstring(pPair, 1), key) == 0)
+		{
+			return pPair;
+		}
+	}
+	return NULL;
 }
 
-/*
- * archive_read_support_filter_all(pArchive) -> nResult
- *
- * Enable all decompression filters.
- */
-RING_FUNC(ring_archive_read_support_filter_all)
+static double archive_option_number(List *pOptions, const char *key, double nDefault)
 {
-	if (RING_API_PARACOUNT != 1)
-	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
-	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
-	}
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	if (!a)
+	List *pPair = archive_option_find(pOptions, key);
+	if (pPair && ring_list_isnumber(pPair, 2))
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		return ring_list_getdouble(pPair, 2);
 	}
-	int result = archive_read_support_filter_all(a);
-	RING_API_RETNUMBER((double)result);
+	return nDefault;
 }
 
-/*
- * archive_read_support_format_all(pArchive) -> nResult
- *
- * Enable all archive format support.
- */
-RING_FUNC(ring_archive_read_support_format_all)
+static const char *archive_option_string(List *pOptions, const char *key)
 {
-	if (RING_API_PARACOUNT != 1)
-	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
-	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
-	}
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	if (!a)
+	List *pPair = archive_option_find(pOptions, key);
+	if (pPair && ring_list_isstring(pPair, 2))
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		return ring_list_getstring(pPair, 2);
 	}
-	int result = archive_read_support_format_all(a);
-	RING_API_RETNUMBER((double)result);
+	return NULL;
 }
 
-/*
- * archive_read_open_filename(pArchive, cFilename, nBlockSize) -> nResult
- *
- * Open an archive file for reading.
- */
-RING_FUNC(ring_archive_read_open_filename)
+/* A C pointer option of the given type, e.g. [:dictionary = pDict] */
+static void *archive_option_pointer(List *pOptions, const char *key, const char *cType)
 {
-	if (RING_API_PARACOUNT != 3)
-	{
-		RING_API_ERROR(RING_API_MISS3PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
-	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
-	}
-	if (!RING_API_ISSTRING(2))
+	List *pPair = archive_option_find(pOptions, key);
+	if (!pPair || !ring_list_islist(pPair, 2))
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		return NULL;
 	}
-	if (!RING_API_ISNUMBER(3))
+	List *pValue = ring_list_getlist(pPair, 2);
+	if (ring_list_getsize(pValue) < RING_CPOINTER_TYPE || !ring_list_isstring(pValue, RING_CPOINTER_TYPE) ||
+		strcmp(ring_list_getstring(pValue, RING_CPOINTER_TYPE), cType) != 0)
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		return NULL;
 	}
+	return ring_list_getpointer(pValue, RING_CPOINTER_POINTER);
+}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	if (!a)
-	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
-	}
+/* RING_ENTRY_* type of an entry as reported by archive_list() */
+static int archive_entry_ring_type(struct archive_entry *entry)
+{
+	mode_t type = archive_entry_filetype(entry);
+	if (S_ISDIR(type))
+		return RING_ENTRY_DIR;
+	if (S_ISLNK(type))
+		return RING_ENTRY_SYMLINK;
+	return RING_ENTRY_FILE;
+}
 
-	const char *filename = RING_API_GETSTRING(2);
-	size_t block_size = (size_t)RING_API_GETNUMBER(3);
+/* Rows of [pathname, size, type, mtime] appended to a Ring list */
+typedef struct ArchiveListTarget
+{
+	RingState *pRingState;
+	List *pList;
+} ArchiveListTarget;
 
-	int result = archive_read_open_filename(a, filename, block_size);
-	RING_API_RETNUMBER((double)result);
+static int archive_list_add_row(void *pContext, const char *cPath, la_int64_t nSize, int nType, la_int64_t nMtime)
+{
+	ArchiveListTarget *pTarget = (ArchiveListTarget *)pContext;
+	List *pEntryList = ring_list_newlist_gc(pTarget->pRingState, pTarget->pList);
+	ring_list_addstring_gc(pTarget->pRingState, pEntryList, cPath);
+	ring_list_adddouble_gc(pTarget->pRingState, pEntryList, (double)nSize);
+	ring_list_adddouble_gc(pTarget->pRingState, pEntryList, (double)nType);
+	ring_list_adddouble_gc(pTarget->pRingState, pEntryList, (double)nMtime);
+	return 1;
 }
 
-/*
- * archive_read_open_memory(pArchive, cData) -> nResult
- *
- * Open an archive from memory buffer for reading.
+/* ============================================================================
+ * Hash Map (byte-string keys)
+ * ============================================================================
  */
-RING_FUNC(ring_archive_read_open_memory)
+
+typedef struct ArchiveMapNode
 {
-	if (RING_API_PARACOUNT != 2)
-	{
-		RING_API_ERROR(RING_API_MISS2PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
-	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
-	}
-	if (!RING_API_ISSTRING(2))
-	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
-	}
+	struct ArchiveMapNode *pNext;
+	unsigned int nHash;
+	size_t nKeySize;
+	void *pValue;
+	char cKey[1];
+} ArchiveMapNode;
+
+typedef struct ArchiveMap
+{
+	ArchiveMapNode **aBuckets;
+	size_t nBuckets;
+	size_t nCount;
+} ArchiveMap;
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	if (!a)
+static unsigned int archive_map_hash(const char *key, size_t nKeySize)
+{
+	/* FNV-1a */
+	unsigned int nHash = 2166136261u;
+	for (size_t i = 0; i < nKeySize; i++)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		nHash ^= (unsigned char)key[i];
+		nHash *= 16777619u;
 	}
-
-	const char *data = RING_API_GETSTRING(2);
-	size_t size = RING_API_GETSTRINGSIZE(2);
-
-	int result = archive_read_open_memory(a, data, size);
-	RING_API_RETNUMBER((double)result);
+	return nHash;
 }
 
-/*
- * archive_read_next_header(pArchive) -> pEntry or NULL
- *
- * Read next entry header. Returns entry pointer or NULL if no more entries.
- */
-RING_FUNC(ring_archive_read_next_header)
+static int archive_map_init(ArchiveMap *pMap, size_t nBuckets)
 {
-	if (RING_API_PARACOUNT != 1)
-	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
-	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
-	}
+	pMap->nBuckets = nBuckets < 16 ? 16 : nBuckets;
+	pMap->nCount = 0;
+	pMap->aBuckets = (ArchiveMapNode **)calloc(pMap->nBuckets, sizeof(ArchiveMapNode *));
+	return pMap->aBuckets != NULL;
+}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	if (!a)
+static ArchiveMapNode *archive_map_find(ArchiveMap *pMap, const char *key, size_t nKeySize)
+{
+	unsigned int nHash = archive_map_hash(key, nKeySize);
+	ArchiveMapNode *pNode = pMap->aBuckets[nHash % pMap->nBuckets];
+	while (pNode)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		if (pNode->nHash == nHash && pNode->nKeySize == nKeySize && memcmp(pNode->cKey, key, nKeySize) == 0)
+		{
+			return pNode;
+		}
+		pNode = pNode->pNext;
 	}
+	return NULL;
+}
 
-	struct archive_entry *entry;
-	int result = archive_read_next_header(a, &entry);
+static void *archive_map_get(ArchiveMap *pMap, const char *key, size_t nKeySize)
+{
+	ArchiveMapNode *pNode = archive_map_find(pMap, key, nKeySize);
+	return pNode ? pNode->pValue : NULL;
+}
 
-	if (result == ARCHIVE_OK || result == ARCHIVE_WARN)
+static void archive_map_grow(ArchiveMap *pMap)
+{
+	size_t nBuckets = pMap->nBuckets * 2;
+	ArchiveMapNode **aBuckets = (ArchiveMapNode **)calloc(nBuckets, sizeof(ArchiveMapNode *));
+	if (!aBuckets)
 	{
-		/* Entry is owned by archive, don't free it separately */
-		RING_API_RETCPOINTER(entry, "archive_entry");
+		return;
 	}
-	else
+	for (size_t i = 0; i < pMap->nBuckets; i++)
 	{
-		RING_API_RETCPOINTER(NULL, "archive_entry");
+		ArchiveMapNode *pNode = pMap->aBuckets[i];
+		while (pNode)
+		{
+			ArchiveMapNode *pNext = pNode->pNext;
+			pNode->pNext = aBuckets[pNode->nHash % nBuckets];
+			aBuckets[pNode->nHash % nBuckets] = pNode;
+			pNode = pNext;
+		}
 	}
+	free(pMap->aBuckets);
+	pMap->aBuckets = aBuckets;
+	pMap->nBuckets = nBuckets;
 }
 
-/*
- * archive_read_data(pArchive, nSize) -> cData
- *
- * Read data from current entry.
- */
-RING_FUNC(ring_archive_read_data)
+/* Insert or replace. Returns the node, or NULL on allocation failure. */
+static ArchiveMapNode *archive_map_put(ArchiveMap *pMap, const char *key, size_t nKeySize, void *pValue)
 {
-	if (RING_API_PARACOUNT != 2)
+	ArchiveMapNode *pNode = archive_map_find(pMap, key, nKeySize);
+	if (pNode)
 	{
-		RING_API_ERROR(RING_API_MISS2PARA);
-		return;
+		pNode->pValue = pValue;
+		return pNode;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (pMap->nCount >= pMap->nBuckets)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		archive_map_grow(pMap);
 	}
-	if (!RING_API_ISNUMBER(2))
+	pNode = (ArchiveMapNode *)malloc(sizeof(ArchiveMapNode) + nKeySize);
+	if (!pNode)
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		return NULL;
 	}
+	pNode->nHash = archive_map_hash(key, nKeySize);
+	pNode->nKeySize = nKeySize;
+	pNode->pValue = pValue;
+	memcpy(pNode->cKey, key, nKeySize);
+	pNode->cKey[nKeySize] = '\0';
+	pNode->pNext = pMap->aBuckets[pNode->nHash % pMap->nBuckets];
+	pMap->aBuckets[pNode->nHash % pMap->nBuckets] = pNode;
+	pMap->nCount++;
+	return pNode;
+}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	if (!a)
+/* Remove a key. Returns its value, or NULL if it was not there. */
+static void *archive_map_remove(ArchiveMap *pMap, const char *key, size_t nKeySize)
+{
+	if (!pMap->aBuckets)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		return NULL;
 	}
-
-	size_t size = (size_t)RING_API_GETNUMBER(2);
-	if (size == 0)
+	unsigned int nHash = archive_map_hash(key, nKeySize);
+	ArchiveMapNode **ppNode = &pMap->aBuckets[nHash % pMap->nBuckets];
+	while (*ppNode)
 	{
-		return;
+		ArchiveMapNode *pNode = *ppNode;
+		if (pNode->nHash == nHash && pNode->nKeySize == nKeySize && memcmp(pNode->cKey, key, nKeySize) == 0)
+		{
+			void *pValue = pNode->pValue;
+			*ppNode = pNode->pNext;
+			free(pNode);
+			pMap->nCount--;
+			return pValue;
+		}
+		ppNode = &pNode->pNext;
 	}
+	return NULL;
+}
 
-	VM *pVM = (VM *)pPointer;
-	char *buffer = (char *)ring_state_malloc(pVM->pRingState, size);
-	if (!buffer)
+static void archive_map_free(ArchiveMap *pMap, void (*pFreeValue)(void *))
+{
+	if (!pMap->aBuckets)
 	{
-		RING_API_ERROR("Failed to allocate read buffer");
 		return;
 	}
-
-	la_ssize_t bytes_read = archive_read_data(a, buffer, size);
-	if (bytes_read < 0)
+	for (size_t i = 0; i < pMap->nBuckets; i++)
 	{
-		ring_state_free(pVM->pRingState, buffer);
-		return;
+		ArchiveMapNode *pNode = pMap->aBuckets[i];
+		while (pNode)
+		{
+			ArchiveMapNode *pNext = pNode->pNext;
+			if (pFreeValue && pNode->pValue)
+			{
+				pFreeValue(pNode->pValue);
+			}
+			free(pNode);
+			pNode = pNext;
+		}
 	}
-
-	RING_API_RETSTRING2(buffer, bytes_read);
-	ring_state_free(pVM->pRingState, buffer);
+	free(pMap->aBuckets);
+	pMap->aBuckets = NULL;
+	pMap->nBuckets = 0;
+	pMap->nCount = 0;
 }
 
+/* ============================================================================
+ * Threads
+ * ============================================================================
+ */
+
 /*
- * archive_read_data_block(pArchive) -> aResult [cData, nOffset, nSize] or NULL
- *
- * Read data block from current entry. More efficient for large files.
+ * Minimal portable mutex, condition variable and detached thread wrappers.
+ * Both mutex and condition types can be initialized statically, so global
+ * state such as the buffer pool needs no setup call.
  */
-RING_FUNC(ring_archive_read_data_block)
+#ifdef _WIN32
+typedef SRWLOCK ArchiveMutex;
+typedef CONDITION_VARIABLE ArchiveCond;
+#define RING_ARCHIVE_MUTEX_INIT SRWLOCK_INIT
+#define RING_ARCHIVE_COND_INIT CONDITION_VARIABLE_INIT
+#else
+typedef pthread_mutex_t ArchiveMutex;
+typedef pthread_cond_t ArchiveCond;
+#define RING_ARCHIVE_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define RING_ARCHIVE_COND_INIT PTHREAD_COND_INITIALIZER
+#endif
+
+static void archive_mutex_init(ArchiveMutex *pMutex)
 {
-	if (RING_API_PARACOUNT != 1)
-	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
-	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
-	}
+#ifdef _WIN32
+	InitializeSRWLock(pMutex);
+#else
+	pthread_mutex_init(pMutex, NULL);
+#endif
+}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	if (!a)
-	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
-	}
+static void archive_mutex_destroy(ArchiveMutex *pMutex)
+{
+#ifndef _WIN32
+	pthread_mutex_destroy(pMutex);
+#endif
+}
 
-	const void *buff;
-	size_t size;
-	la_int64_t offset;
+static void archive_mutex_lock(ArchiveMutex *pMutex)
+{
+#ifdef _WIN32
+	AcquireSRWLockExclusive(pMutex);
+#else
+	pthread_mutex_lock(pMutex);
+#endif
+}
 
-	int result = archive_read_data_block(a, &buff, &size, &offset);
+static void archive_mutex_unlock(ArchiveMutex *pMutex)
+{
+#ifdef _WIN32
+	ReleaseSRWLockExclusive(pMutex);
+#else
+	pthread_mutex_unlock(pMutex);
+#endif
+}
 
-	if (result == ARCHIVE_OK)
-	{
-		VM *pVM = (VM *)pPointer;
-		List *pResultList = RING_API_NEWLIST;
-		ring_list_addstring2_gc(pVM->pRingState, pResultList, (char *)buff, size);
-		ring_list_adddouble_gc(pVM->pRingState, pResultList, (double)offset);
-		ring_list_adddouble_gc(pVM->pRingState, pResultList, (double)size);
-		RING_API_RETLIST(pResultList);
-	}
+static void archive_cond_init(ArchiveCond *pCond)
+{
+#ifdef _WIN32
+	InitializeConditionVariable(pCond);
+#else
+	pthread_cond_init(pCond, NULL);
+#endif
 }
 
-/*
- * archive_read_data_skip(pArchive) -> nResult
- *
- * Skip data for current entry.
- */
-RING_FUNC(ring_archive_read_data_skip)
+static void archive_cond_destroy(ArchiveCond *pCond)
 {
-	if (RING_API_PARACOUNT != 1)
+#ifndef _WIN32
+	pthread_cond_destroy(pCond);
+#endif
+}
+
+static void archive_cond_broadcast(ArchiveCond *pCond)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(pCond);
+#else
+	pthread_cond_broadcast(pCond);
+#endif
+}
+
+/* Returns 0 once nTimeoutMs has passed; a negative timeout waits forever */
+static int archive_cond_wait(ArchiveCond *pCond, ArchiveMutex *pMutex, long nTimeoutMs)
+{
+#ifdef _WIN32
+	return SleepConditionVariableSRW(pCond, pMutex, nTimeoutMs < 0 ? INFINITE : (DWORD)nTimeoutMs, 0) ? 1 : 0;
+#else
+	if (nTimeoutMs < 0)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
+		pthread_cond_wait(pCond, pMutex);
+		return 1;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	struct timespec tDeadline;
+	clock_gettime(CLOCK_REALTIME, &tDeadline);
+	tDeadline.tv_sec += nTimeoutMs / 1000;
+	tDeadline.tv_nsec += (nTimeoutMs % 1000) * 1000000L;
+	if (tDeadline.tv_nsec >= 1000000000L)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		tDeadline.tv_sec++;
+		tDeadline.tv_nsec -= 1000000000L;
 	}
+	return pthread_cond_timedwait(pCond, pMutex, &tDeadline) == ETIMEDOUT ? 0 : 1;
+#endif
+}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	if (!a)
+/* Milliseconds on a monotonic clock, for measuring durations */
+static double archive_clock_ms(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER nCounter, nFrequency;
+	QueryPerformanceCounter(&nCounter);
+	QueryPerformanceFrequency(&nFrequency);
+	return (double)nCounter.QuadPart * 1000.0 / (double)nFrequency.QuadPart;
+#else
+	struct timespec tNow;
+	clock_gettime(CLOCK_MONOTONIC, &tNow);
+	return (double)tNow.tv_sec * 1000.0 + (double)tNow.tv_nsec / 1000000.0;
+#endif
+}
+
+static void archive_sleep_ms(double nMs)
+{
+#ifdef _WIN32
+	Sleep((DWORD)nMs);
+#else
+	struct timespec tWait;
+	tWait.tv_sec = (time_t)(nMs / 1000.0);
+	tWait.tv_nsec = (long)((nMs - (double)tWait.tv_sec * 1000.0) * 1000000.0);
+	while (nanosleep(&tWait, &tWait) != 0 && errno == EINTR)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
 	}
+#endif
+}
 
-	int result = archive_read_data_skip(a);
-	RING_API_RETNUMBER((double)result);
+#ifdef _WIN32
+typedef DWORD ArchiveThreadId;
+#else
+typedef pthread_t ArchiveThreadId;
+#endif
+
+static ArchiveThreadId archive_thread_self(void)
+{
+#ifdef _WIN32
+	return GetCurrentThreadId();
+#else
+	return pthread_self();
+#endif
 }
 
-/*
- * archive_read_close(pArchive) -> nResult
- *
- * Close archive reader.
- */
-RING_FUNC(ring_archive_read_close)
+static int archive_thread_equal(ArchiveThreadId tLeft, ArchiveThreadId tRight)
 {
-	if (RING_API_PARACOUNT != 1)
+#ifdef _WIN32
+	return tLeft == tRight;
+#else
+	return pthread_equal(tLeft, tRight);
+#endif
+}
+
+typedef struct ArchiveThreadStart
+{
+	void (*pFunc)(void *);
+	void *pArg;
+} ArchiveThreadStart;
+
+#ifdef _WIN32
+static unsigned __stdcall archive_thread_main(void *pArg)
+#else
+static void *archive_thread_main(void *pArg)
+#endif
+{
+	ArchiveThreadStart tStart = *(ArchiveThreadStart *)pArg;
+	free(pArg);
+	tStart.pFunc(tStart.pArg);
+	return 0;
+}
+
+/* Run pFunc(pArg) on a new detached thread */
+static int archive_thread_start(void (*pFunc)(void *), void *pArg)
+{
+	ArchiveThreadStart *pStart = (ArchiveThreadStart *)malloc(sizeof(ArchiveThreadStart));
+	if (!pStart)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
+		return 0;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	pStart->pFunc = pFunc;
+	pStart->pArg = pArg;
+#ifdef _WIN32
+	HANDLE hThread = (HANDLE)_beginthreadex(NULL, 0, archive_thread_main, pStart, 0, NULL);
+	if (hThread)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		CloseHandle(hThread);
+		return 1;
 	}
-
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	if (!a)
+#else
+	pthread_t tThread;
+	if (pthread_create(&tThread, NULL, archive_thread_main, pStart) == 0)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		pthread_detach(tThread);
+		return 1;
 	}
-
-	int result = archive_read_close(a);
-	RING_API_RETNUMBER((double)result);
+#endif
+	free(pStart);
+	return 0;
 }
 
+/* Guards reference counts of objects shared with background jobs */
+static ArchiveMutex g_tArchiveRefLock = RING_ARCHIVE_MUTEX_INIT;
+
 /* ============================================================================
- * Ring Functions - Archive Writing
+ * Worker Pool
  * ============================================================================
  */
 
 /*
- * archive_write_new() -> pArchive
+ * One pool of worker threads shared by every multi-threaded path in the
+ * extension, sized with archive_set_threads() and started on first use.
  *
- * Create a new archive writer.
+ * Each worker owns a task deque. Tasks queued from a worker go to the
+ * bottom of its own deque and it takes them back LIFO; idle workers steal
+ * FIFO from the top of the others. Tasks queued from any other thread are
+ * spread round-robin. A thread waiting for a task group runs the queued
+ * tasks of that group meanwhile, so nested parallel work cannot starve
+ * the pool. It never picks up unrelated work, which could be a whole
+ * background job that would hold up the wait until it finished.
  */
-RING_FUNC(ring_archive_write_new)
+#define RING_ARCHIVE_WORKERS_MAX 64
+
+typedef struct ArchiveTaskGroup
 {
-	struct archive *a = archive_write_new();
-	if (!a)
+	ArchiveMutex mutex;
+	ArchiveCond done;
+	int nPending;
+} ArchiveTaskGroup;
+
+typedef struct ArchiveTask
+{
+	void (*pFunc)(void *);
+	void *pArg;
+	ArchiveTaskGroup *pGroup;
+} ArchiveTask;
+
+typedef struct ArchiveTaskQueue
+{
+	ArchiveMutex mutex;
+	ArchiveTask *aTasks;
+	int nHead;
+	int nCount;
+	int nCapacity;
+} ArchiveTaskQueue;
+
+typedef struct ArchiveWorkers
+{
+	ArchiveMutex mutex;
+	ArchiveCond wake;
+	int lInitialized;
+	int nThreads;
+	int nSlots;
+	int nNext;
+	int nQueued;
+	int aRunning[RING_ARCHIVE_WORKERS_MAX];
+	ArchiveTaskQueue aQueues[RING_ARCHIVE_WORKERS_MAX];
+} ArchiveWorkers;
+
+static ArchiveWorkers g_tArchiveWorkers = {RING_ARCHIVE_MUTEX_INIT, RING_ARCHIVE_COND_INIT};
+
+/* Slot + 1 of the worker running on this thread, 0 elsewhere */
+static RING_ARCHIVE_THREAD_LOCAL int g_nArchiveWorkerSlot;
+
+static int archive_cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO tInfo;
+	GetSystemInfo(&tInfo);
+	int nCount = (int)tInfo.dwNumberOfProcessors;
+#else
+	int nCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (nCount < 1)
 	{
-		RING_API_ERROR("Failed to create archive writer");
-		return;
+		return 1;
 	}
-	RING_API_RETMANAGEDCPOINTER(a, "archive_write", free_archive_write);
+	return nCount < RING_ARCHIVE_WORKERS_MAX ? nCount : RING_ARCHIVE_WORKERS_MAX;
 }
 
-/*
- * archive_write_set_format(pArchive, nFormat) -> nResult
- *
- * Set archive format.
- */
-RING_FUNC(ring_archive_write_set_format)
+static int archive_queue_push(ArchiveTaskQueue *pQueue, const ArchiveTask *pTask)
 {
-	if (RING_API_PARACOUNT != 2)
-	{
-		RING_API_ERROR(RING_API_MISS2PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
+	int lPushed = 0;
+	archive_mutex_lock(&pQueue->mutex);
+	if (pQueue->nCount == pQueue->nCapacity)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		int nCapacity = pQueue->nCapacity ? pQueue->nCapacity * 2 : 64;
+		ArchiveTask *aTasks = (ArchiveTask *)malloc(sizeof(ArchiveTask) * nCapacity);
+		if (aTasks)
+		{
+			for (int i = 0; i < pQueue->nCount; i++)
+			{
+				aTasks[i] = pQueue->aTasks[(pQueue->nHead + i) % pQueue->nCapacity];
+			}
+			free(pQueue->aTasks);
+			pQueue->aTasks = aTasks;
+			pQueue->nHead = 0;
+			pQueue->nCapacity = nCapacity;
+		}
 	}
-	if (!RING_API_ISNUMBER(2))
+	if (pQueue->nCount < pQueue->nCapacity)
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		pQueue->aTasks[(pQueue->nHead + pQueue->nCount) % pQueue->nCapacity] = *pTask;
+		pQueue->nCount++;
+		lPushed = 1;
 	}
+	archive_mutex_unlock(&pQueue->mutex);
+	return lPushed;
+}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+/* The owner takes the newest task, thieves the oldest */
+static int archive_queue_pop(ArchiveTaskQueue *pQueue, int lSteal, ArchiveTask *pTask)
+{
+	int lPopped = 0;
+	archive_mutex_lock(&pQueue->mutex);
+	if (pQueue->nCount > 0)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		if (lSteal)
+		{
+			*pTask = pQueue->aTasks[pQueue->nHead];
+			pQueue->nHead = (pQueue->nHead + 1) % pQueue->nCapacity;
+		}
+		else
+		{
+			*pTask = pQueue->aTasks[(pQueue->nHead + pQueue->nCount - 1) % pQueue->nCapacity];
+		}
+		pQueue->nCount--;
+		lPopped = 1;
 	}
+	archive_mutex_unlock(&pQueue->mutex);
+	return lPopped;
+}
 
-	int format = (int)RING_API_GETNUMBER(2);
-	int result = ARCHIVE_OK;
-
-	switch (format)
+/* Take the oldest task of pGroup out of pQueue, wherever it is queued */
+static int archive_queue_take_group(ArchiveTaskQueue *pQueue, ArchiveTaskGroup *pGroup, ArchiveTask *pTask)
+{
+	int lTaken = 0;
+	archive_mutex_lock(&pQueue->mutex);
+	for (int i = 0; i < pQueue->nCount && !lTaken; i++)
 	{
-	case RING_ARCHIVE_FORMAT_TAR:
-		result = archive_write_set_format_pax_restricted(a);
-		break;
-	case RING_ARCHIVE_FORMAT_ZIP:
-		result = archive_write_set_format_zip(a);
-		break;
-	case RING_ARCHIVE_FORMAT_7ZIP:
-		result = archive_write_set_format_7zip(a);
-		break;
-	case RING_ARCHIVE_FORMAT_CPIO:
-		result = archive_write_set_format_cpio(a);
-		break;
-	case RING_ARCHIVE_FORMAT_ISO9660:
-		result = archive_write_set_format_iso9660(a);
-		break;
-	case RING_ARCHIVE_FORMAT_XAR:
-		result = archive_write_set_format_xar(a);
-		break;
-	case RING_ARCHIVE_FORMAT_RAW:
-		result = archive_write_set_format_raw(a);
-		break;
-	default:
-		result = archive_write_set_format_pax_restricted(a);
+		if (pQueue->aTasks[(pQueue->nHead + i) % pQueue->nCapacity].pGroup != pGroup)
+		{
+			continue;
+		}
+		*pTask = pQueue->aTasks[(pQueue->nHead + i) % pQueue->nCapacity];
+		for (int j = i; j < pQueue->nCount - 1; j++)
+		{
+			pQueue->aTasks[(pQueue->nHead + j) % pQueue->nCapacity] =
+				pQueue->aTasks[(pQueue->nHead + j + 1) % pQueue->nCapacity];
+		}
+		pQueue->nCount--;
+		lTaken = 1;
 	}
-
-	RING_API_RETNUMBER((double)result);
+	archive_mutex_unlock(&pQueue->mutex);
+	return lTaken;
 }
 
-/*
- * archive_write_set_format_zip(pArchive) -> nResult
- *
- * Set ZIP format for archive.
- */
-RING_FUNC(ring_archive_write_set_format_zip)
+/* Take a task from worker nSlot's own deque, or steal one */
+static int archive_workers_take(int nSlot, ArchiveTask *pTask)
 {
-	if (RING_API_PARACOUNT != 1)
+	ArchiveWorkers *pWorkers = &g_tArchiveWorkers;
+	archive_mutex_lock(&pWorkers->mutex);
+	int nSlots = pWorkers->nSlots;
+	archive_mutex_unlock(&pWorkers->mutex);
+
+	int lTaken = nSlot >= 0 && archive_queue_pop(&pWorkers->aQueues[nSlot], 0, pTask);
+	for (int i = 1; !lTaken && i <= nSlots; i++)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
+		int nVictim = (nSlot + i) % nSlots;
+		if (nVictim != nSlot)
+		{
+			lTaken = archive_queue_pop(&pWorkers->aQueues[nVictim], 1, pTask);
+		}
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (lTaken)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		archive_mutex_lock(&pWorkers->mutex);
+		pWorkers->nQueued--;
+		archive_mutex_unlock(&pWorkers->mutex);
 	}
+	return lTaken;
+}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+static void archive_task_run(const ArchiveTask *pTask)
+{
+	pTask->pFunc(pTask->pArg);
+	ArchiveTaskGroup *pGroup = pTask->pGroup;
+	if (pGroup)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		archive_mutex_lock(&pGroup->mutex);
+		if (--pGroup->nPending == 0)
+		{
+			archive_cond_broadcast(&pGroup->done);
+		}
+		archive_mutex_unlock(&pGroup->mutex);
 	}
-
-	int result = archive_write_set_format_zip(a);
-	RING_API_RETNUMBER((double)result);
 }
 
-/*
- * archive_write_set_format_pax(pArchive) -> nResult
- *
- * Set PAX (POSIX tar) format.
- */
-RING_FUNC(ring_archive_write_set_format_pax)
+static void archive_worker_main(void *pArg)
 {
-	if (RING_API_PARACOUNT != 1)
+	ArchiveWorkers *pWorkers = &g_tArchiveWorkers;
+	int nSlot = (int)(intptr_t)pArg;
+	g_nArchiveWorkerSlot = nSlot + 1;
+
+	for (;;)
+	{
+		ArchiveTask task;
+		if (archive_workers_take(nSlot, &task))
+		{
+			archive_task_run(&task);
+			continue;
+		}
+
+		archive_mutex_lock(&pWorkers->mutex);
+		if (nSlot >= pWorkers->nThreads && pWorkers->aQueues[nSlot].nCount == 0)
+		{
+			/* Retired by archive_set_threads(); others steal what is left */
+			pWorkers->aRunning[nSlot] = 0;
+			archive_mutex_unlock(&pWorkers->mutex);
+			return;
+		}
+		if (pWorkers->nQueued == 0)
+		{
+			archive_cond_wait(&pWorkers->wake, &pWorkers->mutex, -1);
+		}
+		archive_mutex_unlock(&pWorkers->mutex);
+	}
+}
+
+/* Start workers for empty slots below nThreads; called with the lock held */
+static void archive_workers_start(ArchiveWorkers *pWorkers)
+{
+	if (!pWorkers->lInitialized)
+	{
+		for (int i = 0; i < RING_ARCHIVE_WORKERS_MAX; i++)
+		{
+			archive_mutex_init(&pWorkers->aQueues[i].mutex);
+		}
+		if (pWorkers->nThreads == 0)
+		{
+			pWorkers->nThreads = archive_cpu_count();
+		}
+		pWorkers->lInitialized = 1;
+	}
+	for (int i = 0; i < pWorkers->nThreads; i++)
+	{
+		if (!pWorkers->aRunning[i])
+		{
+			pWorkers->aRunning[i] = archive_thread_start(archive_worker_main, (void *)(intptr_t)i);
+		}
+		if (pWorkers->aRunning[i] && i >= pWorkers->nSlots)
+		{
+			pWorkers->nSlots = i + 1;
+		}
+	}
+}
+
+/*
+ * Queue pFunc(pArg) on the pool, counting it in pGroup if given.
+ * Returns 0 if the task could not be queued; it has not run then.
+ */
+static int archive_task_submit(void (*pFunc)(void *), void *pArg, ArchiveTaskGroup *pGroup)
+{
+	ArchiveWorkers *pWorkers = &g_tArchiveWorkers;
+	ArchiveTask task;
+	task.pFunc = pFunc;
+	task.pArg = pArg;
+	task.pGroup = pGroup;
+
+	archive_mutex_lock(&pWorkers->mutex);
+	archive_workers_start(pWorkers);
+	int nSlot = g_nArchiveWorkerSlot - 1;
+	if (nSlot < 0 || nSlot >= pWorkers->nThreads)
+	{
+		nSlot = -1;
+		for (int i = 0; i < pWorkers->nThreads && nSlot < 0; i++)
+		{
+			int nCandidate = (pWorkers->nNext + i) % pWorkers->nThreads;
+			if (pWorkers->aRunning[nCandidate])
+			{
+				nSlot = nCandidate;
+			}
+		}
+		pWorkers->nNext = (nSlot + 1) % pWorkers->nThreads;
+	}
+	archive_mutex_unlock(&pWorkers->mutex);
+	if (nSlot < 0)
+	{
+		return 0;
+	}
+
+	if (pGroup)
+	{
+		archive_mutex_lock(&pGroup->mutex);
+		pGroup->nPending++;
+		archive_mutex_unlock(&pGroup->mutex);
+	}
+	if (!archive_queue_push(&pWorkers->aQueues[nSlot], &task))
+	{
+		if (pGroup)
+		{
+			archive_mutex_lock(&pGroup->mutex);
+			pGroup->nPending--;
+			archive_mutex_unlock(&pGroup->mutex);
+		}
+		return 0;
+	}
+
+	archive_mutex_lock(&pWorkers->mutex);
+	pWorkers->nQueued++;
+	archive_cond_broadcast(&pWorkers->wake);
+	archive_mutex_unlock(&pWorkers->mutex);
+	return 1;
+}
+
+/* Set the pool size; nThreads < 1 uses one thread per CPU */
+static int archive_workers_resize(int nThreads)
+{
+	ArchiveWorkers *pWorkers = &g_tArchiveWorkers;
+	if (nThreads < 1)
+	{
+		nThreads = archive_cpu_count();
+	}
+	if (nThreads > RING_ARCHIVE_WORKERS_MAX)
+	{
+		nThreads = RING_ARCHIVE_WORKERS_MAX;
+	}
+	archive_mutex_lock(&pWorkers->mutex);
+	pWorkers->nThreads = nThreads;
+	if (pWorkers->lInitialized)
+	{
+		archive_workers_start(pWorkers);
+		archive_cond_broadcast(&pWorkers->wake);
+	}
+	archive_mutex_unlock(&pWorkers->mutex);
+	return nThreads;
+}
+
+static int archive_workers_size(void)
+{
+	ArchiveWorkers *pWorkers = &g_tArchiveWorkers;
+	archive_mutex_lock(&pWorkers->mutex);
+	int nThreads = pWorkers->nThreads ? pWorkers->nThreads : archive_cpu_count();
+	archive_mutex_unlock(&pWorkers->mutex);
+	return nThreads;
+}
+
+static void archive_group_init(ArchiveTaskGroup *pGroup)
+{
+	archive_mutex_init(&pGroup->mutex);
+	archive_cond_init(&pGroup->done);
+	pGroup->nPending = 0;
+}
+
+static void archive_group_destroy(ArchiveTaskGroup *pGroup)
+{
+	archive_cond_destroy(&pGroup->done);
+	archive_mutex_destroy(&pGroup->mutex);
+}
+
+/*
+ * Run one queued task of pGroup on the calling thread. Code that blocks
+ * on pool work calls this first, so it never idles while the task it
+ * waits for sits in a queue, even when every worker is busy elsewhere.
+ */
+static int archive_workers_help(ArchiveTaskGroup *pGroup)
+{
+	ArchiveWorkers *pWorkers = &g_tArchiveWorkers;
+	archive_mutex_lock(&pWorkers->mutex);
+	int nSlots = pWorkers->nSlots;
+	archive_mutex_unlock(&pWorkers->mutex);
+
+	ArchiveTask task;
+	int nFirst = g_nArchiveWorkerSlot > 0 ? g_nArchiveWorkerSlot - 1 : 0;
+	for (int i = 0; i < nSlots; i++)
+	{
+		if (archive_queue_take_group(&pWorkers->aQueues[(nFirst + i) % nSlots], pGroup, &task))
+		{
+			archive_mutex_lock(&pWorkers->mutex);
+			pWorkers->nQueued--;
+			archive_mutex_unlock(&pWorkers->mutex);
+			archive_task_run(&task);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* How long a helping thread sleeps before looking for tasks again */
+#define RING_ARCHIVE_WORKERS_HELP_MS 10
+
+/* Wait until every task of pGroup has run, running its queued tasks meanwhile */
+static void archive_group_wait(ArchiveTaskGroup *pGroup)
+{
+	for (;;)
+	{
+		archive_mutex_lock(&pGroup->mutex);
+		int nPending = pGroup->nPending;
+		archive_mutex_unlock(&pGroup->mutex);
+		if (nPending == 0)
+		{
+			return;
+		}
+		if (archive_workers_help(pGroup))
+		{
+			continue;
+		}
+
+		archive_mutex_lock(&pGroup->mutex);
+		if (pGroup->nPending > 0)
+		{
+			archive_cond_wait(&pGroup->done, &pGroup->mutex, RING_ARCHIVE_WORKERS_HELP_MS);
+		}
+		archive_mutex_unlock(&pGroup->mutex);
+	}
+}
+
+/* ============================================================================
+ * Rate Limits
+ * ============================================================================
+ */
+
+/*
+ * Token buckets capping bytes and files per second. A bucket holds at
+ * most RING_ARCHIVE_RATE_BURST_MS worth of budget and may go into debt:
+ * callers take what they used, then sleep for as long as
+ * archive_rate_take() says.
+ */
+#define RING_ARCHIVE_RATE_BURST_MS 250.0
+#define RING_ARCHIVE_RATE_SLICE_MS 50.0
+
+typedef struct ArchiveRate
+{
+	ArchiveMutex mutex;
+	double nBytesPerSec;
+	double nFilesPerSec;
+	double nBytes;
+	double nFiles;
+	double nLast;
+} ArchiveRate;
+
+/* Returns NULL when neither rate is positive, which means no limit */
+static ArchiveRate *archive_rate_new(double nBytesPerSec, double nFilesPerSec)
+{
+	if (nBytesPerSec <= 0 && nFilesPerSec <= 0)
+	{
+		return NULL;
+	}
+	ArchiveRate *pRate = (ArchiveRate *)calloc(1, sizeof(ArchiveRate));
+	if (!pRate)
+	{
+		return NULL;
+	}
+	archive_mutex_init(&pRate->mutex);
+	pRate->nBytesPerSec = nBytesPerSec > 0 ? nBytesPerSec : 0;
+	pRate->nFilesPerSec = nFilesPerSec > 0 ? nFilesPerSec : 0;
+	pRate->nBytes = pRate->nBytesPerSec * RING_ARCHIVE_RATE_BURST_MS / 1000.0;
+	pRate->nFiles = pRate->nFilesPerSec * RING_ARCHIVE_RATE_BURST_MS / 1000.0;
+	pRate->nLast = archive_clock_ms();
+	return pRate;
+}
+
+static void archive_rate_free(ArchiveRate *pRate)
+{
+	if (pRate)
+	{
+		archive_mutex_destroy(&pRate->mutex);
+		free(pRate);
+	}
+}
+
+/* Refill one bucket and spend nUsed from it; returns the wait in ms */
+static double archive_rate_spend(double *pBudget, double nPerSec, double nElapsed, double nUsed)
+{
+	if (nPerSec <= 0)
+	{
+		return 0;
+	}
+	double nCap = nPerSec * RING_ARCHIVE_RATE_BURST_MS / 1000.0;
+	double nBudget = *pBudget + nElapsed * nPerSec / 1000.0;
+	*pBudget = (nBudget < nCap ? nBudget : nCap) - nUsed;
+	return *pBudget < 0 ? -*pBudget * 1000.0 / nPerSec : 0;
+}
+
+/* Take nBytes and nFiles from the buckets; returns how many ms to sleep */
+static double archive_rate_take(ArchiveRate *pRate, double nBytes, double nFiles)
+{
+	archive_mutex_lock(&pRate->mutex);
+	double nNow = archive_clock_ms();
+	double nElapsed = nNow - pRate->nLast;
+	pRate->nLast = nNow;
+	double nWaitBytes = archive_rate_spend(&pRate->nBytes, pRate->nBytesPerSec, nElapsed, nBytes);
+	double nWaitFiles = archive_rate_spend(&pRate->nFiles, pRate->nFilesPerSec, nElapsed, nFiles);
+	archive_mutex_unlock(&pRate->mutex);
+	return nWaitBytes > nWaitFiles ? nWaitBytes : nWaitFiles;
+}
+
+/*
+ * Limits set on Ring reader and writer handles with
+ * archive_read_set_rate_limit() / archive_write_set_rate_limit(), keyed
+ * by handle address. g_nArchiveHandleRates lets unlimited handles skip
+ * the lookup.
+ */
+static ArchiveMap g_tArchiveHandleRates;
+static ArchiveMutex g_tArchiveHandleRateLock = RING_ARCHIVE_MUTEX_INIT;
+static volatile int g_nArchiveHandleRates;
+
+/* Replace the limit of handle a; pRate NULL removes it */
+static int archive_handle_set_rate(struct archive *a, ArchiveRate *pRate)
+{
+	int lOk = 1;
+	archive_mutex_lock(&g_tArchiveHandleRateLock);
+	ArchiveRate *pOld = (ArchiveRate *)archive_map_remove(&g_tArchiveHandleRates, (const char *)&a, sizeof(a));
+	archive_rate_free(pOld);
+	if (pRate)
+	{
+		if (!g_tArchiveHandleRates.aBuckets)
+		{
+			archive_map_init(&g_tArchiveHandleRates, 16);
+		}
+		lOk = g_tArchiveHandleRates.aBuckets &&
+			  archive_map_put(&g_tArchiveHandleRates, (const char *)&a, sizeof(a), pRate) != NULL;
+		if (!lOk)
+		{
+			archive_rate_free(pRate);
+		}
+	}
+	g_nArchiveHandleRates = (int)g_tArchiveHandleRates.nCount;
+	archive_mutex_unlock(&g_tArchiveHandleRateLock);
+	return lOk;
+}
+
+/* Account for data and entries moved through handle a and sleep off any debt */
+static void archive_handle_throttle(struct archive *a, la_int64_t nBytes, int nFiles)
+{
+	if (!g_nArchiveHandleRates)
+	{
+		return;
+	}
+	double nWait = 0;
+	archive_mutex_lock(&g_tArchiveHandleRateLock);
+	ArchiveRate *pRate = g_tArchiveHandleRates.aBuckets
+							 ? (ArchiveRate *)archive_map_get(&g_tArchiveHandleRates, (const char *)&a, sizeof(a))
+							 : NULL;
+	if (pRate)
+	{
+		nWait = archive_rate_take(pRate, (double)nBytes, (double)nFiles);
+	}
+	archive_mutex_unlock(&g_tArchiveHandleRateLock);
+	if (nWait > 0)
+	{
+		archive_sleep_ms(nWait);
+	}
+}
+
+/* ============================================================================
+ * Shared Handles
+ * ============================================================================
+ */
+
+/*
+ * Writers from archive_write_new_shared() may be used by several threads.
+ * Every write call holds the handle's lock, and a thread that writes a
+ * header keeps holding it until archive_write_finish_entry() (or the
+ * next header, archive_write_close()), so entries from different threads
+ * never interleave. The owner may take the lock again while holding it.
+ */
+typedef struct ArchiveHandleLock
+{
+	ArchiveMutex mutex;
+	ArchiveCond cond;
+	ArchiveThreadId tOwner;
+	int nDepth;
+	int lEntry;
+} ArchiveHandleLock;
+
+static ArchiveMap g_tArchiveSharedHandles;
+static ArchiveMutex g_tArchiveSharedLock = RING_ARCHIVE_MUTEX_INIT;
+static volatile int g_nArchiveSharedHandles;
+
+/* Make handle a shared (lShared) or private again. Returns 1 on success. */
+static int archive_handle_set_shared(struct archive *a, int lShared)
+{
+	int lOk = 1;
+	archive_mutex_lock(&g_tArchiveSharedLock);
+	ArchiveHandleLock *pLock =
+		(ArchiveHandleLock *)archive_map_remove(&g_tArchiveSharedHandles, (const char *)&a, sizeof(a));
+	if (pLock)
+	{
+		archive_cond_destroy(&pLock->cond);
+		archive_mutex_destroy(&pLock->mutex);
+		free(pLock);
+	}
+	if (lShared)
+	{
+		pLock = (ArchiveHandleLock *)calloc(1, sizeof(ArchiveHandleLock));
+		if (pLock && !g_tArchiveSharedHandles.aBuckets)
+		{
+			archive_map_init(&g_tArchiveSharedHandles, 16);
+		}
+		lOk = pLock && g_tArchiveSharedHandles.aBuckets &&
+			  archive_map_put(&g_tArchiveSharedHandles, (const char *)&a, sizeof(a), pLock) != NULL;
+		if (lOk)
+		{
+			archive_mutex_init(&pLock->mutex);
+			archive_cond_init(&pLock->cond);
+		}
+		else
+		{
+			free(pLock);
+		}
+	}
+	g_nArchiveSharedHandles = (int)g_tArchiveSharedHandles.nCount;
+	archive_mutex_unlock(&g_tArchiveSharedLock);
+	return lOk;
+}
+
+/* Wait until this thread may use handle a. Returns NULL for private handles. */
+static ArchiveHandleLock *archive_handle_lock(struct archive *a)
+{
+	if (!g_nArchiveSharedHandles)
+	{
+		return NULL;
+	}
+	archive_mutex_lock(&g_tArchiveSharedLock);
+	ArchiveHandleLock *pLock =
+		g_tArchiveSharedHandles.aBuckets
+			? (ArchiveHandleLock *)archive_map_get(&g_tArchiveSharedHandles, (const char *)&a, sizeof(a))
+			: NULL;
+	archive_mutex_unlock(&g_tArchiveSharedLock);
+	if (!pLock)
+	{
+		return NULL;
+	}
+
+	ArchiveThreadId tSelf = archive_thread_self();
+	archive_mutex_lock(&pLock->mutex);
+	while (pLock->nDepth > 0 && !archive_thread_equal(pLock->tOwner, tSelf))
+	{
+		archive_cond_wait(&pLock->cond, &pLock->mutex, -1);
+	}
+	pLock->tOwner = tSelf;
+	pLock->nDepth++;
+	archive_mutex_unlock(&pLock->mutex);
+	return pLock;
+}
+
+/*
+ * Start (lEntry) or end holding the lock across the current entry. Only
+ * called by the owner between archive_handle_lock() and _unlock().
+ */
+static void archive_handle_hold_entry(ArchiveHandleLock *pLock, int lEntry)
+{
+	if (!pLock)
+	{
+		return;
+	}
+	archive_mutex_lock(&pLock->mutex);
+	if (lEntry != pLock->lEntry)
+	{
+		pLock->lEntry = lEntry;
+		pLock->nDepth += lEntry ? 1 : -1;
+	}
+	archive_mutex_unlock(&pLock->mutex);
+}
+
+static void archive_handle_unlock(ArchiveHandleLock *pLock)
+{
+	if (!pLock)
+	{
+		return;
+	}
+	archive_mutex_lock(&pLock->mutex);
+	if (--pLock->nDepth == 0)
+	{
+		archive_cond_broadcast(&pLock->cond);
+	}
+	archive_mutex_unlock(&pLock->mutex);
+}
+
+/* ============================================================================
+ * Jobs
+ * ============================================================================
+ */
+
+/*
+ * The high-level operations (extract, list, create) run as plain C without
+ * touching the Ring VM, so they can also run on a background thread. An
+ * ArchiveJob carries the arguments, progress counters and result of one
+ * such run; the synchronous functions pass NULL instead.
+ *
+ * A job is shared by its Ring handle and its worker thread and is freed by
+ * whichever lets go last. Counters are guarded by mutex. lCancel is only
+ * ever set, so the worker polls it without taking the lock.
+ *
+ * A cancellation token is a job that runs nothing. Jobs and synchronous
+ * calls given a token stop when it is cancelled or its deadline passes,
+ * and add their progress to it. A job with pRate set is slowed down to
+ * its rate limit as it reports progress.
+ */
+#define RING_ARCHIVE_JOB_EXTRACT 1
+#define RING_ARCHIVE_JOB_LIST 2
+#define RING_ARCHIVE_JOB_CREATE 3
+#define RING_ARCHIVE_JOB_TOKEN 4
+
+/* One archive_list() row: [pathname, size, type, mtime] */
+typedef struct ArchiveListRow
+{
+	char *cPath;
+	la_int64_t nSize;
+	int nType;
+	la_int64_t nMtime;
+} ArchiveListRow;
+
+typedef struct ArchiveCreateOptions
+{
+	int lDedup;
+	const char *cManifest;
+	struct ArchiveDict *pDict;
+} ArchiveCreateOptions;
+
+typedef struct ArchiveJob
+{
+	ArchiveMutex mutex;
+	ArchiveCond done;
+	int nKind;
+	int nRefs;
+	volatile int lCancel;
+	volatile int lExpired;
+	double nDeadline;
+	struct ArchiveJob *pToken;
+	ArchiveRate *pRate;
+	int lDone;
+	int nResult;
+	const char *cError;
+	la_int64_t nEntries;
+	la_int64_t nBytes;
+	la_int64_t nArchiveBytes;
+	la_int64_t nArchiveSize;
+	/* Arguments, owned by the job */
+	char *cArchivePath;
+	char *cDestPath;
+	char **aFiles;
+	int nFiles;
+	int nFormat;
+	int nCompression;
+	ArchiveCreateOptions options;
+	/* Rows collected by a list job */
+	ArchiveListRow *aRows;
+	int nRows;
+	int nRowsCapacity;
+} ArchiveJob;
+
+/* Whether pJob was cancelled or ran past its deadline or its token's */
+static int archive_job_cancelled(ArchiveJob *pJob)
+{
+	if (!pJob)
+	{
+		return 0;
+	}
+	if (pJob->lCancel)
+	{
+		return 1;
+	}
+	if (pJob->nDeadline > 0 && archive_clock_ms() >= pJob->nDeadline)
+	{
+		pJob->lExpired = 1;
+		pJob->lCancel = 1;
+		return 1;
+	}
+	if (archive_job_cancelled(pJob->pToken))
+	{
+		pJob->lExpired = pJob->pToken->lExpired;
+		pJob->lCancel = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/* The error a cancelled job finishes with */
+static const char *archive_job_cancel_error(ArchiveJob *pJob)
+{
+	return pJob->lExpired ? "Deadline exceeded" : "Operation cancelled";
+}
+
+/* Sleep off the rate limit debt of pJob, waking early if it is cancelled */
+static void archive_job_throttle(ArchiveJob *pJob, la_int64_t nEntries, la_int64_t nBytes)
+{
+	double nWait = archive_rate_take(pJob->pRate, (double)nBytes, (double)nEntries);
+	while (nWait > 0 && !archive_job_cancelled(pJob))
+	{
+		double nSlice = nWait < RING_ARCHIVE_RATE_SLICE_MS ? nWait : RING_ARCHIVE_RATE_SLICE_MS;
+		archive_sleep_ms(nSlice);
+		nWait -= nSlice;
+	}
+}
+
+/*
+ * Count finished entries and data bytes. When a is given, the number of
+ * bytes read from or written to the archive file is refreshed as well.
+ */
+static void archive_job_advance(ArchiveJob *pJob, struct archive *a, la_int64_t nEntries, la_int64_t nBytes)
+{
+	if (!pJob)
+	{
+		return;
+	}
+	la_int64_t nArchiveBytes = a ? archive_filter_bytes(a, -1) : -1;
+	for (ArchiveJob *pCounter = pJob; pCounter; pCounter = pCounter->pToken)
+	{
+		archive_mutex_lock(&pCounter->mutex);
+		pCounter->nEntries += nEntries;
+		pCounter->nBytes += nBytes;
+		if (nArchiveBytes >= 0)
+		{
+			pCounter->nArchiveBytes = nArchiveBytes;
+		}
+		archive_mutex_unlock(&pCounter->mutex);
+	}
+	if (pJob->pRate)
+	{
+		archive_job_throttle(pJob, nEntries, nBytes);
+	}
+}
+
+/* Record the size of the archive being read for progress reports */
+static void archive_job_measure(ArchiveJob *pJob, const char *cArchivePath)
+{
+	struct stat st;
+	if (!pJob || stat(cArchivePath, &st) != 0)
+	{
+		return;
+	}
+	for (; pJob; pJob = pJob->pToken)
+	{
+		archive_mutex_lock(&pJob->mutex);
+		pJob->nArchiveSize = (la_int64_t)st.st_size;
+		archive_mutex_unlock(&pJob->mutex);
+	}
+}
+
+/* ============================================================================
+ * Disk Helpers
+ * ============================================================================
+ */
+
+#define RING_ARCHIVE_COPY_BUFFER_SIZE (64 * 1024)
+
+/*
+ * Hash a file on disk with SHA-256. Returns 1 on success.
+ */
+static int archive_hash_file(const char *path, unsigned char *digest, char *buffer, size_t buffer_size)
+{
+	int fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0)
+	{
+		return 0;
+	}
+
+	mbedtls_md_context_t ctx;
+	mbedtls_md_init(&ctx);
+	if (mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) != 0 ||
+		mbedtls_md_starts(&ctx) != 0)
+	{
+		mbedtls_md_free(&ctx);
+		close(fd);
+		return 0;
+	}
+
+	ssize_t len;
+	while ((len = read(fd, buffer, buffer_size)) > 0)
+	{
+		mbedtls_md_update(&ctx, (const unsigned char *)buffer, (size_t)len);
+	}
+	close(fd);
+
+	int ok = (len == 0 && mbedtls_md_finish(&ctx, digest) == 0);
+	mbedtls_md_free(&ctx);
+	return ok;
+}
+
+/*
+ * Stream a file on disk into the current archive entry.
+ * When pHash is not NULL the data is also fed to it. Progress goes to
+ * pJob, and cancelling it stops the copy with an error.
+ */
+static la_int64_t archive_copy_file_data(struct archive *a, const char *path, char *buffer, size_t buffer_size,
+										 mbedtls_md_context_t *pHash, ArchiveJob *pJob)
+{
+	int fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	la_int64_t total = 0;
+	ssize_t len;
+	while ((len = read(fd, buffer, buffer_size)) > 0)
+	{
+		if (pHash)
+		{
+			mbedtls_md_update(pHash, (const unsigned char *)buffer, (size_t)len);
+		}
+		if (archive_write_data(a, buffer, (size_t)len) < 0 || archive_job_cancelled(pJob))
+		{
+			close(fd);
+			return -1;
+		}
+		archive_job_advance(pJob, a, 0, len);
+		archive_handle_throttle(a, len, 0);
+		total += len;
+	}
+	close(fd);
+	return len < 0 ? -1 : total;
+}
+
+/*
+ * Content-hash deduplication state used by archive_create.
+ * Files are keyed by size first so that a file is only hashed ahead of
+ * writing when another file of the same size has already been stored.
+ */
+typedef struct ArchiveDedup
+{
+	ArchiveMap sizes;
+	ArchiveMap digests;
+} ArchiveDedup;
+
+#define RING_ARCHIVE_DEDUP_KEY_SIZE (32 + sizeof(la_int64_t))
+
+static void archive_dedup_key(char *key, const unsigned char *digest, la_int64_t size)
+{
+	memcpy(key, digest, 32);
+	memcpy(key + 32, &size, sizeof(size));
+}
+
+static void archive_dedup_remember(ArchiveDedup *pDedup, struct archive_entry *entry, const unsigned char *digest)
+{
+	la_int64_t size = archive_entry_size(entry);
+	char key[RING_ARCHIVE_DEDUP_KEY_SIZE];
+	archive_dedup_key(key, digest, size);
+
+	char *cArchivePath = strdup(archive_entry_pathname(entry));
+	if (!cArchivePath || !archive_map_put(&pDedup->digests, key, sizeof(key), cArchivePath))
+	{
+		free(cArchivePath);
+		return;
+	}
+	archive_map_put(&pDedup->sizes, (const char *)&size, sizeof(size), pDedup);
+}
+
+/*
+ * Turn entry into a hardlink to an identical file stored earlier.
+ * Returns 1 when the entry was rewritten and its data must not be written.
+ */
+static int archive_dedup_link(ArchiveDedup *pDedup, struct archive_entry *entry, unsigned char *digest, char *buffer,
+							  size_t buffer_size, int *lHashed)
+{
+	la_int64_t size = archive_entry_size(entry);
+	*lHashed = 0;
+
+	/* Only files sharing a size with a stored file can be duplicates */
+	if (!archive_map_get(&pDedup->sizes, (const char *)&size, sizeof(size)))
+	{
+		return 0;
+	}
+	if (!archive_hash_file(archive_entry_sourcepath(entry), digest, buffer, buffer_size))
+	{
+		return 0;
+	}
+	*lHashed = 1;
+
+	char key[RING_ARCHIVE_DEDUP_KEY_SIZE];
+	archive_dedup_key(key, digest, size);
+	const char *cFirstPath = (const char *)archive_map_get(&pDedup->digests, key, sizeof(key));
+	if (!cFirstPath)
+	{
+		return 0;
+	}
+
+	archive_entry_set_hardlink(entry, cFirstPath);
+	archive_entry_set_size(entry, 0);
+	return 1;
+}
+
+/*
+ * Incremental creation state used by archive_create.
+ * The manifest is a text file with one line per entry:
+ *   size <TAB> mtime <TAB> mtime_nsec <TAB> inode <TAB> path
+ * Entries whose metadata is unchanged since the previous run are skipped,
+ * and paths that disappeared are listed in a tombstone entry. Its name is
+ * reserved: a file of that name makes the run fail rather than be
+ * mistaken for the tombstone list.
+ */
+#define RING_ARCHIVE_MANIFEST_HEADER "RING-ARCHIVE-MANIFEST 1"
+#define RING_ARCHIVE_TOMBSTONE_PATH ".archive-deleted"
+
+typedef struct ArchiveManifestRecord
+{
+	la_int64_t nSize;
+	la_int64_t nMtime;
+	long nMtimeNsec;
+	la_int64_t nIno;
+	int lSeen;
+} ArchiveManifestRecord;
+
+typedef struct ArchiveIncremental
+{
+	ArchiveMap previous;
+	const char *cManifestPath;
+	char *cTempPath;
+	FILE *pNew;
+} ArchiveIncremental;
+
+static void archive_incremental_load(ArchiveIncremental *pInc)
+{
+	FILE *fp = fopen(pInc->cManifestPath, "rb");
+	if (!fp)
+	{
+		return;
+	}
+
+	char line[8192];
+	if (!fgets(line, sizeof(line), fp) || strncmp(line, RING_ARCHIVE_MANIFEST_HEADER,
+												  strlen(RING_ARCHIVE_MANIFEST_HEADER)) != 0)
+	{
+		fclose(fp);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		size_t len = strlen(line);
+		if (len == 0 || line[len - 1] != '\n')
+			continue;
+		line[--len] = '\0';
+
+		ArchiveManifestRecord rec;
+		char *p = line;
+		char *end;
+		rec.nSize = (la_int64_t)strtoll(p, &end, 10);
+		if (*end != '\t')
+			continue;
+		rec.nMtime = (la_int64_t)strtoll(end + 1, &end, 10);
+		if (*end != '\t')
+			continue;
+		rec.nMtimeNsec = strtol(end + 1, &end, 10);
+		if (*end != '\t')
+			continue;
+		rec.nIno = (la_int64_t)strtoll(end + 1, &end, 10);
+		if (*end != '\t')
+			continue;
+		p = end + 1;
+		rec.lSeen = 0;
+
+		ArchiveManifestRecord *pRec = (ArchiveManifestRecord *)malloc(sizeof(ArchiveManifestRecord));
+		if (!pRec)
+			break;
+		*pRec = rec;
+		ArchiveManifestRecord *pOld = (ArchiveManifestRecord *)archive_map_get(&pInc->previous, p, strlen(p));
+		if (!archive_map_put(&pInc->previous, p, strlen(p), pRec))
+		{
+			free(pRec);
+			break;
+		}
+		free(pOld);
+	}
+	fclose(fp);
+}
+
+static int archive_incremental_begin(ArchiveIncremental *pInc, const char *cManifestPath)
+{
+	pInc->cManifestPath = cManifestPath;
+	pInc->pNew = NULL;
+	pInc->cTempPath = NULL;
+	if (!archive_map_init(&pInc->previous, 4096))
+	{
+		return 0;
+	}
+	archive_incremental_load(pInc);
+
+	size_t len = strlen(cManifestPath) + 5;
+	pInc->cTempPath = (char *)malloc(len);
+	if (!pInc->cTempPath)
+	{
+		return 0;
+	}
+	snprintf(pInc->cTempPath, len, "%s.tmp", cManifestPath);
+	pInc->pNew = fopen(pInc->cTempPath, "wb");
+	if (!pInc->pNew)
+	{
+		return 0;
+	}
+	fprintf(pInc->pNew, "%s\n", RING_ARCHIVE_MANIFEST_HEADER);
+	return 1;
+}
+
+/*
+ * Compare entry with the previous manifest, filling pCur with its current
+ * metadata. Returns 1 if the entry is unchanged and can be left out of
+ * the archive. Nothing is written to the new manifest; see
+ * archive_incremental_record().
+ */
+static int archive_incremental_unchanged(ArchiveIncremental *pInc, struct archive_entry *entry,
+										 ArchiveManifestRecord *pCur)
+{
+	ArchiveManifestRecord cur;
+	cur.nSize = archive_entry_size(entry);
+	cur.nMtime = (la_int64_t)archive_entry_mtime(entry);
+	cur.nMtimeNsec = archive_entry_mtime_nsec(entry);
+	cur.nIno = archive_entry_ino64(entry);
+	cur.lSeen = 1;
+	*pCur = cur;
+
+	const char *path = archive_entry_pathname(entry);
+	if (!path || strchr(path, '\n'))
+	{
+		return 0;
+	}
+
+	ArchiveManifestRecord *pOld = (ArchiveManifestRecord *)archive_map_get(&pInc->previous, path, strlen(path));
+	if (!pOld)
+	{
+		return 0;
+	}
+	pOld->lSeen = 1;
+
+	/* Directories are always written so restores recreate the tree */
+	if (archive_entry_filetype(entry) == AE_IFDIR)
+	{
+		return 0;
+	}
+	return pOld->nSize == cur.nSize && pOld->nMtime == cur.nMtime && pOld->nMtimeNsec == cur.nMtimeNsec &&
+		   pOld->nIno == cur.nIno;
+}
+
+/*
+ * Add path to the new manifest. Called only once the entry is stored in
+ * the archive, or was left out as unchanged, so that a file which failed
+ * to archive is picked up again by the next run.
+ */
+static void archive_incremental_record(ArchiveIncremental *pInc, const char *path, const ArchiveManifestRecord *pCur)
+{
+	if (!path || strchr(path, '\n'))
+	{
+		return;
+	}
+	fprintf(pInc->pNew, "%lld\t%lld\t%ld\t%lld\t%s\n", (long long)pCur->nSize, (long long)pCur->nMtime,
+			pCur->nMtimeNsec, (long long)pCur->nIno, path);
+}
+
+/* 1 if path extracts to the tombstone entry, ignoring leading "./" and "/" */
+static int archive_incremental_is_tombstone(const char *path)
+{
+	if (!path)
+	{
+		return 0;
+	}
+	while (*path == '/' || (path[0] == '.' && path[1] == '/'))
+	{
+		path += *path == '/' ? 1 : 2;
+	}
+	size_t nLen = strlen(RING_ARCHIVE_TOMBSTONE_PATH);
+	if (strncmp(path, RING_ARCHIVE_TOMBSTONE_PATH, nLen) != 0)
+	{
+		return 0;
+	}
+	path += nLen;
+	while (*path == '/')
+	{
+		path++;
+	}
+	return *path == '\0';
+}
+
+/*
+ * Write the list of paths that vanished since the previous manifest.
+ * Returns 0 if it could not be stored, so the manifest is not advanced.
+ */
+static int archive_incremental_write_tombstones(ArchiveIncremental *pInc, struct archive *a)
+{
+	size_t nLen = 0;
+	for (size_t i = 0; i < pInc->previous.nBuckets; i++)
+	{
+		for (ArchiveMapNode *pNode = pInc->previous.aBuckets[i]; pNode; pNode = pNode->pNext)
+		{
+			if (!((ArchiveManifestRecord *)pNode->pValue)->lSeen)
+			{
+				nLen += pNode->nKeySize + 1;
+			}
+		}
+	}
+	if (nLen == 0)
+	{
+		return 1;
+	}
+
+	char *cList = (char *)malloc(nLen);
+	if (!cList)
+	{
+		return 0;
+	}
+	char *p = cList;
+	for (size_t i = 0; i < pInc->previous.nBuckets; i++)
+	{
+		for (ArchiveMapNode *pNode = pInc->previous.aBuckets[i]; pNode; pNode = pNode->pNext)
+		{
+			if (!((ArchiveManifestRecord *)pNode->pValue)->lSeen)
+			{
+				memcpy(p, pNode->cKey, pNode->nKeySize);
+				p += pNode->nKeySize;
+				*p++ = '\n';
+			}
+		}
+	}
+
+	struct archive_entry *entry = archive_entry_new();
+	int lStored = 0;
+	if (entry)
+	{
+		archive_entry_set_pathname(entry, RING_ARCHIVE_TOMBSTONE_PATH);
+		archive_entry_set_filetype(entry, AE_IFREG);
+		archive_entry_set_perm(entry, 0644);
+		archive_entry_set_size(entry, (la_int64_t)nLen);
+		archive_entry_set_mtime(entry, time(NULL), 0);
+		lStored = archive_write_header(a, entry) == ARCHIVE_OK &&
+				  archive_write_data(a, cList, nLen) == (la_ssize_t)nLen;
+		archive_entry_free(entry);
+	}
+	free(cList);
+	return lStored;
+}
+
+/* Publish the new manifest when lCommit is set, otherwise discard it. */
+static void archive_incremental_end(ArchiveIncremental *pInc, int lCommit)
+{
+	if (pInc->pNew)
+	{
+		if (fclose(pInc->pNew) != 0)
+		{
+			lCommit = 0;
+		}
+		if (lCommit)
+		{
+#ifdef _WIN32
+			remove(pInc->cManifestPath);
+#endif
+			lCommit = rename(pInc->cTempPath, pInc->cManifestPath) == 0;
+		}
+		if (!lCommit)
+		{
+			remove(pInc->cTempPath);
+		}
+	}
+	free(pInc->cTempPath);
+	archive_map_free(&pInc->previous, free);
+}
+
+/* ============================================================================
+ * Append Helpers
+ * ============================================================================
+ */
+
+/*
+ * State for archive_write_open_append(). New output is written starting
+ * at nBase: over the tar end-of-archive blocks, or over the old ZIP
+ * central directory. Everything a ZIP append overwrites, from the central
+ * directory to the end of the file, is kept in pTail; on close the old
+ * central directory is written again in front of the new records. A
+ * failed append writes pTail back and truncates to nOriginalSize.
+ */
+typedef struct ArchiveAppend
+{
+	int fd;
+	int lZip;
+	la_int64_t nBase;
+	la_int64_t nWritten;
+	la_int64_t nOriginalSize;
+	unsigned char *pTail;
+	size_t nTailSize;
+	size_t nCentralSize;
+	la_int64_t nCentralEntries;
+	unsigned char *pComment;
+	size_t nCommentSize;
+	int nResult;
+} ArchiveAppend;
+
+/* Central directory location from a ZIP end record, ZIP64 or not */
+typedef struct ArchiveZipEnd
+{
+	la_int64_t nEntries;
+	la_int64_t nCentralSize;
+	la_int64_t nCentralOffset;
+	la_int64_t nStart; /* First byte of the end records */
+} ArchiveZipEnd;
+
+#define RING_ARCHIVE_ZIP_EOCD_SIZE 22
+#define RING_ARCHIVE_ZIP_CDH_SIZE 46
+#define RING_ARCHIVE_ZIP64_EOCD_SIZE 56
+#define RING_ARCHIVE_ZIP64_LOCATOR_SIZE 20
+
+static unsigned int archive_le16(const unsigned char *p)
+{
+	return (unsigned int)p[0] | ((unsigned int)p[1] << 8);
+}
+
+static unsigned int archive_le32(const unsigned char *p)
+{
+	return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static void archive_set_le16(unsigned char *p, unsigned int v)
+{
+	p[0] = (unsigned char)(v & 0xff);
+	p[1] = (unsigned char)((v >> 8) & 0xff);
+}
+
+static void archive_set_le32(unsigned char *p, unsigned int v)
+{
+	archive_set_le16(p, v & 0xffff);
+	archive_set_le16(p + 2, (v >> 16) & 0xffff);
+}
+
+static la_int64_t archive_le64(const unsigned char *p)
+{
+	return (la_int64_t)(((unsigned long long)archive_le32(p + 4) << 32) | archive_le32(p));
+}
+
+static void archive_set_le64(unsigned char *p, la_int64_t v)
+{
+	archive_set_le32(p, (unsigned int)((unsigned long long)v & 0xffffffff));
+	archive_set_le32(p + 4, (unsigned int)((unsigned long long)v >> 32));
+}
+
+static ssize_t archive_pread_full(int fd, void *buffer, size_t size, la_int64_t offset)
+{
+	if (lseek(fd, offset, SEEK_SET) < 0)
+	{
+		return -1;
+	}
+	size_t total = 0;
+	while (total < size)
+	{
+		ssize_t len = read(fd, (char *)buffer + total, (unsigned int)(size - total));
+		if (len < 0)
+			return -1;
+		if (len == 0)
+			break;
+		total += (size_t)len;
+	}
+	return (ssize_t)total;
+}
+
+static int archive_write_full(int fd, const void *buffer, size_t size)
+{
+	size_t total = 0;
+	while (total < size)
+	{
+		ssize_t len = write(fd, (const char *)buffer + total, (unsigned int)(size - total));
+		if (len <= 0)
+			return 0;
+		total += (size_t)len;
+	}
+	return 1;
+}
+
+/* Parse a tar numeric field: octal, or base-256 when the high bit is set. */
+static la_int64_t archive_tar_number(const unsigned char *p, size_t len)
+{
+	la_int64_t value = 0;
+	if (p[0] & 0x80)
+	{
+		value = p[0] & 0x3f;
+		for (size_t i = 1; i < len; i++)
+			value = (value << 8) | p[i];
+		return value;
+	}
+	for (size_t i = 0; i < len && p[i]; i++)
+	{
+		if (p[i] >= '0' && p[i] <= '7')
+			value = (value << 3) | (p[i] - '0');
+		else if (p[i] != ' ')
+			break;
+	}
+	return value;
+}
+
+/* Look for a "size=" record in pax extended header data. */
+static la_int64_t archive_pax_size(const char *data, size_t len)
+{
+	size_t pos = 0;
+	while (pos < len)
+	{
+		char *end;
+		long rec_len = strtol(data + pos, &end, 10);
+		if (rec_len <= 0 || pos + (size_t)rec_len > len || *end != ' ')
+			break;
+		if ((size_t)(end + 1 - data) + 5 <= pos + (size_t)rec_len && strncmp(end + 1, "size=", 5) == 0)
+		{
+			return (la_int64_t)strtoll(end + 6, NULL, 10);
+		}
+		pos += (size_t)rec_len;
+	}
+	return -1;
+}
+
+/*
+ * Walk tar headers (seeking over data) and return the offset of the
+ * end-of-archive marker, or -1 if the file is not a readable tar.
+ */
+static la_int64_t archive_tar_find_end(int fd)
+{
+	unsigned char header[512];
+	la_int64_t offset = 0;
+	la_int64_t pax_size = -1;
+
+	for (;;)
+	{
+		ssize_t len = archive_pread_full(fd, header, sizeof(header), offset);
+		if (len == 0)
+			return offset;
+		if (len != (ssize_t)sizeof(header))
+			return -1;
+
+		int lZero = 1;
+		unsigned int sum = 0;
+		for (int i = 0; i < 512; i++)
+		{
+			if (header[i])
+				lZero = 0;
+			sum += (i >= 148 && i < 156) ? ' ' : header[i];
+		}
+		if (lZero)
+			return offset;
+		if ((la_int64_t)sum != archive_tar_number(header + 148, 8))
+			return -1;
+
+		char type = (char)header[156];
+		la_int64_t size = archive_tar_number(header + 124, 12);
+		if (pax_size >= 0 && type != 'x' && type != 'g')
+		{
+			size = pax_size;
+			pax_size = -1;
+		}
+		if (type >= '2' && type <= '6')
+			size = 0;
+
+		if (type == 'x' && size > 0 && size < 65536)
+		{
+			char *data = (char *)malloc((size_t)size);
+			if (data && archive_pread_full(fd, data, (size_t)size, offset + 512) == (ssize_t)size)
+			{
+				pax_size = archive_pax_size(data, (size_t)size);
+			}
+			free(data);
+		}
+
+		offset += 512 + ((size + 511) / 512) * 512;
+	}
+}
+
+/*
+ * Read the central directory location from the end of central directory
+ * record at nEocd, following the ZIP64 locator in front of it if there
+ * is one. Returns 0 for multi-disk archives and broken ZIP64 records.
+ */
+static int archive_zip_read_end(int fd, la_int64_t nEocd, const unsigned char *eocd, ArchiveZipEnd *pEnd)
+{
+	unsigned char locator[RING_ARCHIVE_ZIP64_LOCATOR_SIZE];
+	unsigned char record[RING_ARCHIVE_ZIP64_EOCD_SIZE];
+	if (archive_le16(eocd + 4) != 0 || archive_le16(eocd + 6) != 0)
+	{
+		return 0;
+	}
+	pEnd->nEntries = archive_le16(eocd + 10);
+	pEnd->nCentralSize = archive_le32(eocd + 12);
+	pEnd->nCentralOffset = archive_le32(eocd + 16);
+	pEnd->nStart = nEocd;
+	if (nEocd < RING_ARCHIVE_ZIP64_LOCATOR_SIZE + RING_ARCHIVE_ZIP64_EOCD_SIZE ||
+		archive_pread_full(fd, locator, sizeof(locator), nEocd - RING_ARCHIVE_ZIP64_LOCATOR_SIZE) !=
+			(ssize_t)sizeof(locator) ||
+		archive_le32(locator) != 0x07064b50)
+	{
+		return 1;
+	}
+
+	la_int64_t nRecord = archive_le64(locator + 8);
+	if (archive_le32(locator + 4) != 0 || archive_le32(locator + 16) > 1 || nRecord < 0 ||
+		nRecord > nEocd - RING_ARCHIVE_ZIP64_LOCATOR_SIZE - RING_ARCHIVE_ZIP64_EOCD_SIZE ||
+		archive_pread_full(fd, record, sizeof(record), nRecord) != (ssize_t)sizeof(record) ||
+		archive_le32(record) != 0x06064b50 || archive_le32(record + 16) != 0 || archive_le32(record + 20) != 0)
+	{
+		return 0;
+	}
+	pEnd->nEntries = archive_le64(record + 32);
+	pEnd->nCentralSize = archive_le64(record + 40);
+	pEnd->nCentralOffset = archive_le64(record + 48);
+	pEnd->nStart = nRecord;
+	return pEnd->nEntries >= 0 && pEnd->nCentralSize >= 0 && pEnd->nCentralOffset >= 0;
+}
+
+/*
+ * Locate the ZIP end records, load everything from the central directory
+ * on into pTail and keep the archive comment. Returns 1 on success.
+ */
+static int archive_zip_load_central(struct archive *a, ArchiveAppend *pAppend)
+{
+	la_int64_t file_size = lseek(pAppend->fd, 0, SEEK_END);
+	if (file_size < RING_ARCHIVE_ZIP_EOCD_SIZE)
+	{
+		archive_set_error(a, EINVAL, "Not a ZIP archive");
+		return 0;
+	}
+
+	size_t tail_size = file_size < 65535 + RING_ARCHIVE_ZIP_EOCD_SIZE ? (size_t)file_size
+																	  : 65535 + RING_ARCHIVE_ZIP_EOCD_SIZE;
+	unsigned char *tail = (unsigned char *)malloc(tail_size);
+	if (!tail || archive_pread_full(pAppend->fd, tail, tail_size, file_size - (la_int64_t)tail_size) !=
+					 (ssize_t)tail_size)
+	{
+		free(tail);
+		archive_set_error(a, EIO, "Failed to read ZIP trailer");
+		return 0;
+	}
+
+	unsigned char *eocd = NULL;
+	for (size_t i = tail_size - RING_ARCHIVE_ZIP_EOCD_SIZE + 1; i-- > 0;)
+	{
+		if (archive_le32(tail + i) == 0x06054b50)
+		{
+			eocd = tail + i;
+			break;
+		}
+	}
+	if (!eocd)
+	{
+		free(tail);
+		archive_set_error(a, EINVAL, "ZIP end of central directory not found");
+		return 0;
+	}
+
+	ArchiveZipEnd end;
+	la_int64_t nEocd = file_size - (la_int64_t)tail_size + (eocd - tail);
+	if (!archive_zip_read_end(pAppend->fd, nEocd, eocd, &end))
+	{
+		free(tail);
+		archive_set_error(a, EINVAL, "Multi-disk and damaged ZIP64 archives cannot be appended");
+		return 0;
+	}
+	if (end.nCentralOffset + end.nCentralSize > end.nStart)
+	{
+		free(tail);
+		archive_set_error(a, EINVAL, "ZIP central directory is out of place");
+		return 0;
+	}
+
+	/* The archive comment is carried over to the new end record */
+	size_t comment_size = archive_le16(eocd + 20);
+	size_t comment_room = tail_size - (size_t)(eocd - tail) - RING_ARCHIVE_ZIP_EOCD_SIZE;
+	pAppend->nCommentSize = comment_size < comment_room ? comment_size : comment_room;
+	pAppend->pComment = (unsigned char *)malloc(pAppend->nCommentSize ? pAppend->nCommentSize : 1);
+	if (!pAppend->pComment)
+	{
+		free(tail);
+		archive_set_error(a, ENOMEM, "Failed to allocate ZIP comment");
+		return 0;
+	}
+	memcpy(pAppend->pComment, eocd + RING_ARCHIVE_ZIP_EOCD_SIZE, pAppend->nCommentSize);
+	free(tail);
+
+	/* New entries overwrite the central directory; keep it to restore it */
+	pAppend->nBase = end.nCentralOffset;
+	pAppend->nCentralEntries = end.nEntries;
+	pAppend->nCentralSize = (size_t)end.nCentralSize;
+	pAppend->nTailSize = (size_t)(file_size - end.nCentralOffset);
+	pAppend->pTail = (unsigned char *)malloc(pAppend->nTailSize);
+	if (!pAppend->pTail || archive_pread_full(pAppend->fd, pAppend->pTail, pAppend->nTailSize, pAppend->nBase) !=
+							   (ssize_t)pAppend->nTailSize)
+	{
+		archive_set_error(a, EIO, "Failed to read ZIP central directory");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Copy the central directory record at src (nRecord bytes) to dst with
+ * its local header offset moved by nBase, adding the offset to the ZIP64
+ * extra field when it no longer fits in 32 bits. Returns the size of
+ * the new record, at most nRecord + 12, or 0 if it cannot be rebased.
+ */
+static size_t archive_zip_rebase_record(const unsigned char *src, size_t nRecord, unsigned char *dst, la_int64_t nBase)
+{
+	size_t name_size = archive_le16(src + 28);
+	size_t extra_size = archive_le16(src + 30);
+	size_t extra_start = RING_ARCHIVE_ZIP_CDH_SIZE + name_size;
+	la_int64_t local = archive_le32(src + 42);
+
+	/* Find the ZIP64 extra field and where the local offset goes in it */
+	size_t zip64 = 0;
+	size_t zip64_size = 0;
+	for (size_t pos = extra_start; pos + 4 <= extra_start + extra_size;)
+	{
+		size_t field_size = archive_le16(src + pos + 2);
+		if (archive_le16(src + pos) == 0x0001)
+		{
+			zip64 = pos;
+			zip64_size = field_size;
+			break;
+		}
+		pos += 4 + field_size;
+	}
+	size_t offset_at = zip64 + 4 + (archive_le32(src + 24) == 0xffffffff ? 8 : 0) +
+					   (archive_le32(src + 20) == 0xffffffff ? 8 : 0);
+	if (archive_le16(src + 34) == 0xffff)
+	{
+		return 0;
+	}
+
+	memcpy(dst, src, nRecord);
+	if (local == 0xffffffff)
+	{
+		if (!zip64 || offset_at + 8 > zip64 + 4 + zip64_size)
+		{
+			return 0;
+		}
+		archive_set_le64(dst + offset_at, archive_le64(src + offset_at) + nBase);
+		return nRecord;
+	}
+	if (local + nBase < 0xffffffffLL)
+	{
+		archive_set_le32(dst + 42, (unsigned int)(local + nBase));
+		return nRecord;
+	}
+
+	/* Insert the 64-bit offset, growing or adding the ZIP64 extra field */
+	size_t insert_at = zip64 ? zip64 + 4 + zip64_size : extra_start + extra_size;
+	size_t grow = zip64 ? 8 : 12;
+	if (extra_size + grow > 0xffff || (zip64 && offset_at != insert_at))
+	{
+		return 0;
+	}
+	memcpy(dst + insert_at + grow, src + insert_at, nRecord - insert_at);
+	if (zip64)
+	{
+		archive_set_le16(dst + zip64 + 2, (unsigned int)(zip64_size + 8));
+	}
+	else
+	{
+		archive_set_le16(dst + insert_at, 0x0001);
+		archive_set_le16(dst + insert_at + 2, 8);
+	}
+	archive_set_le64(dst + insert_at + grow - 8, local + nBase);
+	archive_set_le32(dst + 42, 0xffffffff);
+	archive_set_le16(dst + 30, (unsigned int)(extra_size + grow));
+	return nRecord + grow;
+}
+
+/*
+ * Build the end records for a central directory of nEntries records,
+ * nSize bytes at nOffset, into end (room for RING_ARCHIVE_ZIP64_EOCD_SIZE
+ * + RING_ARCHIVE_ZIP64_LOCATOR_SIZE + RING_ARCHIVE_ZIP_EOCD_SIZE bytes);
+ * the ZIP64 records are only added when a field does not fit. Returns
+ * the number of bytes used, not counting the comment.
+ */
+static size_t archive_zip_build_end(unsigned char *end, la_int64_t nEntries, la_int64_t nSize, la_int64_t nOffset,
+									size_t nCommentSize)
+{
+	size_t used = 0;
+	int lZip64 = nEntries >= 0xffff || nSize >= 0xffffffffLL || nOffset >= 0xffffffffLL;
+	if (lZip64)
+	{
+		memset(end, 0, RING_ARCHIVE_ZIP64_EOCD_SIZE + RING_ARCHIVE_ZIP64_LOCATOR_SIZE);
+		archive_set_le32(end, 0x06064b50);
+		archive_set_le64(end + 4, RING_ARCHIVE_ZIP64_EOCD_SIZE - 12);
+		archive_set_le16(end + 12, 45);
+		archive_set_le16(end + 14, 45);
+		archive_set_le64(end + 24, nEntries);
+		archive_set_le64(end + 32, nEntries);
+		archive_set_le64(end + 40, nSize);
+		archive_set_le64(end + 48, nOffset);
+		unsigned char *locator = end + RING_ARCHIVE_ZIP64_EOCD_SIZE;
+		archive_set_le32(locator, 0x07064b50);
+		archive_set_le64(locator + 8, nOffset + nSize);
+		archive_set_le32(locator + 16, 1);
+		used = RING_ARCHIVE_ZIP64_EOCD_SIZE + RING_ARCHIVE_ZIP64_LOCATOR_SIZE;
+	}
+
+	unsigned char *eocd = end + used;
+	memset(eocd, 0, RING_ARCHIVE_ZIP_EOCD_SIZE);
+	archive_set_le32(eocd, 0x06054b50);
+	archive_set_le16(eocd + 8, nEntries >= 0xffff ? 0xffff : (unsigned int)nEntries);
+	archive_set_le16(eocd + 10, nEntries >= 0xffff ? 0xffff : (unsigned int)nEntries);
+	archive_set_le32(eocd + 12, nSize >= 0xffffffffLL ? 0xffffffff : (unsigned int)nSize);
+	archive_set_le32(eocd + 16, nOffset >= 0xffffffffLL ? 0xffffffff : (unsigned int)nOffset);
+	archive_set_le16(eocd + 20, (unsigned int)nCommentSize);
+	return used + RING_ARCHIVE_ZIP_EOCD_SIZE;
+}
+
+/*
+ * libarchive wrote [new entries][new central directory][end records] at
+ * nBase, over the old central directory. Rebase the new central
+ * directory records, put the old ones in front of them and finish with
+ * end records (ZIP64 when needed) carrying the original comment.
+ */
+static int archive_zip_merge_central(struct archive *a, ArchiveAppend *pAppend)
+{
+	unsigned char eocd[RING_ARCHIVE_ZIP_EOCD_SIZE];
+	ArchiveZipEnd end;
+	la_int64_t nEnd = pAppend->nBase + pAppend->nWritten;
+	if (pAppend->nWritten < RING_ARCHIVE_ZIP_EOCD_SIZE ||
+		archive_pread_full(pAppend->fd, eocd, sizeof(eocd), nEnd - RING_ARCHIVE_ZIP_EOCD_SIZE) != (ssize_t)sizeof(eocd) ||
+		archive_le32(eocd) != 0x06054b50 ||
+		!archive_zip_read_end(pAppend->fd, nEnd - RING_ARCHIVE_ZIP_EOCD_SIZE, eocd, &end))
+	{
+		archive_set_error(a, EINVAL, "Unexpected ZIP output while appending");
+		return 0;
+	}
+
+	/* Offsets in libarchive's end records count from nBase */
+	la_int64_t cd_offset = pAppend->nBase + end.nCentralOffset;
+	size_t new_cd_size = (size_t)end.nCentralSize;
+	if (end.nStart < pAppend->nBase || cd_offset + end.nCentralSize > end.nStart)
+	{
+		archive_set_error(a, EINVAL, "Unexpected ZIP output while appending");
+		return 0;
+	}
+
+	unsigned char *cd = (unsigned char *)malloc(new_cd_size ? new_cd_size : 1);
+	size_t out_capacity = new_cd_size + 12 * (new_cd_size / RING_ARCHIVE_ZIP_CDH_SIZE + 1);
+	unsigned char *out = (unsigned char *)malloc(out_capacity);
+	if (!cd || !out || archive_pread_full(pAppend->fd, cd, new_cd_size, cd_offset) != (ssize_t)new_cd_size)
+	{
+		free(cd);
+		free(out);
+		archive_set_error(a, EIO, "Failed to read new ZIP central directory");
+		return 0;
+	}
+
+	size_t pos = 0;
+	size_t out_size = 0;
+	while (pos < new_cd_size)
+	{
+		size_t record = RING_ARCHIVE_ZIP_CDH_SIZE;
+		if (pos + record <= new_cd_size)
+		{
+			record += archive_le16(cd + pos + 28) + archive_le16(cd + pos + 30) + archive_le16(cd + pos + 32);
+		}
+		size_t written = pos + record <= new_cd_size && archive_le32(cd + pos) == 0x02014b50
+							 ? archive_zip_rebase_record(cd + pos, record, out + out_size, pAppend->nBase)
+							 : 0;
+		if (!written)
+		{
+			free(cd);
+			free(out);
+			archive_set_error(a, EINVAL, "Unexpected ZIP central directory while appending");
+			return 0;
+		}
+		out_size += written;
+		pos += record;
+	}
+	free(cd);
+
+	unsigned char records[RING_ARCHIVE_ZIP64_EOCD_SIZE + RING_ARCHIVE_ZIP64_LOCATOR_SIZE + RING_ARCHIVE_ZIP_EOCD_SIZE];
+	la_int64_t total_cd_size = (la_int64_t)pAppend->nCentralSize + (la_int64_t)out_size;
+	size_t records_size = archive_zip_build_end(records, pAppend->nCentralEntries + end.nEntries, total_cd_size,
+												cd_offset, pAppend->nCommentSize);
+
+	int ok = lseek(pAppend->fd, cd_offset, SEEK_SET) >= 0 &&
+			 archive_write_full(pAppend->fd, pAppend->pTail, pAppend->nCentralSize) &&
+			 archive_write_full(pAppend->fd, out, out_size) && archive_write_full(pAppend->fd, records, records_size) &&
+			 archive_write_full(pAppend->fd, pAppend->pComment, pAppend->nCommentSize) &&
+			 ftruncate(pAppend->fd, cd_offset + total_cd_size + (la_int64_t)records_size +
+										(la_int64_t)pAppend->nCommentSize) == 0;
+	free(out);
+	if (!ok)
+	{
+		archive_set_error(a, EIO, "Failed to rewrite ZIP central directory");
+	}
+	return ok;
+}
+
+static la_ssize_t archive_append_write(struct archive *a, void *client_data, const void *buffer, size_t length)
+{
+	ArchiveAppend *pAppend = (ArchiveAppend *)client_data;
+	if (!archive_write_full(pAppend->fd, buffer, length))
+	{
+		archive_set_error(a, EIO, "Failed to write appended data");
+		return -1;
+	}
+	pAppend->nWritten += (la_int64_t)length;
+	return (la_ssize_t)length;
+}
+
+/*
+ * libarchive ignores the result of a client close callback, so the
+ * append state outlives it in this registry, keyed by handle address,
+ * until archive_write_close() collects nResult or the handle is freed.
+ */
+static ArchiveMap g_tArchiveAppends;
+static ArchiveMutex g_tArchiveAppendLock = RING_ARCHIVE_MUTEX_INIT;
+
+static void archive_append_free(ArchiveAppend *pAppend)
+{
+	if (pAppend)
+	{
+		if (pAppend->fd >= 0)
+		{
+			close(pAppend->fd);
+		}
+		free(pAppend->pTail);
+		free(pAppend->pComment);
+		free(pAppend);
+	}
+}
+
+/* Attach pAppend to handle a; fails if a is already appending */
+static int archive_append_register(struct archive *a, ArchiveAppend *pAppend)
+{
+	int lOk = 0;
+	archive_mutex_lock(&g_tArchiveAppendLock);
+	if (!g_tArchiveAppends.aBuckets)
+	{
+		archive_map_init(&g_tArchiveAppends, 16);
+	}
+	if (g_tArchiveAppends.aBuckets && !archive_map_get(&g_tArchiveAppends, (const char *)&a, sizeof(a)))
+	{
+		lOk = archive_map_put(&g_tArchiveAppends, (const char *)&a, sizeof(a), pAppend) != NULL;
+	}
+	archive_mutex_unlock(&g_tArchiveAppendLock);
+	return lOk;
+}
+
+/* Detach and return the append state of handle a, if any */
+static ArchiveAppend *archive_append_take(struct archive *a)
+{
+	ArchiveAppend *pAppend = NULL;
+	archive_mutex_lock(&g_tArchiveAppendLock);
+	if (g_tArchiveAppends.aBuckets)
+	{
+		pAppend = (ArchiveAppend *)archive_map_remove(&g_tArchiveAppends, (const char *)&a, sizeof(a));
+	}
+	archive_mutex_unlock(&g_tArchiveAppendLock);
+	return pAppend;
+}
+
+static int archive_append_close(struct archive *a, void *client_data)
+{
+	ArchiveAppend *pAppend = (ArchiveAppend *)client_data;
+	pAppend->nResult = ARCHIVE_OK;
+	if (pAppend->lZip)
+	{
+		if (!archive_zip_merge_central(a, pAppend))
+		{
+			/* Put the old central directory and end records back */
+			if (lseek(pAppend->fd, pAppend->nBase, SEEK_SET) < 0 ||
+				!archive_write_full(pAppend->fd, pAppend->pTail, pAppend->nTailSize) ||
+				ftruncate(pAppend->fd, pAppend->nOriginalSize) != 0)
+			{
+				archive_set_error(a, EIO, "Failed to restore ZIP after a failed append");
+			}
+			pAppend->nResult = ARCHIVE_FATAL;
+		}
+	}
+	else if (ftruncate(pAppend->fd, pAppend->nBase + pAppend->nWritten) != 0)
+	{
+		archive_set_error(a, errno, "Failed to truncate appended TAR");
+		pAppend->nResult = ARCHIVE_FATAL;
+	}
+	close(pAppend->fd);
+	pAppend->fd = -1;
+	return pAppend->nResult;
+}
+
+/* ============================================================================
+ * Memory Sink
+ * ============================================================================
+ */
+
+/*
+ * Size-classed buffer pool. Classes are powers of two from 64 KB to 4 MB
+ * and each keeps a few released buffers, so building many archives of a
+ * similar size reuses the same memory. Larger buffers bypass the pool,
+ * and no more than RING_ARCHIVE_POOL_MAX_BYTES stay parked in it;
+ * archive_pool_trim() frees them all.
+ */
+#define RING_ARCHIVE_MEMORY_MIN_CAPACITY (64 * 1024)
+#define RING_ARCHIVE_POOL_CLASSES 7
+#define RING_ARCHIVE_POOL_DEPTH 4
+#define RING_ARCHIVE_POOL_MAX_BYTES (16 * 1024 * 1024)
+
+static void *g_aArchivePool[RING_ARCHIVE_POOL_CLASSES][RING_ARCHIVE_POOL_DEPTH];
+static int g_aArchivePoolCount[RING_ARCHIVE_POOL_CLASSES];
+static size_t g_nArchivePoolBytes;
+static ArchiveMutex g_tArchivePoolLock = RING_ARCHIVE_MUTEX_INIT;
+
+static int archive_pool_class(size_t nSize)
+{
+	int nClass = 0;
+	size_t nClassSize = RING_ARCHIVE_MEMORY_MIN_CAPACITY;
+	while (nClassSize < nSize && nClass < RING_ARCHIVE_POOL_CLASSES)
+	{
+		nClassSize *= 2;
+		nClass++;
+	}
+	return nClass;
+}
+
+static void *archive_pool_acquire(size_t nSize, size_t *pCapacity)
+{
+	int nClass = archive_pool_class(nSize);
+	if (nClass >= RING_ARCHIVE_POOL_CLASSES)
+	{
+		*pCapacity = nSize;
+		return malloc(nSize);
+	}
+	*pCapacity = (size_t)RING_ARCHIVE_MEMORY_MIN_CAPACITY << nClass;
+	void *pBuffer = NULL;
+	archive_mutex_lock(&g_tArchivePoolLock);
+	if (g_aArchivePoolCount[nClass] > 0)
+	{
+		pBuffer = g_aArchivePool[nClass][--g_aArchivePoolCount[nClass]];
+		g_nArchivePoolBytes -= *pCapacity;
+	}
+	archive_mutex_unlock(&g_tArchivePoolLock);
+	return pBuffer ? pBuffer : malloc(*pCapacity);
+}
+
+static void archive_pool_release(void *pBuffer, size_t nCapacity)
+{
+	if (!pBuffer)
+	{
+		return;
+	}
+	int nClass = archive_pool_class(nCapacity);
+	if (nClass < RING_ARCHIVE_POOL_CLASSES && ((size_t)RING_ARCHIVE_MEMORY_MIN_CAPACITY << nClass) == nCapacity)
+	{
+		archive_mutex_lock(&g_tArchivePoolLock);
+		if (g_aArchivePoolCount[nClass] < RING_ARCHIVE_POOL_DEPTH &&
+			g_nArchivePoolBytes + nCapacity <= RING_ARCHIVE_POOL_MAX_BYTES)
+		{
+			g_aArchivePool[nClass][g_aArchivePoolCount[nClass]++] = pBuffer;
+			g_nArchivePoolBytes += nCapacity;
+			pBuffer = NULL;
+		}
+		archive_mutex_unlock(&g_tArchivePoolLock);
+	}
+	free(pBuffer);
+}
+
+/* Free every parked buffer; returns how many bytes that released */
+static size_t archive_pool_trim(void)
+{
+	archive_mutex_lock(&g_tArchivePoolLock);
+	size_t nFreed = g_nArchivePoolBytes;
+	for (int nClass = 0; nClass < RING_ARCHIVE_POOL_CLASSES; nClass++)
+	{
+		while (g_aArchivePoolCount[nClass] > 0)
+		{
+			free(g_aArchivePool[nClass][--g_aArchivePoolCount[nClass]]);
+		}
+	}
+	g_nArchivePoolBytes = 0;
+	archive_mutex_unlock(&g_tArchivePoolLock);
+	return nFreed;
+}
+
+/*
+ * Growable output buffer for archive_write_open_memory(). Capacity at
+ * least doubles as data arrives, up to nMaxSize, so writing n bytes costs
+ * O(n) copying in total. nMaxSize of 0 means no limit. Buffers larger
+ * than the pool sizes grow with realloc() instead of a fresh copy.
+ *
+ * The buffer is owned by Ring (lRingOwned), by the writer it is attached
+ * to (lWriterAttached) and by any readers opened on it (nReaders), and is
+ * destroyed when all of them let go. This keeps it valid when the garbage
+ * collector frees it before a writer's final flush or while a reader is
+ * still using the data. Readers and writers may close on worker threads,
+ * so these three fields are only touched under g_tArchiveMemoryLock.
+ */
+typedef struct ArchiveMemory
+{
+	char *pData;
+	size_t nSize;
+	size_t nCapacity;
+	size_t nMaxSize;
+	int lRingOwned;
+	int lWriterAttached;
+	int nReaders;
+} ArchiveMemory;
+
+#define RING_ARCHIVE_MEMORY_OWNER_RING 0
+#define RING_ARCHIVE_MEMORY_OWNER_WRITER 1
+#define RING_ARCHIVE_MEMORY_OWNER_READER 2
+
+static ArchiveMutex g_tArchiveMemoryLock = RING_ARCHIVE_MUTEX_INIT;
+
+static ArchiveMemory *archive_memory_create(size_t nMaxSize)
+{
+	ArchiveMemory *pMemory = (ArchiveMemory *)calloc(1, sizeof(ArchiveMemory));
+	if (pMemory)
+	{
+		pMemory->nMaxSize = nMaxSize;
+		pMemory->lRingOwned = 1;
+	}
+	return pMemory;
+}
+
+static int archive_memory_reserve(ArchiveMemory *pMemory, size_t nNeeded)
+{
+	if (nNeeded <= pMemory->nCapacity)
+	{
+		return 1;
+	}
+	if (pMemory->nMaxSize && nNeeded > pMemory->nMaxSize)
+	{
+		return 0;
+	}
+	if (pMemory->nCapacity <= ((size_t)-1) / 2 && nNeeded < pMemory->nCapacity * 2)
+	{
+		nNeeded = pMemory->nCapacity * 2;
+	}
+	if (pMemory->nMaxSize && nNeeded > pMemory->nMaxSize)
+	{
+		nNeeded = pMemory->nMaxSize;
+	}
+
+	/* Past the pool sizes realloc() can often grow the block in place */
+	int nClass = archive_pool_class(nNeeded);
+	if (nClass >= RING_ARCHIVE_POOL_CLASSES ||
+		(pMemory->nMaxSize && ((size_t)RING_ARCHIVE_MEMORY_MIN_CAPACITY << nClass) > pMemory->nMaxSize))
+	{
+		char *pData = (char *)realloc(pMemory->pData, nNeeded);
+		if (!pData)
+		{
+			return 0;
+		}
+		pMemory->pData = pData;
+		pMemory->nCapacity = nNeeded;
+		return 1;
+	}
+
+	size_t nCapacity;
+	char *pData = (char *)archive_pool_acquire(nNeeded, &nCapacity);
+	if (!pData)
+	{
+		return 0;
+	}
+	if (pMemory->nSize)
+	{
+		memcpy(pData, pMemory->pData, pMemory->nSize);
+	}
+	archive_pool_release(pMemory->pData, pMemory->nCapacity);
+	pMemory->pData = pData;
+	pMemory->nCapacity = nCapacity;
+	return 1;
+}
+
+/* New Ring-owned buffer holding a copy of pData */
+static ArchiveMemory *archive_memory_copy(const char *pData, size_t nSize)
+{
+	ArchiveMemory *pMemory = archive_memory_create(0);
+	if (!pMemory)
+	{
+		return NULL;
+	}
+	if (!archive_memory_reserve(pMemory, nSize ? nSize : 1))
+	{
+		free(pMemory);
+		return NULL;
+	}
+	memcpy(pMemory->pData, pData, nSize);
+	pMemory->nSize = nSize;
+	return pMemory;
+}
+
+/* Return the buffer to the pool; the sink stays usable */
+static void archive_memory_clear(ArchiveMemory *pMemory)
+{
+	archive_pool_release(pMemory->pData, pMemory->nCapacity);
+	pMemory->pData = NULL;
+	pMemory->nSize = 0;
+	pMemory->nCapacity = 0;
+}
+
+/* Returns 1 while a writer or reader is using the buffer */
+static int archive_memory_busy(ArchiveMemory *pMemory)
+{
+	archive_mutex_lock(&g_tArchiveMemoryLock);
+	int lBusy = pMemory->lWriterAttached || pMemory->nReaders > 0;
+	archive_mutex_unlock(&g_tArchiveMemoryLock);
+	return lBusy;
+}
+
+/* Returns 1 while a writer is attached to the buffer */
+static int archive_memory_writing(ArchiveMemory *pMemory)
+{
+	archive_mutex_lock(&g_tArchiveMemoryLock);
+	int lWriting = pMemory->lWriterAttached;
+	archive_mutex_unlock(&g_tArchiveMemoryLock);
+	return lWriting;
+}
+
+static void archive_memory_attach(ArchiveMemory *pMemory, int nOwner)
+{
+	archive_mutex_lock(&g_tArchiveMemoryLock);
+	if (nOwner == RING_ARCHIVE_MEMORY_OWNER_WRITER)
+	{
+		pMemory->lWriterAttached = 1;
+	}
+	else
+	{
+		pMemory->nReaders++;
+	}
+	archive_mutex_unlock(&g_tArchiveMemoryLock);
+}
+
+static void archive_memory_release(ArchiveMemory *pMemory, int nOwner)
+{
+	if (!pMemory)
+	{
+		return;
+	}
+	archive_mutex_lock(&g_tArchiveMemoryLock);
+	if (nOwner == RING_ARCHIVE_MEMORY_OWNER_WRITER)
+	{
+		pMemory->lWriterAttached = 0;
+	}
+	else if (nOwner == RING_ARCHIVE_MEMORY_OWNER_READER)
+	{
+		pMemory->nReaders--;
+	}
+	else
+	{
+		pMemory->lRingOwned = 0;
+	}
+	int lUnused = !pMemory->lRingOwned && !pMemory->lWriterAttached && pMemory->nReaders <= 0;
+	archive_mutex_unlock(&g_tArchiveMemoryLock);
+	if (lUnused)
+	{
+		archive_memory_clear(pMemory);
+		free(pMemory);
+	}
+}
+
+static void free_archive_memory(void *pState, void *pPointer)
+{
+	archive_memory_release((ArchiveMemory *)pPointer, RING_ARCHIVE_MEMORY_OWNER_RING);
+}
+
+static int archive_memory_open(struct archive *a, void *client_data)
+{
+	ArchiveMemory *pMemory = (ArchiveMemory *)client_data;
+	archive_memory_attach(pMemory, RING_ARCHIVE_MEMORY_OWNER_WRITER);
+	/* Like libarchive's own memory writer: no padding of the last block */
+	if (archive_write_get_bytes_in_last_block(a) < 0)
+	{
+		archive_write_set_bytes_in_last_block(a, 1);
+	}
+	return ARCHIVE_OK;
+}
+
+static la_ssize_t archive_memory_write(struct archive *a, void *client_data, const void *buffer, size_t length)
+{
+	ArchiveMemory *pMemory = (ArchiveMemory *)client_data;
+	if (length > ((size_t)-1) - pMemory->nSize || !archive_memory_reserve(pMemory, pMemory->nSize + length))
+	{
+		if (pMemory->nMaxSize)
+		{
+			archive_set_error(a, ENOMEM, "Memory archive exceeds the %lu byte limit",
+							  (unsigned long)pMemory->nMaxSize);
+		}
+		else
+		{
+			archive_set_error(a, ENOMEM, "Out of memory growing memory archive");
+		}
+		return -1;
+	}
+	memcpy(pMemory->pData + pMemory->nSize, buffer, length);
+	pMemory->nSize += length;
+	return (la_ssize_t)length;
+}
+
+static int archive_memory_close(struct archive *a, void *client_data)
+{
+	(void)a;
+	archive_memory_release((ArchiveMemory *)client_data, RING_ARCHIVE_MEMORY_OWNER_WRITER);
+	return ARCHIVE_OK;
+}
+
+/*
+ * Reader over an ArchiveMemory. The whole buffer is handed to libarchive
+ * in one block, with no copy; the reader pins the buffer until it closes.
+ */
+typedef struct ArchiveMemoryReader
+{
+	ArchiveMemory *pMemory;
+	la_int64_t nPosition;
+} ArchiveMemoryReader;
+
+static la_ssize_t archive_memory_read(struct archive *a, void *client_data, const void **buffer)
+{
+	ArchiveMemoryReader *pReader = (ArchiveMemoryReader *)client_data;
+	(void)a;
+	la_int64_t nLeft = (la_int64_t)pReader->pMemory->nSize - pReader->nPosition;
+	if (nLeft <= 0)
+	{
+		return 0;
+	}
+	*buffer = pReader->pMemory->pData + pReader->nPosition;
+	pReader->nPosition += nLeft;
+	return (la_ssize_t)nLeft;
+}
+
+static la_int64_t archive_memory_skip(struct archive *a, void *client_data, la_int64_t request)
+{
+	ArchiveMemoryReader *pReader = (ArchiveMemoryReader *)client_data;
+	(void)a;
+	la_int64_t nLeft = (la_int64_t)pReader->pMemory->nSize - pReader->nPosition;
+	if (request > nLeft)
+	{
+		request = nLeft;
+	}
+	pReader->nPosition += request;
+	return request;
+}
+
+static la_int64_t archive_memory_seek(struct archive *a, void *client_data, la_int64_t offset, int whence)
+{
+	ArchiveMemoryReader *pReader = (ArchiveMemoryReader *)client_data;
+	la_int64_t nSize = (la_int64_t)pReader->pMemory->nSize;
+	(void)a;
+	switch (whence)
+	{
+	case SEEK_CUR:
+		offset += pReader->nPosition;
+		break;
+	case SEEK_END:
+		offset += nSize;
+		break;
+	}
+	if (offset < 0)
+	{
+		return ARCHIVE_FATAL;
+	}
+	pReader->nPosition = offset > nSize ? nSize : offset;
+	return pReader->nPosition;
+}
+
+static int archive_memory_read_close(struct archive *a, void *client_data)
+{
+	ArchiveMemoryReader *pReader = (ArchiveMemoryReader *)client_data;
+	(void)a;
+	archive_memory_release(pReader->pMemory, RING_ARCHIVE_MEMORY_OWNER_READER);
+	free(pReader);
+	return ARCHIVE_OK;
+}
+
+/*
+ * Open reader a over pMemory. The close callback drops the pin and frees
+ * the reader state, also when opening fails.
+ */
+static int archive_memory_read_open(struct archive *a, ArchiveMemory *pMemory)
+{
+	ArchiveMemoryReader *pReader = (ArchiveMemoryReader *)calloc(1, sizeof(ArchiveMemoryReader));
+	if (!pReader)
+	{
+		archive_set_error(a, ENOMEM, "Failed to allocate memory reader");
+		return ARCHIVE_FATAL;
+	}
+	pReader->pMemory = pMemory;
+	archive_memory_attach(pMemory, RING_ARCHIVE_MEMORY_OWNER_READER);
+
+	archive_read_set_callback_data(a, pReader);
+	archive_read_set_read_callback(a, archive_memory_read);
+	archive_read_set_skip_callback(a, archive_memory_skip);
+	archive_read_set_seek_callback(a, archive_memory_seek);
+	archive_read_set_close_callback(a, archive_memory_read_close);
+	return archive_read_open1(a);
+}
+
+/*
+ * Fetch the sink from a managed archive_memory pointer or from the
+ * [pBuffer, pUsed] list returned by archive_write_open_memory().
+ */
+static ArchiveMemory *archive_memory_from_param(void *pPointer, int nParam)
+{
+	if (RING_API_ISCPOINTER(nParam))
+	{
+		return (ArchiveMemory *)RING_API_GETCPOINTER(nParam, "archive_memory");
+	}
+	if (!RING_API_ISLIST(nParam))
+	{
+		return NULL;
+	}
+	List *pList = RING_API_GETLIST(nParam);
+	if (ring_list_getsize(pList) != 2 || !ring_list_islist(pList, 1))
+	{
+		return NULL;
+	}
+	List *pBufferList = ring_list_getlist(pList, 1);
+	return (ArchiveMemory *)ring_list_getpointer(pBufferList, RING_CPOINTER_POINTER);
+}
+
+/* ============================================================================
+ * Ring Callbacks
+ * ============================================================================
+ */
+
+/*
+ * Streaming into Ring code. The C side runs cCode with ring_vm_runcode();
+ * while it runs, archive_callback_data() returns the current block and
+ * archive_callback_abort() makes the operation fail. Callbacks can nest,
+ * so the active one is saved and restored around each run.
+ */
+typedef struct ArchiveCallback
+{
+	VM *pVM;
+	char *cCode;
+	const char *pBlock;
+	size_t nBlock;
+	int lAbort;
+	/* Block handed over by archive_callback_supply() for a reader */
+	char *pSupply;
+	size_t nSupply;
+	size_t nSupplyCapacity;
+	int lSupplied;
+} ArchiveCallback;
+
+static RING_ARCHIVE_THREAD_LOCAL ArchiveCallback *g_pArchiveCallback;
+
+static ArchiveCallback *archive_callback_new(VM *pVM, const char *cCode)
+{
+	ArchiveCallback *pCallback = (ArchiveCallback *)calloc(1, sizeof(ArchiveCallback));
+	if (!pCallback)
+	{
+		return NULL;
+	}
+	pCallback->pVM = pVM;
+	pCallback->cCode = strdup(cCode);
+	if (!pCallback->cCode)
+	{
+		free(pCallback);
+		return NULL;
+	}
+	return pCallback;
+}
+
+static void archive_callback_free(ArchiveCallback *pCallback)
+{
+	if (pCallback)
+	{
+		free(pCallback->cCode);
+		free(pCallback->pSupply);
+		free(pCallback);
+	}
+}
+
+/* Run the Ring code with pBlock as the current block. Returns 0 if aborted. */
+static int archive_callback_run(ArchiveCallback *pCallback, const void *pBlock, size_t nBlock)
+{
+	ArchiveCallback *pSaved = g_pArchiveCallback;
+	pCallback->pBlock = (const char *)pBlock;
+	pCallback->nBlock = nBlock;
+	g_pArchiveCallback = pCallback;
+	ring_vm_runcode(pCallback->pVM, pCallback->cCode);
+	g_pArchiveCallback = pSaved;
+	pCallback->pBlock = NULL;
+	pCallback->nBlock = 0;
+	return !pCallback->lAbort;
+}
+
+static int archive_callback_write_open(struct archive *a, void *client_data)
+{
+	(void)client_data;
+	/* Output goes straight to the consumer: no padding of the last block */
+	if (archive_write_get_bytes_in_last_block(a) < 0)
+	{
+		archive_write_set_bytes_in_last_block(a, 1);
+	}
+	return ARCHIVE_OK;
+}
+
+static la_ssize_t archive_callback_write(struct archive *a, void *client_data, const void *buffer, size_t length)
+{
+	ArchiveCallback *pCallback = (ArchiveCallback *)client_data;
+	if (pCallback->lAbort || !archive_callback_run(pCallback, buffer, length))
+	{
+		archive_set_error(a, EIO, "Write aborted by callback");
+		return -1;
+	}
+	return (la_ssize_t)length;
+}
+
+/* An empty block tells the Ring code that the archive is complete */
+static int archive_callback_write_close(struct archive *a, void *client_data)
+{
+	ArchiveCallback *pCallback = (ArchiveCallback *)client_data;
+	if (pCallback->lAbort || !archive_callback_run(pCallback, "", 0))
+	{
+		return ARCHIVE_FATAL;
+	}
+	return ARCHIVE_OK;
+}
+
+static int archive_callback_write_free(struct archive *a, void *client_data)
+{
+	(void)a;
+	archive_callback_free((ArchiveCallback *)client_data);
+	return ARCHIVE_OK;
+}
+
+/*
+ * Ask the Ring code for the next input block. It hands the block over
+ * with archive_callback_supply(); supplying nothing, or an empty string,
+ * means end of input.
+ */
+static la_ssize_t archive_callback_read(struct archive *a, void *client_data, const void **buffer)
+{
+	ArchiveCallback *pCallback = (ArchiveCallback *)client_data;
+	pCallback->nSupply = 0;
+	pCallback->lSupplied = 0;
+	if (pCallback->lAbort || !archive_callback_run(pCallback, NULL, 0))
+	{
+		archive_set_error(a, EIO, "Read aborted by callback");
+		return -1;
+	}
+	*buffer = pCallback->pSupply;
+	return (la_ssize_t)pCallback->nSupply;
+}
+
+static int archive_callback_read_close(struct archive *a, void *client_data)
+{
+	(void)a;
+	archive_callback_free((ArchiveCallback *)client_data);
+	return ARCHIVE_OK;
+}
+
+/* ============================================================================
+ * Nested Readers
+ * ============================================================================
+ */
+
+/*
+ * Input for archive_read_open_entry(): blocks are taken straight from the
+ * outer reader's current entry without copying. Holes in sparse entries
+ * are filled with zeros.
+ */
+typedef struct ArchiveNested
+{
+	struct archive *pOuter;
+	const void *pPending;
+	size_t nPending;
+	la_int64_t nPendingOffset;
+	la_int64_t nPosition;
+} ArchiveNested;
+
+static const char g_aArchiveZeros[16 * 1024];
+
+static la_ssize_t archive_nested_read(struct archive *a, void *client_data, const void **buffer)
+{
+	ArchiveNested *pNested = (ArchiveNested *)client_data;
+
+	if (!pNested->pPending)
+	{
+		const void *pBlock;
+		size_t nBlock;
+		la_int64_t nOffset;
+		int r = archive_read_data_block(pNested->pOuter, &pBlock, &nBlock, &nOffset);
+		if (r == ARCHIVE_EOF)
+		{
+			return 0;
+		}
+		if (r < ARCHIVE_WARN)
+		{
+			archive_set_error(a, archive_errno(pNested->pOuter), "%s",
+							  archive_error_string(pNested->pOuter) ? archive_error_string(pNested->pOuter)
+																	: "Failed to read outer entry");
+			return -1;
+		}
+		pNested->pPending = pBlock;
+		pNested->nPending = nBlock;
+		pNested->nPendingOffset = nOffset;
+	}
+
+	if (pNested->nPosition < pNested->nPendingOffset)
+	{
+		la_int64_t nGap = pNested->nPendingOffset - pNested->nPosition;
+		if (nGap > (la_int64_t)sizeof(g_aArchiveZeros))
+		{
+			nGap = (la_int64_t)sizeof(g_aArchiveZeros);
+		}
+		pNested->nPosition += nGap;
+		*buffer = g_aArchiveZeros;
+		return (la_ssize_t)nGap;
+	}
+
+	*buffer = pNested->pPending;
+	pNested->nPosition += (la_int64_t)pNested->nPending;
+	pNested->pPending = NULL;
+	return (la_ssize_t)pNested->nPending;
+}
+
+static int archive_nested_close(struct archive *a, void *client_data)
+{
+	(void)a;
+	free(client_data);
+	return ARCHIVE_OK;
+}
+
+/* ============================================================================
+ * Codecs
+ * ============================================================================
+ */
+
+/*
+ * Streaming compressor/decompressor over the bundled compression libraries,
+ * independent of any archive container. Output is appended to an
+ * ArchiveMemory, so buffers come from the shared pool and an optional
+ * nMaxSize caps decompressed output.
+ */
+#define RING_ARCHIVE_CODEC_CONTINUE 0
+#define RING_ARCHIVE_CODEC_FLUSH 1
+#define RING_ARCHIVE_CODEC_FINISH 2
+
+#define RING_ARCHIVE_CODEC_CHUNK (64 * 1024)
+
+/*
+ * Trained zstd dictionary, digested once for compression (at a fixed
+ * level) and for decompression. Codecs using it hold a reference, so it
+ * outlives the Ring pointer if the garbage collector frees that first.
+ */
+typedef struct ArchiveDict
+{
+	ZSTD_CDict *pCDict;
+	ZSTD_DDict *pDDict;
+	char *pData;
+	size_t nSize;
+	int nRefs;
+} ArchiveDict;
+
+static void archive_dict_retain(ArchiveDict *pDict)
+{
+	archive_mutex_lock(&g_tArchiveRefLock);
+	pDict->nRefs++;
+	archive_mutex_unlock(&g_tArchiveRefLock);
+}
+
+static void archive_dict_release(ArchiveDict *pDict)
+{
+	if (!pDict)
+	{
+		return;
+	}
+	archive_mutex_lock(&g_tArchiveRefLock);
+	int nRefs = --pDict->nRefs;
+	archive_mutex_unlock(&g_tArchiveRefLock);
+	if (nRefs == 0)
+	{
+		ZSTD_freeCDict(pDict->pCDict);
+		ZSTD_freeDDict(pDict->pDDict);
+		free(pDict->pData);
+		free(pDict);
+	}
+}
+
+static void free_archive_dict(void *pState, void *pPointer)
+{
+	archive_dict_release((ArchiveDict *)pPointer);
+}
+
+/* nLevel < 0 creates a dictionary for decompression only */
+static ArchiveDict *archive_dict_create(const char *pData, size_t nSize, int nLevel)
+{
+	ArchiveDict *pDict = (ArchiveDict *)calloc(1, sizeof(ArchiveDict));
+	if (!pDict)
+	{
+		return NULL;
+	}
+	pDict->nRefs = 1;
+	pDict->pData = (char *)malloc(nSize ? nSize : 1);
+	if (pDict->pData)
+	{
+		memcpy(pDict->pData, pData, nSize);
+		pDict->nSize = nSize;
+		pDict->pDDict = ZSTD_createDDict(pData, nSize);
+		if (nLevel >= 0)
+		{
+			pDict->pCDict = ZSTD_createCDict(pData, nSize, nLevel ? nLevel : ZSTD_CLEVEL_DEFAULT);
+		}
+	}
+	if (!pDict->pDDict || (nLevel >= 0 && !pDict->pCDict))
+	{
+		archive_dict_release(pDict);
+		return NULL;
+	}
+	return pDict;
+}
+
+typedef struct ArchiveCodec
+{
+	int nCodec;
+	int lEncode;
+	int lDone;
+	int lFinished;
+	const char *cError;
+	z_stream zlib;
+	bz_stream bzip2;
+	lzma_stream lzma;
+	ZSTD_CCtx *pZstdC;
+	ZSTD_DCtx *pZstdD;
+	LZ4F_cctx *pLz4C;
+	LZ4F_dctx *pLz4D;
+	LZ4F_preferences_t lz4Prefs;
+	int lLz4Started;
+	BrotliEncoderState *pBrotliE;
+	BrotliDecoderState *pBrotliD;
+	ArchiveDict *pDict;
+} ArchiveCodec;
+
+static void archive_codec_end(ArchiveCodec *pCodec)
+{
+	switch (pCodec->nCodec)
+	{
+	case RING_COMPRESSION_GZIP:
+		if (pCodec->lEncode)
+			deflateEnd(&pCodec->zlib);
+		else
+			inflateEnd(&pCodec->zlib);
+		break;
+	case RING_COMPRESSION_BZIP2:
+		if (pCodec->lEncode)
+			BZ2_bzCompressEnd(&pCodec->bzip2);
+		else
+			BZ2_bzDecompressEnd(&pCodec->bzip2);
+		break;
+	case RING_COMPRESSION_XZ:
+	case RING_COMPRESSION_LZMA:
+		lzma_end(&pCodec->lzma);
+		break;
+	case RING_COMPRESSION_ZSTD:
+		ZSTD_freeCCtx(pCodec->pZstdC);
+		ZSTD_freeDCtx(pCodec->pZstdD);
+		break;
+	case RING_COMPRESSION_LZ4:
+		if (pCodec->pLz4C)
+			LZ4F_freeCompressionContext(pCodec->pLz4C);
+		if (pCodec->pLz4D)
+			LZ4F_freeDecompressionContext(pCodec->pLz4D);
+		break;
+	case RING_COMPRESSION_BROTLI:
+		if (pCodec->pBrotliE)
+			BrotliEncoderDestroyInstance(pCodec->pBrotliE);
+		if (pCodec->pBrotliD)
+			BrotliDecoderDestroyInstance(pCodec->pBrotliD);
+		break;
+	}
+	archive_dict_release(pCodec->pDict);
+	memset(pCodec, 0, sizeof(ArchiveCodec));
+}
+
+/*
+ * Set up pCodec for nCodec (a RING_COMPRESSION_* value). nLevel < 0 picks
+ * the library default. Returns 1 on success; on failure pCodec->cError
+ * says why and nothing needs to be freed.
+ */
+static int archive_codec_init(ArchiveCodec *pCodec, int nCodec, int lEncode, int nLevel)
+{
+	int lOk = 0;
+	memset(pCodec, 0, sizeof(ArchiveCodec));
+	pCodec->nCodec = nCodec;
+	pCodec->lEncode = lEncode;
+
+	switch (nCodec)
+	{
+	case RING_COMPRESSION_NONE:
+		lOk = 1;
+		break;
+	case RING_COMPRESSION_GZIP:
+		if (lEncode)
+			lOk = deflateInit2(&pCodec->zlib, nLevel < 0 ? Z_DEFAULT_COMPRESSION : nLevel, Z_DEFLATED, 15 + 16, 8,
+							   Z_DEFAULT_STRATEGY) == Z_OK;
+		else
+			/* 15 + 32: accept both gzip and zlib headers */
+			lOk = inflateInit2(&pCodec->zlib, 15 + 32) == Z_OK;
+		break;
+	case RING_COMPRESSION_BZIP2:
+		if (lEncode)
+			lOk = BZ2_bzCompressInit(&pCodec->bzip2, nLevel < 1 ? 9 : (nLevel > 9 ? 9 : nLevel), 0, 0) == BZ_OK;
+		else
+			lOk = BZ2_bzDecompressInit(&pCodec->bzip2, 0, 0) == BZ_OK;
+		break;
+	case RING_COMPRESSION_XZ:
+	{
+		lzma_stream init = LZMA_STREAM_INIT;
+		pCodec->lzma = init;
+		if (lEncode)
+			lOk = lzma_easy_encoder(&pCodec->lzma, nLevel < 0 ? LZMA_PRESET_DEFAULT : (uint32_t)nLevel,
+									LZMA_CHECK_CRC64) == LZMA_OK;
+		else
+			lOk = lzma_stream_decoder(&pCodec->lzma, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+		break;
+	}
+	case RING_COMPRESSION_LZMA:
+	{
+		lzma_stream init = LZMA_STREAM_INIT;
+		pCodec->lzma = init;
+		if (lEncode)
+		{
+			lzma_options_lzma options;
+			lOk = !lzma_lzma_preset(&options, nLevel < 0 ? LZMA_PRESET_DEFAULT : (uint32_t)nLevel) &&
+				  lzma_alone_encoder(&pCodec->lzma, &options) == LZMA_OK;
+		}
+		else
+			lOk = lzma_alone_decoder(&pCodec->lzma, UINT64_MAX) == LZMA_OK;
+		break;
+	}
+	case RING_COMPRESSION_ZSTD:
+		if (lEncode)
+		{
+			pCodec->pZstdC = ZSTD_createCCtx();
+			lOk = pCodec->pZstdC != NULL;
+			if (lOk && nLevel >= 0)
+				lOk = !ZSTD_isError(ZSTD_CCtx_setParameter(pCodec->pZstdC, ZSTD_c_compressionLevel, nLevel));
+		}
+		else
+		{
+			pCodec->pZstdD = ZSTD_createDCtx();
+			lOk = pCodec->pZstdD != NULL;
+		}
+		break;
+	case RING_COMPRESSION_LZ4:
+		if (lEncode)
+		{
+			lOk = !LZ4F_isError(LZ4F_createCompressionContext(&pCodec->pLz4C, LZ4F_VERSION));
+			pCodec->lz4Prefs.compressionLevel = nLevel < 0 ? 0 : nLevel;
+			pCodec->lz4Prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+		}
+		else
+			lOk = !LZ4F_isError(LZ4F_createDecompressionContext(&pCodec->pLz4D, LZ4F_VERSION));
+		break;
+	case RING_COMPRESSION_BROTLI:
+		if (lEncode)
+		{
+			pCodec->pBrotliE = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+			lOk = pCodec->pBrotliE != NULL;
+			if (lOk && nLevel >= 0)
+				lOk = BrotliEncoderSetParameter(pCodec->pBrotliE, BROTLI_PARAM_QUALITY,
+												(uint32_t)(nLevel > BROTLI_MAX_QUALITY ? BROTLI_MAX_QUALITY : nLevel));
+		}
+		else
+		{
+			pCodec->pBrotliD = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+			lOk = pCodec->pBrotliD != NULL;
+		}
+		break;
+	default:
+		pCodec->cError = "Unknown compression codec";
+		return 0;
+	}
+
+	if (!lOk)
+	{
+		archive_codec_end(pCodec);
+		pCodec->cError = "Failed to initialize codec";
+	}
+	return lOk;
+}
+
+/*
+ * Compress or decompress with a trained dictionary. Only zstd supports
+ * them; for compression the dictionary's level replaces nLevel.
+ */
+static int archive_codec_use_dict(ArchiveCodec *pCodec, ArchiveDict *pDict)
+{
+	if (pCodec->nCodec != RING_COMPRESSION_ZSTD)
+	{
+		pCodec->cError = "Dictionaries are only supported by zstd";
+		return 0;
+	}
+	if (pCodec->lEncode && !pDict->pCDict)
+	{
+		pCodec->cError = "Dictionary can only be used for decompression";
+		return 0;
+	}
+	size_t r = pCodec->lEncode ? ZSTD_CCtx_refCDict(pCodec->pZstdC, pDict->pCDict)
+							   : ZSTD_DCtx_refDDict(pCodec->pZstdD, pDict->pDDict);
+	if (ZSTD_isError(r))
+	{
+		pCodec->cError = "Failed to load dictionary";
+		return 0;
+	}
+	archive_dict_release(pCodec->pDict);
+	archive_dict_retain(pDict);
+	pCodec->pDict = pDict;
+	return 1;
+}
+
+/*
+ * Start a new stream with the same settings (and dictionary) after the
+ * previous one was finished. Only used for zstd, where it saves
+ * reallocating the context for each of many small entries.
+ */
+static void archive_codec_reset(ArchiveCodec *pCodec)
+{
+	if (pCodec->lEncode)
+		ZSTD_CCtx_reset(pCodec->pZstdC, ZSTD_reset_session_only);
+	else
+		ZSTD_DCtx_reset(pCodec->pZstdD, ZSTD_reset_session_only);
+	pCodec->lDone = 0;
+	pCodec->lFinished = 0;
+	pCodec->cError = NULL;
+}
+
+/*
+ * Make room for more output: returns the free space at the end of pOut,
+ * or 0 if nMaxSize has been reached or memory is exhausted.
+ */
+static size_t archive_codec_space(ArchiveCodec *pCodec, ArchiveMemory *pOut, size_t nWanted)
+{
+	size_t nNeeded = pOut->nSize + nWanted;
+	if (pOut->nMaxSize && nNeeded > pOut->nMaxSize)
+	{
+		nNeeded = pOut->nMaxSize;
+	}
+	if (nNeeded <= pOut->nSize || !archive_memory_reserve(pOut, nNeeded))
+	{
+		pCodec->cError = pOut->nMaxSize && pOut->nSize >= pOut->nMaxSize ? "Output exceeds the size limit"
+																		  : "Out of memory";
+		return 0;
+	}
+	return pOut->nCapacity - pOut->nSize;
+}
+
+#define RING_ARCHIVE_CODEC_RESERVE(nWanted)                                                                          \
+	nAvail = archive_codec_space(pCodec, pOut, (nWanted));                                                             \
+	if (!nAvail)                                                                                                       \
+		return 0;                                                                                                      \
+	pNext = (unsigned char *)pOut->pData + pOut->nSize;
+
+static int archive_codec_run_zlib(ArchiveCodec *pCodec, const unsigned char *pIn, size_t nIn, int nMode,
+								  ArchiveMemory *pOut)
+{
+	z_stream *z = &pCodec->zlib;
+	size_t nAvail;
+	unsigned char *pNext;
+	int nFlush = nMode == RING_ARCHIVE_CODEC_FINISH ? Z_FINISH
+				 : nMode == RING_ARCHIVE_CODEC_FLUSH ? Z_SYNC_FLUSH
+													 : Z_NO_FLUSH;
+	z->next_in = (Bytef *)pIn;
+	z->avail_in = (uInt)nIn;
+	for (;;)
+	{
+		RING_ARCHIVE_CODEC_RESERVE(RING_ARCHIVE_CODEC_CHUNK);
+		z->next_out = pNext;
+		z->avail_out = (uInt)(nAvail > RING_ARCHIVE_CODEC_CHUNK ? RING_ARCHIVE_CODEC_CHUNK : nAvail);
+		uInt nGiven = z->avail_out;
+		int r = pCodec->lEncode ? deflate(z, nFlush) : inflate(z, Z_NO_FLUSH);
+		pOut->nSize += nGiven - z->avail_out;
+		if (r == Z_STREAM_END)
+		{
+			if (pCodec->lEncode || z->avail_in == 0)
+			{
+				pCodec->lDone = 1;
+				return 1;
+			}
+			/* Another gzip member follows */
+			inflateReset(z);
+			pCodec->lDone = 0;
+			continue;
+		}
+		if (r != Z_OK && r != Z_BUF_ERROR)
+		{
+			pCodec->cError = "Corrupt or invalid compressed data";
+			return 0;
+		}
+		if (z->avail_out != 0 && z->avail_in == 0 && !(pCodec->lEncode && nFlush == Z_FINISH))
+		{
+			return 1;
+		}
+		if (r == Z_BUF_ERROR && z->avail_out != 0)
+		{
+			return 1;
+		}
+	}
+}
+
+static int archive_codec_run_bzip2(ArchiveCodec *pCodec, const unsigned char *pIn, size_t nIn, int nMode,
+								   ArchiveMemory *pOut)
+{
+	bz_stream *bz = &pCodec->bzip2;
+	size_t nAvail;
+	unsigned char *pNext;
+	int nAction = nMode == RING_ARCHIVE_CODEC_FINISH ? BZ_FINISH
+				  : nMode == RING_ARCHIVE_CODEC_FLUSH ? BZ_FLUSH
+													  : BZ_RUN;
+	bz->next_in = (char *)pIn;
+	bz->avail_in = (unsigned int)nIn;
+	for (;;)
+	{
+		RING_ARCHIVE_CODEC_RESERVE(RING_ARCHIVE_CODEC_CHUNK);
+		bz->next_out = (char *)pNext;
+		bz->avail_out = (unsigned int)(nAvail > RING_ARCHIVE_CODEC_CHUNK ? RING_ARCHIVE_CODEC_CHUNK : nAvail);
+		unsigned int nGiven = bz->avail_out;
+		int r = pCodec->lEncode ? BZ2_bzCompress(bz, nAction) : BZ2_bzDecompress(bz);
+		pOut->nSize += nGiven - bz->avail_out;
+		if (r < 0)
+		{
+			pCodec->cError = "Corrupt or invalid compressed data";
+			return 0;
+		}
+		if (r == BZ_STREAM_END)
+		{
+			if (pCodec->lEncode || bz->avail_in == 0)
+			{
+				pCodec->lDone = 1;
+				return 1;
+			}
+			/* Another bzip2 stream follows */
+			char *pRest = bz->next_in;
+			unsigned int nRest = bz->avail_in;
+			BZ2_bzDecompressEnd(bz);
+			memset(bz, 0, sizeof(bz_stream));
+			if (BZ2_bzDecompressInit(bz, 0, 0) != BZ_OK)
+			{
+				pCodec->cError = "Failed to initialize codec";
+				return 0;
+			}
+			bz->next_in = pRest;
+			bz->avail_in = nRest;
+			pCodec->lDone = 0;
+			continue;
+		}
+		if (!pCodec->lEncode || nAction == BZ_RUN)
+		{
+			if (bz->avail_in == 0 && bz->avail_out != 0)
+				return 1;
+		}
+		else if (nAction == BZ_FLUSH && r == BZ_RUN_OK)
+		{
+			return 1;
+		}
+	}
+}
+
+static int archive_codec_run_lzma(ArchiveCodec *pCodec, const unsigned char *pIn, size_t nIn, int nMode,
+								  ArchiveMemory *pOut)
+{
+	lzma_stream *s = &pCodec->lzma;
+	size_t nAvail;
+	unsigned char *pNext;
+	lzma_action nAction = LZMA_RUN;
+	if (nMode == RING_ARCHIVE_CODEC_FINISH)
+		nAction = LZMA_FINISH;
+	else if (nMode == RING_ARCHIVE_CODEC_FLUSH && pCodec->lEncode && pCodec->nCodec == RING_COMPRESSION_XZ)
+		/* The legacy .lzma format has no flush marker */
+		nAction = LZMA_SYNC_FLUSH;
+
+	s->next_in = pIn;
+	s->avail_in = nIn;
+	for (;;)
+	{
+		RING_ARCHIVE_CODEC_RESERVE(RING_ARCHIVE_CODEC_CHUNK);
+		s->next_out = pNext;
+		s->avail_out = nAvail;
+		lzma_ret r = lzma_code(s, nAction);
+		pOut->nSize += nAvail - s->avail_out;
+		if (r == LZMA_STREAM_END)
+		{
+			if (nAction == LZMA_SYNC_FLUSH)
+				return 1;
+			pCodec->lDone = 1;
+			return 1;
+		}
+		if (r == LZMA_BUF_ERROR && nAction != LZMA_FINISH)
+		{
+			return 1;
+		}
+		if (r != LZMA_OK)
+		{
+			pCodec->cError = r == LZMA_BUF_ERROR ? "Truncated compressed data" : "Corrupt or invalid compressed data";
+			return 0;
+		}
+		if (nAction == LZMA_RUN && s->avail_in == 0 && s->avail_out != 0)
+		{
+			return 1;
+		}
+	}
+}
+
+static int archive_codec_run_zstd(ArchiveCodec *pCodec, const unsigned char *pIn, size_t nIn, int nMode,
+								  ArchiveMemory *pOut)
+{
+	size_t nAvail;
+	unsigned char *pNext;
+	ZSTD_inBuffer in = {pIn, nIn, 0};
+	ZSTD_EndDirective nOp = nMode == RING_ARCHIVE_CODEC_FINISH ? ZSTD_e_end
+							: nMode == RING_ARCHIVE_CODEC_FLUSH ? ZSTD_e_flush
+																: ZSTD_e_continue;
+	for (;;)
+	{
+		RING_ARCHIVE_CODEC_RESERVE(pCodec->lEncode ? ZSTD_CStreamOutSize() : ZSTD_DStreamOutSize());
+		ZSTD_outBuffer out = {pNext, nAvail, 0};
+		size_t r = pCodec->lEncode ? ZSTD_compressStream2(pCodec->pZstdC, &out, &in, nOp)
+								   : ZSTD_decompressStream(pCodec->pZstdD, &out, &in);
+		pOut->nSize += out.pos;
+		if (ZSTD_isError(r))
+		{
+			pCodec->cError = ZSTD_getErrorName(r);
+			return 0;
+		}
+		if (pCodec->lEncode)
+		{
+			if (nOp == ZSTD_e_continue ? in.pos == in.size : r == 0)
+			{
+				pCodec->lDone = nOp == ZSTD_e_end;
+				return 1;
+			}
+		}
+		else
+		{
+			/* r == 0: a frame ended and everything has been flushed */
+			pCodec->lDone = r == 0;
+			if (in.pos == in.size && out.pos < out.size)
+				return 1;
+		}
+	}
+}
+
+static int archive_codec_run_lz4(ArchiveCodec *pCodec, const unsigned char *pIn, size_t nIn, int nMode,
+								 ArchiveMemory *pOut)
+{
+	size_t nAvail;
+	unsigned char *pNext;
+
+	if (!pCodec->lEncode)
+	{
+		size_t nPos = 0;
+		for (;;)
+		{
+			RING_ARCHIVE_CODEC_RESERVE(RING_ARCHIVE_CODEC_CHUNK);
+			size_t nDst = nAvail;
+			size_t nSrc = nIn - nPos;
+			size_t r = LZ4F_decompress(pCodec->pLz4D, pNext, &nDst, pIn + nPos, &nSrc, NULL);
+			if (LZ4F_isError(r))
+			{
+				pCodec->cError = LZ4F_getErrorName(r);
+				return 0;
+			}
+			pOut->nSize += nDst;
+			nPos += nSrc;
+			pCodec->lDone = r == 0;
+			if (nPos == nIn && nDst < nAvail)
+				return 1;
+		}
+	}
+
+	if (!pCodec->lLz4Started)
+	{
+		RING_ARCHIVE_CODEC_RESERVE(LZ4F_HEADER_SIZE_MAX);
+		size_t r = LZ4F_compressBegin(pCodec->pLz4C, pNext, nAvail, &pCodec->lz4Prefs);
+		if (LZ4F_isError(r))
+		{
+			pCodec->cError = LZ4F_getErrorName(r);
+			return 0;
+		}
+		pOut->nSize += r;
+		pCodec->lLz4Started = 1;
+	}
+
+	size_t nPos = 0;
+	while (nPos < nIn)
+	{
+		size_t nChunk = nIn - nPos > RING_ARCHIVE_CODEC_CHUNK ? RING_ARCHIVE_CODEC_CHUNK : nIn - nPos;
+		RING_ARCHIVE_CODEC_RESERVE(LZ4F_compressBound(nChunk, &pCodec->lz4Prefs));
+		size_t r = LZ4F_compressUpdate(pCodec->pLz4C, pNext, nAvail, pIn + nPos, nChunk, NULL);
+		if (LZ4F_isError(r))
+		{
+			pCodec->cError = LZ4F_getErrorName(r);
+			return 0;
+		}
+		pOut->nSize += r;
+		nPos += nChunk;
+	}
+
+	if (nMode != RING_ARCHIVE_CODEC_CONTINUE)
+	{
+		RING_ARCHIVE_CODEC_RESERVE(LZ4F_compressBound(0, &pCodec->lz4Prefs));
+		size_t r = nMode == RING_ARCHIVE_CODEC_FINISH ? LZ4F_compressEnd(pCodec->pLz4C, pNext, nAvail, NULL)
+													  : LZ4F_flush(pCodec->pLz4C, pNext, nAvail, NULL);
+		if (LZ4F_isError(r))
+		{
+			pCodec->cError = LZ4F_getErrorName(r);
+			return 0;
+		}
+		pOut->nSize += r;
+		pCodec->lDone = nMode == RING_ARCHIVE_CODEC_FINISH;
+	}
+	return 1;
+}
+
+static int archive_codec_run_brotli(ArchiveCodec *pCodec, const unsigned char *pIn, size_t nIn, int nMode,
+									ArchiveMemory *pOut)
+{
+	size_t nAvail;
+	unsigned char *pNext;
+	const uint8_t *pNextIn = pIn;
+	size_t nAvailIn = nIn;
+
+	if (!pCodec->lEncode)
+	{
+		for (;;)
+		{
+			RING_ARCHIVE_CODEC_RESERVE(RING_ARCHIVE_CODEC_CHUNK);
+			size_t nAvailOut = nAvail;
+			BrotliDecoderResult r = BrotliDecoderDecompressStream(pCodec->pBrotliD, &nAvailIn, &pNextIn, &nAvailOut,
+																  &pNext, NULL);
+			pOut->nSize += nAvail - nAvailOut;
+			if (r == BROTLI_DECODER_RESULT_ERROR)
+			{
+				pCodec->cError = BrotliDecoderErrorString(BrotliDecoderGetErrorCode(pCodec->pBrotliD));
+				return 0;
+			}
+			if (r == BROTLI_DECODER_RESULT_SUCCESS)
+			{
+				pCodec->lDone = 1;
+				return 1;
+			}
+			/* Input can run out while decoded bytes are still pending */
+			if (r == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT && !BrotliDecoderHasMoreOutput(pCodec->pBrotliD))
+				return 1;
+		}
+	}
+
+	BrotliEncoderOperation nOp = nMode == RING_ARCHIVE_CODEC_FINISH ? BROTLI_OPERATION_FINISH
+								 : nMode == RING_ARCHIVE_CODEC_FLUSH ? BROTLI_OPERATION_FLUSH
+																	 : BROTLI_OPERATION_PROCESS;
+	for (;;)
+	{
+		RING_ARCHIVE_CODEC_RESERVE(RING_ARCHIVE_CODEC_CHUNK);
+		size_t nAvailOut = nAvail;
+		if (!BrotliEncoderCompressStream(pCodec->pBrotliE, nOp, &nAvailIn, &pNextIn, &nAvailOut, &pNext, NULL))
+		{
+			pCodec->cError = "Brotli compression failed";
+			return 0;
+		}
+		pOut->nSize += nAvail - nAvailOut;
+		if (nAvailIn == 0 && !BrotliEncoderHasMoreOutput(pCodec->pBrotliE))
+		{
+			if (nOp != BROTLI_OPERATION_FINISH || BrotliEncoderIsFinished(pCodec->pBrotliE))
+			{
+				pCodec->lDone = nOp == BROTLI_OPERATION_FINISH;
+				return 1;
+			}
+		}
+	}
+}
+
+#undef RING_ARCHIVE_CODEC_RESERVE
+
+static int archive_codec_step(ArchiveCodec *pCodec, const void *pIn, size_t nIn, int nMode, ArchiveMemory *pOut)
+{
+	const unsigned char *pBytes = (const unsigned char *)pIn;
+	switch (pCodec->nCodec)
+	{
+	case RING_COMPRESSION_GZIP:
+		return archive_codec_run_zlib(pCodec, pBytes, nIn, nMode, pOut);
+	case RING_COMPRESSION_BZIP2:
+		return archive_codec_run_bzip2(pCodec, pBytes, nIn, nMode, pOut);
+	case RING_COMPRESSION_XZ:
+	case RING_COMPRESSION_LZMA:
+		return archive_codec_run_lzma(pCodec, pBytes, nIn, nMode, pOut);
+	case RING_COMPRESSION_ZSTD:
+		return archive_codec_run_zstd(pCodec, pBytes, nIn, nMode, pOut);
+	case RING_COMPRESSION_LZ4:
+		return archive_codec_run_lz4(pCodec, pBytes, nIn, nMode, pOut);
+	case RING_COMPRESSION_BROTLI:
+		return archive_codec_run_brotli(pCodec, pBytes, nIn, nMode, pOut);
+	}
+
+	/* RING_COMPRESSION_NONE */
+	pCodec->lDone = 1;
+	if (nIn && archive_codec_space(pCodec, pOut, nIn) < nIn)
+	{
+		if (!pCodec->cError)
+		{
+			pCodec->cError = "Output exceeds the size limit";
+		}
+		return 0;
+	}
+	if (nIn)
+	{
+		memcpy(pOut->pData + pOut->nSize, pIn, nIn);
+		pOut->nSize += nIn;
+	}
+	return 1;
+}
+
+/*
+ * Feed nIn bytes through pCodec and append the result to pOut. With
+ * RING_ARCHIVE_CODEC_FLUSH all pending output is emitted; with
+ * RING_ARCHIVE_CODEC_FINISH the stream is completed (for decoders: checked
+ * to be complete) and the codec cannot be fed again.
+ */
+static int archive_codec_run(ArchiveCodec *pCodec, const void *pIn, size_t nIn, int nMode, ArchiveMemory *pOut)
+{
+	if (pCodec->lFinished)
+	{
+		pCodec->cError = "Stream is already finished";
+		return 0;
+	}
+
+	/* A decoder past the end of its data has nothing left to do, and some
+	 * libraries reject further calls */
+	int lOk = (!pCodec->lEncode && pCodec->lDone && nIn == 0) ? 1 : archive_codec_step(pCodec, pIn, nIn, nMode, pOut);
+
+	if (lOk && nMode == RING_ARCHIVE_CODEC_FINISH)
+	{
+		pCodec->lFinished = 1;
+		if (!pCodec->lDone)
+		{
+			pCodec->cError = "Truncated compressed data";
+			lOk = 0;
+		}
+	}
+	return lOk;
+}
+
+/*
+ * Incremental codec handed to Ring by archive_compressor_new() and
+ * archive_decompressor_new(). The codec keeps its state between calls and
+ * each call's output is built in the same pooled buffer; a buffer that grew
+ * past RING_ARCHIVE_STREAM_KEEP is handed back so one large chunk does not
+ * pin the memory for the life of the stream. nMaxSize limits the total
+ * output of a decompressor.
+ */
+#define RING_ARCHIVE_STREAM_KEEP (1024 * 1024)
+
+typedef struct ArchiveStream
+{
+	ArchiveCodec codec;
+	ArchiveMemory out;
+	size_t nMaxSize;
+	size_t nTotalOut;
+	int lDone;
+	int lClosed;
+	const char *cError;
+} ArchiveStream;
+
+static void archive_stream_close(ArchiveStream *pStream)
+{
+	if (!pStream->lClosed)
+	{
+		pStream->lDone = pStream->codec.lDone;
+		archive_codec_end(&pStream->codec);
+		pStream->lClosed = 1;
+	}
+}
+
+static void free_archive_stream(void *pState, void *pPointer)
+{
+	ArchiveStream *pStream = (ArchiveStream *)pPointer;
+	if (pStream)
+	{
+		archive_stream_close(pStream);
+		archive_memory_clear(&pStream->out);
+		free(pStream);
+	}
+}
+
+/*
+ * Run nIn bytes through pStream. On success the output is left in
+ * pStream->out; once the stream is finished or has failed its codec state
+ * is freed and further calls fail.
+ */
+static int archive_stream_run(ArchiveStream *pStream, const char *pIn, size_t nIn, int nMode)
+{
+	if (pStream->lClosed)
+	{
+		if (!pStream->cError)
+		{
+			pStream->cError = "Stream is already finished";
+		}
+		return 0;
+	}
+
+	pStream->out.nSize = 0;
+	pStream->out.nMaxSize = 0;
+	if (pStream->nMaxSize)
+	{
+		/* With nothing left a 1-byte limit still lets calls that produce
+		 * no output through; any output at all is caught below */
+		size_t nLeft = pStream->nMaxSize - pStream->nTotalOut;
+		pStream->out.nMaxSize = nLeft ? nLeft : 1;
+	}
+
+	int lOk = archive_codec_run(&pStream->codec, pIn, nIn, nMode, &pStream->out);
+	if (lOk && pStream->nMaxSize && pStream->nTotalOut + pStream->out.nSize > pStream->nMaxSize)
+	{
+		pStream->codec.cError = "Output exceeds the size limit";
+		lOk = 0;
+	}
+	if (!lOk)
+	{
+		pStream->cError = pStream->codec.cError;
+		archive_stream_close(pStream);
+		return 0;
+	}
+	pStream->nTotalOut += pStream->out.nSize;
+	if (nMode == RING_ARCHIVE_CODEC_FINISH)
+	{
+		archive_stream_close(pStream);
+	}
+	return 1;
+}
+
+/* ============================================================================
+ * Parallel Decoding
+ * ============================================================================
+ */
+
+/*
+ * xz files written in several blocks (xz -T) and zstd files made of several
+ * frames (pzstd, concatenated .zst files) are built from segments that
+ * decode independently. archive_read_open_path() locates the segments up
+ * front, from the index of an xz stream or by walking the zstd frame and
+ * block headers. It then feeds the reader through a read callback that
+ * keeps the next few segments decoding on the worker pool and hands them
+ * over in order. libarchive sees an uncompressed archive, so the filter
+ * found here is recorded per handle for archive_filter_name().
+ *
+ * Other input, single-segment files, segments larger than
+ * RING_ARCHIVE_SEGMENT_MAX, zstd frames that do not record their content
+ * size and a pool of one thread use libarchive's own filters.
+ */
+#define RING_ARCHIVE_SEGMENT_MAX (256 * 1024 * 1024)
+#define RING_ARCHIVE_SEGMENT_WINDOW (512 * 1024 * 1024)
+#define RING_ARCHIVE_ZSTD_HEADER_MAX 18
+
+typedef struct ArchiveSegment
+{
+	la_int64_t nOffset;
+	size_t nPacked;
+	size_t nSize;
+} ArchiveSegment;
+
+typedef struct ArchiveParallelRead ArchiveParallelRead;
+
+typedef struct ArchiveParallelSlot
+{
+	ArchiveParallelRead *pRead;
+	unsigned char *pPacked;
+	size_t nPacked;
+	size_t nExpected;
+	ArchiveMemory out;
+	int lReady;
+	int lFailed;
+} ArchiveParallelSlot;
+
+struct ArchiveParallelRead
+{
+	int fd;
+	int nCodec;
+	lzma_check nCheck;
+	ArchiveSegment *aSegments;
+	int nSegments;
+	int nSubmitted;
+	int nDelivered;
+	int nWindow;
+	ArchiveParallelSlot *aSlots;
+	ArchiveMutex mutex;
+	ArchiveCond ready;
+	ArchiveTaskGroup group;
+};
+
+static int archive_read_at(int fd, la_int64_t nOffset, void *pBuffer, size_t nSize)
+{
+	if (lseek(fd, nOffset, SEEK_SET) != nOffset)
+	{
+		return 0;
+	}
+	size_t nDone = 0;
+	while (nDone < nSize)
+	{
+		ssize_t len = read(fd, (char *)pBuffer + nDone, (unsigned int)(nSize - nDone));
+		if (len <= 0)
+		{
+			return 0;
+		}
+		nDone += (size_t)len;
+	}
+	return 1;
+}
+
+static int archive_segment_add(ArchiveSegment **paSegments, int *pCount, int *pCapacity, la_int64_t nOffset,
+							   size_t nPacked, size_t nSize)
+{
+	if (*pCount == *pCapacity)
+	{
+		int nCapacity = *pCapacity ? *pCapacity * 2 : 64;
+		ArchiveSegment *aSegments = (ArchiveSegment *)realloc(*paSegments, sizeof(ArchiveSegment) * nCapacity);
+		if (!aSegments)
+		{
+			return 0;
+		}
+		*paSegments = aSegments;
+		*pCapacity = nCapacity;
+	}
+	ArchiveSegment *pSegment = &(*paSegments)[(*pCount)++];
+	pSegment->nOffset = nOffset;
+	pSegment->nPacked = nPacked;
+	pSegment->nSize = nSize;
+	return 1;
+}
+
+/* Blocks of a single-stream xz file, from the index at its end */
+static int archive_xz_segments(int fd, la_int64_t nFileSize, ArchiveSegment **paSegments, lzma_check *pCheck)
+{
+	uint8_t aHeader[LZMA_STREAM_HEADER_SIZE];
+	uint8_t aFooter[LZMA_STREAM_HEADER_SIZE];
+	lzma_stream_flags header;
+	lzma_stream_flags footer;
+	if (nFileSize < 2 * LZMA_STREAM_HEADER_SIZE || !archive_read_at(fd, 0, aHeader, sizeof(aHeader)) ||
+		!archive_read_at(fd, nFileSize - LZMA_STREAM_HEADER_SIZE, aFooter, sizeof(aFooter)) ||
+		lzma_stream_header_decode(&header, aHeader) != LZMA_OK ||
+		lzma_stream_footer_decode(&footer, aFooter) != LZMA_OK || lzma_stream_flags_compare(&header, &footer) != LZMA_OK ||
+		footer.backward_size > (lzma_vli)(nFileSize - 2 * LZMA_STREAM_HEADER_SIZE))
+	{
+		return 0;
+	}
+
+	size_t nIndexSize = (size_t)footer.backward_size;
+	uint8_t *pIndexData = (uint8_t *)malloc(nIndexSize);
+	lzma_index *pIndex = NULL;
+	uint64_t nMemLimit = UINT64_MAX;
+	size_t nPos = 0;
+	int lOk = pIndexData &&
+			  archive_read_at(fd, nFileSize - LZMA_STREAM_HEADER_SIZE - (la_int64_t)nIndexSize, pIndexData, nIndexSize) &&
+			  lzma_index_buffer_decode(&pIndex, &nMemLimit, NULL, pIndexData, &nPos, nIndexSize) == LZMA_OK;
+	free(pIndexData);
+	if (!lOk)
+	{
+		return 0;
+	}
+
+	/* Concatenated streams and stream padding are left to libarchive */
+	int nCount = 0;
+	int nCapacity = 0;
+	if (lzma_index_stream_flags(pIndex, &footer) == LZMA_OK && lzma_index_file_size(pIndex) == (lzma_vli)nFileSize &&
+		lzma_index_block_count(pIndex) >= 2)
+	{
+		lzma_index_iter iter;
+		lzma_index_iter_init(&iter, pIndex);
+		while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK))
+		{
+			if (iter.block.total_size > RING_ARCHIVE_SEGMENT_MAX ||
+				iter.block.uncompressed_size > RING_ARCHIVE_SEGMENT_MAX ||
+				!archive_segment_add(paSegments, &nCount, &nCapacity, (la_int64_t)iter.block.compressed_file_offset,
+									 (size_t)iter.block.total_size, (size_t)iter.block.uncompressed_size))
+			{
+				nCount = 0;
+				break;
+			}
+		}
+		*pCheck = footer.check;
+	}
+	lzma_index_end(pIndex, NULL);
+	return nCount;
+}
+
+/*
+ * Frames of a zstd file, found by walking the block headers without
+ * decoding. Gives up as soon as one frame exceeds RING_ARCHIVE_SEGMENT_MAX
+ * or does not record its content size (streamed output), which also keeps
+ * the walk short for the usual single-frame file.
+ */
+static int archive_zstd_segments(int fd, la_int64_t nFileSize, ArchiveSegment **paSegments)
+{
+	static const int aDictIdSize[4] = {0, 1, 2, 4};
+	int nCount = 0;
+	int nCapacity = 0;
+	la_int64_t nPos = 0;
+
+	while (nPos < nFileSize)
+	{
+		unsigned char aHead[RING_ARCHIVE_ZSTD_HEADER_MAX];
+		size_t nHead = nFileSize - nPos < RING_ARCHIVE_ZSTD_HEADER_MAX ? (size_t)(nFileSize - nPos)
+																	   : RING_ARCHIVE_ZSTD_HEADER_MAX;
+		if (nHead < 8 || !archive_read_at(fd, nPos, aHead, nHead))
+		{
+			return 0;
+		}
+		unsigned int nMagic = archive_le32(aHead);
+		if ((nMagic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START)
+		{
+			nPos += 8 + (la_int64_t)archive_le32(aHead + 4);
+			continue;
+		}
+		if (nMagic != ZSTD_MAGICNUMBER)
+		{
+			return 0;
+		}
+
+		/* Frame header: descriptor, window, dictionary id, content size */
+		unsigned char nDescriptor = aHead[4];
+		int lSingleSegment = (nDescriptor >> 5) & 1;
+		int aContentSize[4] = {lSingleSegment, 2, 4, 8};
+		size_t nHeader = 5 + !lSingleSegment + aDictIdSize[nDescriptor & 3] + aContentSize[nDescriptor >> 6];
+		unsigned long long nContent = nHeader <= nHead ? ZSTD_getFrameContentSize(aHead, nHeader) : ZSTD_CONTENTSIZE_ERROR;
+		if (nContent == ZSTD_CONTENTSIZE_ERROR || nContent == ZSTD_CONTENTSIZE_UNKNOWN ||
+			nContent > RING_ARCHIVE_SEGMENT_MAX)
+		{
+			return 0;
+		}
+
+		la_int64_t nEnd = nPos + (la_int64_t)nHeader;
+		for (;;)
+		{
+			unsigned char aBlock[3];
+			if (nEnd - nPos > RING_ARCHIVE_SEGMENT_MAX || !archive_read_at(fd, nEnd, aBlock, 3))
+			{
+				return 0;
+			}
+			unsigned int nBlock = aBlock[0] | (aBlock[1] << 8) | (aBlock[2] << 16);
+			int nType = (nBlock >> 1) & 3;
+			if (nType == 3)
+			{
+				return 0;
+			}
+			/* RLE blocks store one byte */
+			nEnd += 3 + (nType == 1 ? 1 : (la_int64_t)(nBlock >> 3));
+			if (nBlock & 1)
+			{
+				break;
+			}
+		}
+		if ((nDescriptor >> 2) & 1)
+		{
+			nEnd += 4;
+		}
+		if (nEnd > nFileSize ||
+			!archive_segment_add(paSegments, &nCount, &nCapacity, nPos, (size_t)(nEnd - nPos),
+								 (size_t)nContent))
+		{
+			return 0;
+		}
+		nPos = nEnd;
+	}
+	return nCount;
+}
+
+static int archive_segment_decode(ArchiveParallelSlot *pSlot)
+{
+	ArchiveMemory *pOut = &pSlot->out;
+	pOut->nMaxSize = RING_ARCHIVE_SEGMENT_MAX;
+	if (!archive_memory_reserve(pOut, pSlot->nExpected ? pSlot->nExpected : 1))
+	{
+		return 0;
+	}
+
+	if (pSlot->pRead->nCodec == RING_COMPRESSION_ZSTD)
+	{
+		ArchiveCodec codec;
+		if (!archive_codec_init(&codec, RING_COMPRESSION_ZSTD, 0, 0))
+		{
+			return 0;
+		}
+		int lOk = archive_codec_run(&codec, pSlot->pPacked, pSlot->nPacked, RING_ARCHIVE_CODEC_FINISH, pOut);
+		archive_codec_end(&codec);
+		return lOk && pOut->nSize == pSlot->nExpected;
+	}
+
+	lzma_filter aFilters[LZMA_FILTERS_MAX + 1];
+	lzma_block block;
+	memset(&block, 0, sizeof(block));
+	block.version = 0;
+	block.check = pSlot->pRead->nCheck;
+	block.filters = aFilters;
+	block.header_size = lzma_block_header_size_decode(pSlot->pPacked[0]);
+	if (block.header_size > pSlot->nPacked || lzma_block_header_decode(&block, NULL, pSlot->pPacked) != LZMA_OK)
+	{
+		return 0;
+	}
+	size_t nInPos = block.header_size;
+	size_t nOutPos = 0;
+	lzma_ret r = lzma_block_buffer_decode(&block, NULL, pSlot->pPacked, &nInPos, pSlot->nPacked,
+										  (uint8_t *)pOut->pData, &nOutPos, pSlot->nExpected);
+	for (int i = 0; aFilters[i].id != LZMA_VLI_UNKNOWN; i++)
+	{
+		free(aFilters[i].options);
+	}
+	pOut->nSize = nOutPos;
+	return r == LZMA_OK && nOutPos == pSlot->nExpected;
+}
+
+static void archive_segment_task(void *pArg)
+{
+	ArchiveParallelSlot *pSlot = (ArchiveParallelSlot *)pArg;
+	int lOk = archive_segment_decode(pSlot);
+	free(pSlot->pPacked);
+	pSlot->pPacked = NULL;
+
+	ArchiveParallelRead *pRead = pSlot->pRead;
+	archive_mutex_lock(&pRead->mutex);
+	pSlot->lFailed = !lOk;
+	pSlot->lReady = 1;
+	archive_cond_broadcast(&pRead->ready);
+	archive_mutex_unlock(&pRead->mutex);
+}
+
+/* Read the next segment and queue it for decoding */
+static int archive_segment_submit(ArchiveParallelRead *pRead)
+{
+	ArchiveSegment *pSegment = &pRead->aSegments[pRead->nSubmitted];
+	ArchiveParallelSlot *pSlot = &pRead->aSlots[pRead->nSubmitted % pRead->nWindow];
+	pSlot->pPacked = (unsigned char *)malloc(pSegment->nPacked ? pSegment->nPacked : 1);
+	if (!pSlot->pPacked || !archive_read_at(pRead->fd, pSegment->nOffset, pSlot->pPacked, pSegment->nPacked))
+	{
+		free(pSlot->pPacked);
+		pSlot->pPacked = NULL;
+		return 0;
+	}
+	pSlot->nPacked = pSegment->nPacked;
+	pSlot->nExpected = pSegment->nSize;
+	pSlot->lReady = 0;
+	pSlot->lFailed = 0;
+	pRead->nSubmitted++;
+	if (!archive_task_submit(archive_segment_task, pSlot, &pRead->group))
+	{
+		archive_segment_task(pSlot);
+	}
+	return 1;
+}
+
+/*
+ * Readers decoding in parallel, keyed by handle address, so that
+ * archive_filter_name() can report the filter libarchive never saw.
+ * g_nArchiveParallelReads lets other handles skip the lookup.
+ */
+static ArchiveMap g_tArchiveParallelReads;
+static ArchiveMutex g_tArchiveParallelLock = RING_ARCHIVE_MUTEX_INIT;
+static volatile int g_nArchiveParallelReads;
+
+static void archive_parallel_track(struct archive *a, ArchiveParallelRead *pRead)
+{
+	archive_mutex_lock(&g_tArchiveParallelLock);
+	if (pRead)
+	{
+		if (!g_tArchiveParallelReads.aBuckets)
+		{
+			archive_map_init(&g_tArchiveParallelReads, 16);
+		}
+		if (g_tArchiveParallelReads.aBuckets)
+		{
+			archive_map_put(&g_tArchiveParallelReads, (const char *)&a, sizeof(a), pRead);
+		}
+	}
+	else
+	{
+		archive_map_remove(&g_tArchiveParallelReads, (const char *)&a, sizeof(a));
+	}
+	g_nArchiveParallelReads = (int)g_tArchiveParallelReads.nCount;
+	archive_mutex_unlock(&g_tArchiveParallelLock);
+}
+
+/* "xz" or "zstd" if a decodes in parallel, otherwise NULL */
+static const char *archive_parallel_filter(struct archive *a)
+{
+	if (!g_nArchiveParallelReads)
+	{
+		return NULL;
+	}
+	archive_mutex_lock(&g_tArchiveParallelLock);
+	ArchiveParallelRead *pRead =
+		g_tArchiveParallelReads.aBuckets
+			? (ArchiveParallelRead *)archive_map_get(&g_tArchiveParallelReads, (const char *)&a, sizeof(a))
+			: NULL;
+	const char *cName = pRead ? (pRead->nCodec == RING_COMPRESSION_ZSTD ? "zstd" : "xz") : NULL;
+	archive_mutex_unlock(&g_tArchiveParallelLock);
+	return cName;
+}
+
+static la_ssize_t archive_parallel_read(struct archive *a, void *client_data, const void **buffer)
+{
+	ArchiveParallelRead *pRead = (ArchiveParallelRead *)client_data;
+	for (;;)
+	{
+		/* The previous segment has been consumed */
+		if (pRead->nDelivered > 0)
+		{
+			archive_memory_clear(&pRead->aSlots[(pRead->nDelivered - 1) % pRead->nWindow].out);
+		}
+		if (pRead->nDelivered == pRead->nSegments)
+		{
+			return 0;
+		}
+		while (pRead->nSubmitted < pRead->nSegments && pRead->nSubmitted < pRead->nDelivered + pRead->nWindow)
+		{
+			if (!archive_segment_submit(pRead))
+			{
+				archive_set_error(a, EIO, "Failed to read compressed data");
+				return ARCHIVE_FATAL;
+			}
+		}
+
+		ArchiveParallelSlot *pSlot = &pRead->aSlots[pRead->nDelivered % pRead->nWindow];
+		for (;;)
+		{
+			archive_mutex_lock(&pRead->mutex);
+			int lReady = pSlot->lReady;
+			archive_mutex_unlock(&pRead->mutex);
+			if (lReady)
+			{
+				break;
+			}
+			if (archive_workers_help(&pRead->group))
+			{
+				continue;
+			}
+			archive_mutex_lock(&pRead->mutex);
+			if (!pSlot->lReady)
+			{
+				archive_cond_wait(&pRead->ready, &pRead->mutex, RING_ARCHIVE_WORKERS_HELP_MS);
+			}
+			archive_mutex_unlock(&pRead->mutex);
+		}
+		if (pSlot->lFailed)
+		{
+			archive_set_error(a, EINVAL, "Corrupt compressed data");
+			return ARCHIVE_FATAL;
+		}
+		pRead->nDelivered++;
+
+		/* An empty segment would read as the end of input */
+		if (pSlot->out.nSize > 0)
+		{
+			*buffer = pSlot->out.pData;
+			return (la_ssize_t)pSlot->out.nSize;
+		}
+	}
+}
+
+static int archive_parallel_close(struct archive *a, void *client_data)
+{
+	ArchiveParallelRead *pRead = (ArchiveParallelRead *)client_data;
+	archive_parallel_track(a, NULL);
+	archive_group_wait(&pRead->group);
+	for (int i = 0; i < pRead->nWindow; i++)
+	{
+		free(pRead->aSlots[i].pPacked);
+		archive_memory_clear(&pRead->aSlots[i].out);
+	}
+	close(pRead->fd);
+	archive_group_destroy(&pRead->group);
+	archive_cond_destroy(&pRead->ready);
+	archive_mutex_destroy(&pRead->mutex);
+	free(pRead->aSlots);
+	free(pRead->aSegments);
+	free(pRead);
+	return ARCHIVE_OK;
+}
+
+/* Reader state for path if it is a multi-segment xz or zstd file */
+static ArchiveParallelRead *archive_parallel_open(const char *path)
+{
+	int nThreads = archive_workers_size();
+	if (nThreads < 2)
+	{
+		return NULL;
+	}
+	int fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	static const unsigned char aXzMagic[6] = {0xFD, '7', 'z', 'X', 'Z', 0x00};
+	unsigned char aMagic[6];
+	la_int64_t nFileSize = (la_int64_t)lseek(fd, 0, SEEK_END);
+	ArchiveSegment *aSegments = NULL;
+	lzma_check nCheck = LZMA_CHECK_NONE;
+	int nCodec = 0;
+	int nSegments = 0;
+	if (nFileSize > (la_int64_t)sizeof(aMagic) && archive_read_at(fd, 0, aMagic, sizeof(aMagic)))
+	{
+		unsigned int nMagic = archive_le32(aMagic);
+		if (memcmp(aMagic, aXzMagic, sizeof(aXzMagic)) == 0)
+		{
+			nCodec = RING_COMPRESSION_XZ;
+			nSegments = archive_xz_segments(fd, nFileSize, &aSegments, &nCheck);
+		}
+		else if (nMagic == ZSTD_MAGICNUMBER || (nMagic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START)
+		{
+			nCodec = RING_COMPRESSION_ZSTD;
+			nSegments = archive_zstd_segments(fd, nFileSize, &aSegments);
+		}
+	}
+
+	ArchiveParallelRead *pRead = nSegments >= 2 ? (ArchiveParallelRead *)calloc(1, sizeof(ArchiveParallelRead)) : NULL;
+	if (!pRead)
+	{
+		free(aSegments);
+		close(fd);
+		return NULL;
+	}
+
+	/* Decode ahead on every worker, within RING_ARCHIVE_SEGMENT_WINDOW */
+	size_t nLargest = 1;
+	for (int i = 0; i < nSegments; i++)
+	{
+		nLargest = aSegments[i].nSize > nLargest ? aSegments[i].nSize : nLargest;
+	}
+	int nWindow = nThreads * 2;
+	if ((size_t)nWindow > RING_ARCHIVE_SEGMENT_WINDOW / nLargest)
+	{
+		nWindow = (int)(RING_ARCHIVE_SEGMENT_WINDOW / nLargest);
+	}
+	nWindow = nWindow < 2 ? 2 : (nWindow > nSegments ? nSegments : nWindow);
+
+	pRead->aSlots = (ArchiveParallelSlot *)calloc(nWindow, sizeof(ArchiveParallelSlot));
+	if (!pRead->aSlots)
+	{
+		free(pRead);
+		free(aSegments);
+		close(fd);
+		return NULL;
+	}
+	for (int i = 0; i < nWindow; i++)
+	{
+		pRead->aSlots[i].pRead = pRead;
+	}
+	pRead->fd = fd;
+	pRead->nCodec = nCodec;
+	pRead->nCheck = nCheck;
+	pRead->aSegments = aSegments;
+	pRead->nSegments = nSegments;
+	pRead->nWindow = nWindow;
+	archive_mutex_init(&pRead->mutex);
+	archive_cond_init(&pRead->ready);
+	archive_group_init(&pRead->group);
+	return pRead;
+}
+
+/*
+ * Open path for a, decoding multi-segment xz and zstd files in parallel
+ * and everything else through archive_read_open_filename().
+ */
+static int archive_read_open_path(struct archive *a, const char *path, size_t nBlockSize)
+{
+	ArchiveParallelRead *pRead = path && *path ? archive_parallel_open(path) : NULL;
+	if (!pRead)
+	{
+		return archive_read_open_filename(a, path, nBlockSize);
+	}
+	archive_parallel_track(a, pRead);
+	archive_read_set_callback_data(a, pRead);
+	archive_read_set_read_callback(a, archive_parallel_read);
+	archive_read_set_close_callback(a, archive_parallel_close);
+	return archive_read_open1(a);
+}
+
+/* ============================================================================
+ * Dictionary Containers
+ * ============================================================================
+ */
+
+/*
+ * archive_create() with [:dictionary = pDict] stores the dictionary as
+ * the first entry and compresses every file on its own with it. The data
+ * of such an entry starts with a zstd skippable frame holding a tag and
+ * the original size, followed by the zstd frame, so it is still a valid
+ * .zst stream. archive_extract(), archive_read_file() and archive_list()
+ * undo this transparently. A first entry with the reserved name whose
+ * data lacks the zstd dictionary magic is an ordinary file.
+ */
+#define RING_ARCHIVE_DICTIONARY_PATH ".archive-dictionary"
+#define RING_ARCHIVE_DICTIONARY_MAX_SIZE (16 * 1024 * 1024)
+#define RING_ARCHIVE_DICTIONARY_MARK_SIZE 24
+#define RING_ARCHIVE_DICTIONARY_MARK_MAGIC 0x184D2A5E
+#define RING_ARCHIVE_DICTIONARY_MARK_TAG "RINGDICT"
+#define RING_ARCHIVE_ZSTD_DICT_MAGIC 0xEC30A437
+
+/*
+ * Whether entry, the nIndex-th (from 0) of its archive, may hold the
+ * dictionary: only a first regular file with the reserved name does.
+ * Its data must still start with the zstd dictionary magic, see
+ * archive_dict_load_entry(); otherwise it is an ordinary file.
+ */
+static int archive_dict_is_entry(struct archive_entry *entry, la_int64_t nIndex)
+{
+	const char *path = archive_entry_pathname(entry);
+	la_int64_t size = archive_entry_size(entry);
+	return nIndex == 0 && path && strcmp(path, RING_ARCHIVE_DICTIONARY_PATH) == 0 &&
+		   archive_entry_filetype(entry) == AE_IFREG && size >= 8 && size <= RING_ARCHIVE_DICTIONARY_MAX_SIZE;
+}
+
+static int archive_dict_has_magic(const void *data, size_t size)
+{
+	return size >= 4 && archive_le32((const unsigned char *)data) == RING_ARCHIVE_ZSTD_DICT_MAGIC;
+}
+
+/* Read the start of an archive_dict_is_entry() entry and check its magic */
+static int archive_dict_peek_magic(struct archive *a)
+{
+	unsigned char magic[4];
+	return archive_read_data(a, magic, sizeof(magic)) == (la_ssize_t)sizeof(magic) &&
+		   archive_dict_has_magic(magic, sizeof(magic));
+}
+
+static void archive_dict_set_mark(unsigned char *p, la_int64_t original)
+{
+	archive_set_le32(p, RING_ARCHIVE_DICTIONARY_MARK_MAGIC);
+	archive_set_le32(p + 4, RING_ARCHIVE_DICTIONARY_MARK_SIZE - 8);
+	memcpy(p + 8, RING_ARCHIVE_DICTIONARY_MARK_TAG, 8);
+	archive_set_le32(p + 16, (unsigned int)(original & 0xFFFFFFFF));
+	archive_set_le32(p + 20, (unsigned int)((unsigned long long)original >> 32));
+}
+
+/* Original size if head is the start of a packed entry, otherwise -1 */
+static la_int64_t archive_dict_get_mark(const unsigned char *head, la_ssize_t nHead)
+{
+	if (nHead != RING_ARCHIVE_DICTIONARY_MARK_SIZE || archive_le32(head) != RING_ARCHIVE_DICTIONARY_MARK_MAGIC ||
+		archive_le32(head + 4) != RING_ARCHIVE_DICTIONARY_MARK_SIZE - 8 ||
+		memcmp(head + 8, RING_ARCHIVE_DICTIONARY_MARK_TAG, 8) != 0)
+	{
+		return -1;
+	}
+	return (la_int64_t)(((unsigned long long)archive_le32(head + 20) << 32) | archive_le32(head + 16));
+}
+
+/*
+ * Read the start of the current entry and report its original size if it
+ * is packed (-1 otherwise). The bytes read are left in head/pHead and
+ * must be passed on to archive_dict_read_data().
+ */
+static la_int64_t archive_dict_peek(struct archive *a, struct archive_entry *entry, unsigned char *head,
+									la_ssize_t *pHead)
+{
+	*pHead = 0;
+	if (archive_entry_filetype(entry) != AE_IFREG || archive_entry_size(entry) < RING_ARCHIVE_DICTIONARY_MARK_SIZE)
+	{
+		return -1;
+	}
+	*pHead = archive_read_data(a, head, RING_ARCHIVE_DICTIONARY_MARK_SIZE);
+	if (*pHead < 0)
+	{
+		*pHead = 0;
+	}
+	return archive_dict_get_mark(head, *pHead);
+}
+
+/*
+ * Read the current entry, which passed archive_dict_is_entry(), into
+ * pData. Returns 1 if it holds a dictionary, with *ppDict set to it (NULL
+ * if it could not be loaded). Returns 0 for an ordinary file, whose bytes
+ * are left in pData since they cannot be read from a again.
+ */
+static int archive_dict_load_entry(struct archive *a, struct archive_entry *entry, ArchiveMemory *pData,
+								   ArchiveDict **ppDict)
+{
+	size_t size = (size_t)archive_entry_size(entry);
+	*ppDict = NULL;
+	pData->nSize = 0;
+	if (!archive_memory_reserve(pData, size))
+	{
+		return 0;
+	}
+	la_ssize_t got = archive_read_data(a, pData->pData, size);
+	pData->nSize = got > 0 ? (size_t)got : 0;
+	if (!archive_dict_has_magic(pData->pData, pData->nSize))
+	{
+		return 0;
+	}
+	if ((size_t)got == size)
+	{
+		*ppDict = archive_dict_create(pData->pData, size, -1);
+	}
+	return 1;
+}
+
+/* Set up pCodec to decode packed entries with pDict. Returns 1 on success. */
+static int archive_dict_open_codec(ArchiveCodec *pCodec, ArchiveDict *pDict)
+{
+	if (!archive_codec_init(pCodec, RING_COMPRESSION_ZSTD, 0, -1))
+	{
+		return 0;
+	}
+	if (!archive_codec_use_dict(pCodec, pDict))
+	{
+		archive_codec_end(pCodec);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Handle the current entry, the nIndex-th of its archive, if it may be the
+ * dictionary. Returns 1 if it is one, setting *pHasDict once pCodec is
+ * ready to decode the entries that follow. Returns 0 otherwise; *pHeld is
+ * then set if the entry's data was read into pData and must be used from
+ * there.
+ */
+static int archive_dict_open_entry(struct archive *a, struct archive_entry *entry, la_int64_t nIndex,
+								   ArchiveCodec *pCodec, int *pHasDict, ArchiveMemory *pData, int *pHeld)
+{
+	*pHeld = 0;
+	if (!archive_dict_is_entry(entry, nIndex))
+	{
+		return 0;
+	}
+	ArchiveDict *pDict;
+	if (!archive_dict_load_entry(a, entry, pData, &pDict))
+	{
+		*pHeld = 1;
+		return 0;
+	}
+	pData->nSize = 0;
+	*pHasDict = pDict && archive_dict_open_codec(pCodec, pDict);
+	archive_dict_release(pDict);
+	return 1;
+}
+
+/*
+ * Read the rest of an entry after archive_dict_peek(). Packed entries are
+ * decoded with pCodec, others are passed through. The data is collected
+ * in pOut or, with ext set, written to ext as it arrives. Fails once pJob
+ * is cancelled.
+ */
+static int archive_dict_read_data(struct archive *a, ArchiveCodec *pCodec, int lPacked, const unsigned char *head,
+								  la_ssize_t nHead, ArchiveMemory *pOut, struct archive *ext, ArchiveJob *pJob)
+{
+	char buffer[RING_ARCHIVE_CODEC_CHUNK / 4];
+	const char *pBlock = (const char *)head;
+	la_ssize_t len = nHead;
+	int lFirst = 1;
+
+	if (lPacked)
+	{
+		archive_codec_reset(pCodec);
+	}
+	for (;;)
+	{
+		int lEnd = len == 0 && !lFirst;
+		if (len > 0 && lPacked)
+		{
+			if (!archive_codec_run(pCodec, pBlock, (size_t)len, RING_ARCHIVE_CODEC_CONTINUE, pOut))
+			{
+				return 0;
+			}
+		}
+		else if (len > 0)
+		{
+			if (!archive_memory_reserve(pOut, pOut->nSize + (size_t)len))
+			{
+				return 0;
+			}
+			memcpy(pOut->pData + pOut->nSize, pBlock, (size_t)len);
+			pOut->nSize += (size_t)len;
+		}
+		if (lEnd && lPacked && !archive_codec_run(pCodec, "", 0, RING_ARCHIVE_CODEC_FINISH, pOut))
+		{
+			return 0;
+		}
+		if (ext && pOut->nSize)
+		{
+			if (archive_write_data(ext, pOut->pData, pOut->nSize) < 0)
+			{
+				return 0;
+			}
+			pOut->nSize = 0;
+		}
+		if (lEnd)
+		{
+			return 1;
+		}
+		if (archive_job_cancelled(pJob))
+		{
+			return 0;
+		}
+		len = archive_read_data(a, buffer, sizeof(buffer));
+		if (len < 0)
+		{
+			return 0;
+		}
+		pBlock = buffer;
+		lFirst = 0;
+	}
+}
+
+/*
+ * Compress a file on disk into pOut (replacing its contents), marked as
+ * packed. Returns the file size, or -1 on failure.
+ */
+static la_int64_t archive_dict_compress_file(ArchiveCodec *pCodec, const char *path, char *buffer,
+											 size_t buffer_size, ArchiveMemory *pOut)
+{
+	int fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0)
+	{
+		return -1;
+	}
+
+	archive_codec_reset(pCodec);
+	pOut->nSize = 0;
+	if (!archive_memory_reserve(pOut, RING_ARCHIVE_DICTIONARY_MARK_SIZE))
+	{
+		close(fd);
+		return -1;
+	}
+	pOut->nSize = RING_ARCHIVE_DICTIONARY_MARK_SIZE;
+
+	la_int64_t total = 0;
+	ssize_t len;
+	while ((len = read(fd, buffer, buffer_size)) > 0)
+	{
+		if (!archive_codec_run(pCodec, buffer, (size_t)len, RING_ARCHIVE_CODEC_CONTINUE, pOut))
+		{
+			close(fd);
+			return -1;
+		}
+		total += len;
+	}
+	close(fd);
+	if (len < 0 || !archive_codec_run(pCodec, "", 0, RING_ARCHIVE_CODEC_FINISH, pOut))
+	{
+		return -1;
+	}
+	archive_dict_set_mark((unsigned char *)pOut->pData, total);
+	return total;
+}
+
+/* Write the dictionary as the archive's first entry */
+static int archive_dict_write_entry(struct archive *a, ArchiveDict *pDict)
+{
+	struct archive_entry *entry = archive_entry_new();
+	archive_entry_set_pathname(entry, RING_ARCHIVE_DICTIONARY_PATH);
+	archive_entry_set_filetype(entry, AE_IFREG);
+	archive_entry_set_perm(entry, 0644);
+	archive_entry_set_size(entry, (la_int64_t)pDict->nSize);
+	archive_entry_set_mtime(entry, time(NULL), 0);
+	int ok = archive_write_header(a, entry) == ARCHIVE_OK &&
+			 archive_write_data(a, pDict->pData, pDict->nSize) == (la_ssize_t)pDict->nSize;
+	archive_entry_free(entry);
+	return ok;
+}
+
+/* ============================================================================
+ * Entry Cache
+ * ============================================================================
+ */
+
+/*
+ * Optional process-wide cache of decoded entries for archive_read_file(),
+ * off until archive_set_cache_size() gives it a byte budget. Keys are the
+ * archive's device and inode (its path where there are no inode numbers)
+ * plus the entry path; each entry remembers the archive's size and mtime
+ * and is dropped when they no longer match. The least recently used
+ * entries are evicted to stay within the budget.
+ */
+typedef struct ArchiveCacheEntry
+{
+	struct ArchiveCacheEntry *pPrev;
+	struct ArchiveCacheEntry *pNext;
+	ArchiveMapNode *pNode;
+	la_int64_t nFileSize;
+	la_int64_t nFileMtime;
+	long nFileMtimeNsec;
+	char *pData;
+	size_t nSize;
+} ArchiveCacheEntry;
+
+typedef struct ArchiveEntryCache
+{
+	ArchiveMutex mutex;
+	ArchiveMap tEntries;
+	ArchiveCacheEntry *pHead;
+	ArchiveCacheEntry *pTail;
+	size_t nBytes;
+	volatile size_t nLimit;
+	double nHits;
+	double nMisses;
+} ArchiveEntryCache;
+
+static ArchiveEntryCache g_tArchiveCache = {RING_ARCHIVE_MUTEX_INIT};
+
+static long archive_stat_mtime_nsec(const struct stat *st)
+{
+#if defined(__APPLE__)
+	return st->st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	return 0;
+#else
+	return st->st_mtim.tv_nsec;
+#endif
+}
+
+/* Cache key of an entry; free() it after use. Returns NULL on allocation failure. */
+static char *archive_cache_key(const char *cArchivePath, const struct stat *st, const char *cEntryPath,
+							   size_t nEntrySize, size_t *pKeySize)
+{
+	size_t nPrefix = st->st_ino ? sizeof(la_int64_t) * 2 : strlen(cArchivePath) + 1;
+	char *cKey = (char *)malloc(nPrefix + nEntrySize);
+	if (!cKey)
+	{
+		return NULL;
+	}
+	if (st->st_ino)
+	{
+		la_int64_t aIdentity[2] = {(la_int64_t)st->st_dev, (la_int64_t)st->st_ino};
+		memcpy(cKey, aIdentity, sizeof(aIdentity));
+	}
+	else
+	{
+		memcpy(cKey, cArchivePath, nPrefix);
+	}
+	memcpy(cKey + nPrefix, cEntryPath, nEntrySize);
+	*pKeySize = nPrefix + nEntrySize;
+	return cKey;
+}
+
+/* Charged against the budget: the data plus the bookkeeping around it */
+static size_t archive_cache_cost(size_t nSize, size_t nKeySize)
+{
+	return nSize + nKeySize + sizeof(ArchiveCacheEntry) + sizeof(ArchiveMapNode);
+}
+
+static void archive_cache_unlink(ArchiveCacheEntry *pEntry)
+{
+	if (pEntry->pPrev)
+	{
+		pEntry->pPrev->pNext = pEntry->pNext;
+	}
+	else
+	{
+		g_tArchiveCache.pHead = pEntry->pNext;
+	}
+	if (pEntry->pNext)
+	{
+		pEntry->pNext->pPrev = pEntry->pPrev;
+	}
+	else
+	{
+		g_tArchiveCache.pTail = pEntry->pPrev;
+	}
+	pEntry->pPrev = pEntry->pNext = NULL;
+}
+
+static void archive_cache_push(ArchiveCacheEntry *pEntry)
+{
+	pEntry->pNext = g_tArchiveCache.pHead;
+	if (g_tArchiveCache.pHead)
+	{
+		g_tArchiveCache.pHead->pPrev = pEntry;
+	}
+	g_tArchiveCache.pHead = pEntry;
+	if (!g_tArchiveCache.pTail)
+	{
+		g_tArchiveCache.pTail = pEntry;
+	}
+}
+
+/* Remove an entry from the cache and free it. Called with the cache locked. */
+static void archive_cache_drop(ArchiveCacheEntry *pEntry)
+{
+	archive_cache_unlink(pEntry);
+	g_tArchiveCache.nBytes -= archive_cache_cost(pEntry->nSize, pEntry->pNode->nKeySize);
+	archive_map_remove(&g_tArchiveCache.tEntries, pEntry->pNode->cKey, pEntry->pNode->nKeySize);
+	free(pEntry->pData);
+	free(pEntry);
+}
+
+/* Evict least recently used entries until the cache fits its budget. Called with the cache locked. */
+static void archive_cache_trim(void)
+{
+	while (g_tArchiveCache.pTail && g_tArchiveCache.nBytes > g_tArchiveCache.nLimit)
+	{
+		archive_cache_drop(g_tArchiveCache.pTail);
+	}
+}
+
+/*
+ * Find the entry for cKey if the archive still matches st, and mark it
+ * most recently used. Counts a hit or a miss. Called with the cache
+ * locked; the entry stays valid until it is unlocked.
+ */
+static ArchiveCacheEntry *archive_cache_find(const char *cKey, size_t nKeySize, const struct stat *st)
+{
+	ArchiveCacheEntry *pEntry =
+		g_tArchiveCache.tEntries.aBuckets ? (ArchiveCacheEntry *)archive_map_get(&g_tArchiveCache.tEntries, cKey, nKeySize)
+										  : NULL;
+	if (pEntry && (pEntry->nFileSize != (la_int64_t)st->st_size || pEntry->nFileMtime != (la_int64_t)st->st_mtime ||
+				   pEntry->nFileMtimeNsec != archive_stat_mtime_nsec(st)))
+	{
+		archive_cache_drop(pEntry);
+		pEntry = NULL;
+	}
+	if (!pEntry)
+	{
+		g_tArchiveCache.nMisses++;
+		return NULL;
+	}
+	g_tArchiveCache.nHits++;
+	archive_cache_unlink(pEntry);
+	archive_cache_push(pEntry);
+	return pEntry;
+}
+
+/* Store a copy of pData for cKey, evicting older entries to make room */
+static void archive_cache_put(const char *cKey, size_t nKeySize, const struct stat *st, const char *pData,
+							  size_t nSize)
+{
+	size_t nCost = archive_cache_cost(nSize, nKeySize);
+	if (nCost > g_tArchiveCache.nLimit)
+	{
+		return;
+	}
+	ArchiveCacheEntry *pEntry = (ArchiveCacheEntry *)calloc(1, sizeof(ArchiveCacheEntry));
+	if (!pEntry)
+	{
+		return;
+	}
+	pEntry->pData = (char *)malloc(nSize ? nSize : 1);
+	if (!pEntry->pData)
+	{
+		free(pEntry);
+		return;
+	}
+	if (nSize)
+	{
+		memcpy(pEntry->pData, pData, nSize);
+	}
+	pEntry->nSize = nSize;
+	pEntry->nFileSize = (la_int64_t)st->st_size;
+	pEntry->nFileMtime = (la_int64_t)st->st_mtime;
+	pEntry->nFileMtimeNsec = archive_stat_mtime_nsec(st);
+
+	archive_mutex_lock(&g_tArchiveCache.mutex);
+	ArchiveCacheEntry *pOld =
+		g_tArchiveCache.tEntries.aBuckets ? (ArchiveCacheEntry *)archive_map_get(&g_tArchiveCache.tEntries, cKey, nKeySize)
+										  : NULL;
+	if (pOld)
+	{
+		archive_cache_drop(pOld);
+	}
+	if (!g_tArchiveCache.tEntries.aBuckets)
+	{
+		archive_map_init(&g_tArchiveCache.tEntries, 256);
+	}
+	pEntry->pNode = g_tArchiveCache.tEntries.aBuckets && nCost <= g_tArchiveCache.nLimit
+						? archive_map_put(&g_tArchiveCache.tEntries, cKey, nKeySize, pEntry)
+						: NULL;
+	if (!pEntry->pNode)
+	{
+		archive_mutex_unlock(&g_tArchiveCache.mutex);
+		free(pEntry->pData);
+		free(pEntry);
+		return;
+	}
+	archive_cache_push(pEntry);
+	g_tArchiveCache.nBytes += nCost;
+	archive_cache_trim();
+	archive_mutex_unlock(&g_tArchiveCache.mutex);
+}
+
+/* ============================================================================
+ * Ring Functions - Archive Reading
+ * ============================================================================
+ */
+
+static void free_archive_read(void *pState, void *pPointer)
+{
+	struct archive *a = (struct archive *)pPointer;
+	if (a)
+	{
+		archive_handle_set_rate(a, NULL);
+		archive_read_free(a);
+	}
+}
+
+/*
+ * archive_read_new() -> pArchive
+ *
+ * Create a new archive reader.
+ */
+RING_FUNC(ring_archive_read_new)
+{
+	struct archive *a = archive_read_new();
+	if (!a)
+	{
+		RING_API_ERROR("Failed to create archive reader");
+		return;
+	}
+	RING_API_RETMANAGEDCPOINTER(a, "archive_read", free_archive_read);
+}
+
+/*
+ * archive_read_support_filter_all(pArchive) -> nResult
+ *
+ * Enable all decompression filters.
+ */
+RING_FUNC(ring_archive_read_support_filter_all)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+	int result = archive_read_support_filter_all(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_read_support_format_all(pArchive) -> nResult
+ *
+ * Enable all archive format support.
+ */
+RING_FUNC(ring_archive_read_support_format_all)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+	int result = archive_read_support_format_all(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_read_open_filename(pArchive, cFilename, nBlockSize) -> nResult
+ *
+ * Open an archive file for reading. Multi-segment xz and zstd files are
+ * decoded in parallel; archive_filter_name() still reports the filter.
+ */
+RING_FUNC(ring_archive_read_open_filename)
+{
+	if (RING_API_PARACOUNT != 3)
+	{
+		RING_API_ERROR(RING_API_MISS3PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+	if (!RING_API_ISNUMBER(3))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	const char *filename = RING_API_GETSTRING(2);
+	size_t block_size = (size_t)RING_API_GETNUMBER(3);
+
+	int result = archive_read_open_path(a, filename, block_size);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_read_open_memory(pArchive, cData | pMemory) -> nResult
+ *
+ * Open an archive from memory buffer for reading. Both are read in place
+ * with no copy. cData must stay alive and unchanged until the reader is
+ * closed; when it may not, pass archive_memory_from_string(cData). A
+ * pMemory buffer (from archive_memory_new() or
+ * archive_memory_from_string()) stays pinned until the reader is closed.
+ */
+RING_FUNC(ring_archive_read_open_memory)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2) && !RING_API_ISCPOINTER(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	if (RING_API_ISSTRING(2))
+	{
+		int result = archive_read_open_memory(a, RING_API_GETSTRING(2), (size_t)RING_API_GETSTRINGSIZE(2));
+		RING_API_RETNUMBER((double)result);
+		return;
+	}
+
+	ArchiveMemory *pMemory = (ArchiveMemory *)RING_API_GETCPOINTER(2, "archive_memory");
+	if (!pMemory)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+	if (archive_memory_writing(pMemory))
+	{
+		RING_API_ERROR("Close the writer before reading its memory buffer");
+		return;
+	}
+	int result = archive_memory_read_open(a, pMemory);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_read_open_fd(pArchive, nFd [, nBlockSize]) -> nResult
+ *
+ * Open an archive from an already open file descriptor such as a pipe,
+ * socket or stdin (0). The descriptor is not closed.
+ */
+RING_FUNC(ring_archive_read_open_fd)
+{
+	if (RING_API_PARACOUNT < 2 || RING_API_PARACOUNT > 3)
+	{
+		RING_API_ERROR(RING_API_BADPARACOUNT);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2) || (RING_API_PARACOUNT == 3 && !RING_API_ISNUMBER(3)))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	size_t block_size = 10240;
+	if (RING_API_PARACOUNT == 3 && RING_API_GETNUMBER(3) > 0)
+	{
+		block_size = (size_t)RING_API_GETNUMBER(3);
+	}
+
+	int result = archive_read_open_fd(a, (int)RING_API_GETNUMBER(2), block_size);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_read_open_callback(pArchive, cCode) -> nResult
+ *
+ * Open an archive whose input is pulled from Ring: cCode runs whenever
+ * more data is needed and passes the next block to
+ * archive_callback_supply(). Supplying nothing means end of input.
+ */
+RING_FUNC(ring_archive_read_open_callback)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	ArchiveCallback *pCallback = archive_callback_new((VM *)pPointer, RING_API_GETSTRING(2));
+	if (!pCallback)
+	{
+		RING_API_ERROR("Failed to allocate callback");
+		return;
+	}
+
+	/* The close callback frees pCallback, also when opening fails */
+	int result = archive_read_open(a, pCallback, NULL, archive_callback_read, archive_callback_read_close);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_callback_supply(cData)
+ *
+ * Inside a read callback: hand the next input block to the reader.
+ */
+RING_FUNC(ring_archive_callback_supply)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISSTRING(1))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	ArchiveCallback *pCallback = g_pArchiveCallback;
+	if (!pCallback)
+	{
+		RING_API_ERROR("archive_callback_supply() must be called from a read callback");
+		return;
+	}
+	if (pCallback->lSupplied)
+	{
+		RING_API_ERROR("Only one block can be supplied per callback");
+		return;
+	}
+
+	size_t size = (size_t)RING_API_GETSTRINGSIZE(1);
+	if (size > pCallback->nSupplyCapacity)
+	{
+		char *pSupply = (char *)realloc(pCallback->pSupply, size);
+		if (!pSupply)
+		{
+			RING_API_ERROR("Failed to allocate input block");
+			return;
+		}
+		pCallback->pSupply = pSupply;
+		pCallback->nSupplyCapacity = size;
+	}
+	if (size)
+	{
+		memcpy(pCallback->pSupply, RING_API_GETSTRING(1), size);
+	}
+	pCallback->nSupply = size;
+	pCallback->lSupplied = 1;
+}
+
+/*
+ * archive_read_open_entry(pOuterArchive) -> pArchive
+ *
+ * Open the outer reader's current entry as an archive of its own, e.g. a
+ * .tar.gz stored inside a .zip. Data is pulled lazily from the outer
+ * reader, so the outer reader must stay alive and must not move to its
+ * next entry while the returned reader is in use.
+ */
+RING_FUNC(ring_archive_read_open_entry)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *outer = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!outer)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	ArchiveNested *pNested = (ArchiveNested *)calloc(1, sizeof(ArchiveNested));
+	struct archive *a = archive_read_new();
+	if (!pNested || !a)
+	{
+		free(pNested);
+		if (a)
+		{
+			archive_read_free(a);
+		}
+		RING_API_ERROR("Failed to create archive reader");
+		return;
+	}
+	pNested->pOuter = outer;
+
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	/* The close callback frees pNested, also when opening fails */
+	if (archive_read_open(a, pNested, NULL, archive_nested_read, archive_nested_close) != ARCHIVE_OK)
+	{
+		char cError[256];
+		snprintf(cError, sizeof(cError), "Failed to open nested archive: %s",
+				 archive_error_string(a) ? archive_error_string(a) : "unknown error");
+		archive_read_free(a);
+		RING_API_ERROR(cError);
+		return;
+	}
+
+	RING_API_RETMANAGEDCPOINTER(a, "archive_read", free_archive_read);
+}
+
+/*
+ * archive_read_next_header(pArchive) -> pEntry or NULL
+ *
+ * Read next entry header. Returns entry pointer or NULL if no more entries.
+ */
+RING_FUNC(ring_archive_read_next_header)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry;
+	int result = archive_read_next_header(a, &entry);
+
+	if (result == ARCHIVE_OK || result == ARCHIVE_WARN)
+	{
+		archive_handle_throttle(a, 0, 1);
+		/* Entry is owned by archive, don't free it separately */
+		RING_API_RETCPOINTER(entry, "archive_entry");
+	}
+	else
+	{
+		RING_API_RETCPOINTER(NULL, "archive_entry");
+	}
+}
+
+/*
+ * archive_read_next_headers(pArchive, nCount) -> aEntries
+ *
+ * Advance over up to nCount entries, skipping their data, and return
+ * their metadata as [[pathname, size, type, mtime], ...]. Like
+ * archive_read_next_header(), rows describe the entries as stored: an
+ * archive_create() dictionary shows up as its first entry and the sizes
+ * of files packed with it are their compressed sizes, where
+ * archive_list() hides the one and reports the original sizes. Fewer rows
+ * are returned at the end of the archive and an empty list once it is
+ * exhausted or unreadable.
+ */
+RING_FUNC(ring_archive_read_next_headers)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	VM *pVM = (VM *)pPointer;
+	ArchiveListTarget target;
+	target.pRingState = pVM->pRingState;
+	target.pList = RING_API_NEWLIST;
+
+	struct archive_entry *entry;
+	int nCount = (int)RING_API_GETNUMBER(2);
+	for (int i = 0; i < nCount; i++)
+	{
+		int result = archive_read_next_header(a, &entry);
+		if (result != ARCHIVE_OK && result != ARCHIVE_WARN)
+		{
+			break;
+		}
+
+		const char *pathname = archive_entry_pathname(entry);
+		archive_list_add_row(&target, pathname ? pathname : "", archive_entry_size(entry),
+							 archive_entry_ring_type(entry), (la_int64_t)archive_entry_mtime(entry));
+		archive_read_data_skip(a);
+		archive_handle_throttle(a, 0, 1);
+	}
+
+	RING_API_RETLIST(target.pList);
+}
+
+/*
+ * archive_read_data(pArchive, nSize) -> cData
+ *
+ * Read data from current entry.
+ */
+RING_FUNC(ring_archive_read_data)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	size_t size = (size_t)RING_API_GETNUMBER(2);
+	if (size == 0)
+	{
+		return;
+	}
+
+	VM *pVM = (VM *)pPointer;
+	char *buffer = (char *)ring_state_malloc(pVM->pRingState, size);
+	if (!buffer)
+	{
+		RING_API_ERROR("Failed to allocate read buffer");
+		return;
+	}
+
+	la_ssize_t bytes_read = archive_read_data(a, buffer, size);
+	if (bytes_read < 0)
+	{
+		ring_state_free(pVM->pRingState, buffer);
+		return;
+	}
+
+	archive_handle_throttle(a, bytes_read, 0);
+	RING_API_RETSTRING2(buffer, bytes_read);
+	ring_state_free(pVM->pRingState, buffer);
+}
+
+/*
+ * archive_read_data_block(pArchive) -> aResult [cData, nOffset, nSize] or NULL
+ *
+ * Read data block from current entry. More efficient for large files.
+ */
+RING_FUNC(ring_archive_read_data_block)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	const void *buff;
+	size_t size;
+	la_int64_t offset;
+
+	int result = archive_read_data_block(a, &buff, &size, &offset);
+
+	if (result == ARCHIVE_OK)
+	{
+		archive_handle_throttle(a, (la_int64_t)size, 0);
+		VM *pVM = (VM *)pPointer;
+		List *pResultList = RING_API_NEWLIST;
+		ring_list_addstring2_gc(pVM->pRingState, pResultList, (char *)buff, size);
+		ring_list_adddouble_gc(pVM->pRingState, pResultList, (double)offset);
+		ring_list_adddouble_gc(pVM->pRingState, pResultList, (double)size);
+		RING_API_RETLIST(pResultList);
+	}
+}
+
+/*
+ * archive_read_data_skip(pArchive) -> nResult
+ *
+ * Skip data for current entry.
+ */
+RING_FUNC(ring_archive_read_data_skip)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_read_data_skip(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/* Shared body of archive_read_set_rate_limit() and archive_write_set_rate_limit() */
+static void archive_handle_rate_param(void *pPointer, const char *cType)
+{
+	if (RING_API_PARACOUNT != 2 && RING_API_PARACOUNT != 3)
+	{
+		RING_API_ERROR(RING_API_BADPARACOUNT);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2) || (RING_API_PARACOUNT == 3 && !RING_API_ISNUMBER(3)))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, cType);
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	double nBytesPerSec = RING_API_GETNUMBER(2);
+	double nFilesPerSec = RING_API_PARACOUNT == 3 ? RING_API_GETNUMBER(3) : 0;
+	ArchiveRate *pRate = archive_rate_new(nBytesPerSec, nFilesPerSec);
+	if ((nBytesPerSec > 0 || nFilesPerSec > 0) && !pRate)
+	{
+		RING_API_ERROR("Failed to allocate rate limit");
+		return;
+	}
+	if (!archive_handle_set_rate(a, pRate))
+	{
+		RING_API_ERROR("Failed to allocate rate limit");
+		return;
+	}
+	RING_API_RETNUMBER((double)ARCHIVE_OK);
+}
+
+/*
+ * archive_read_set_rate_limit(pArchive, nBytesPerSec [, nFilesPerSec]) -> nResult
+ *
+ * Slow the reader down to at most nBytesPerSec of entry data and
+ * nFilesPerSec entries; 0 means no limit for that rate. Calls that read
+ * past the limit sleep before returning.
+ */
+RING_FUNC(ring_archive_read_set_rate_limit)
+{
+	archive_handle_rate_param(pPointer, "archive_read");
+}
+
+/*
+ * archive_read_close(pArchive) -> nResult
+ *
+ * Close archive reader.
+ */
+RING_FUNC(ring_archive_read_close)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_read_close(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/* ============================================================================
+ * Ring Functions - Archive Writing
+ * ============================================================================
+ */
+
+static void free_archive_write(void *pState, void *pPointer)
+{
+	struct archive *a = (struct archive *)pPointer;
+	if (a)
+	{
+		archive_handle_set_rate(a, NULL);
+		archive_handle_set_shared(a, 0);
+		ArchiveAppend *pAppend = archive_append_take(a);
+		archive_write_free(a);
+		archive_append_free(pAppend);
+	}
+}
+
+/*
+ * archive_write_new() -> pArchive
+ *
+ * Create a new archive writer.
+ */
+RING_FUNC(ring_archive_write_new)
+{
+	struct archive *a = archive_write_new();
+	if (!a)
+	{
+		RING_API_ERROR("Failed to create archive writer");
+		return;
+	}
+	RING_API_RETMANAGEDCPOINTER(a, "archive_write", free_archive_write);
+}
+
+/*
+ * archive_write_new_shared() -> pArchive
+ *
+ * Create a writer that several threads may write entries to. Each
+ * entry, from archive_write_header() to archive_write_finish_entry(), is
+ * written by one thread at a time; other threads block until it is
+ * finished. archive_write_entries() and archive_write_file_from_disk()
+ * write their entries as one unit. Set the writer up and open it before
+ * sharing it.
+ */
+RING_FUNC(ring_archive_write_new_shared)
+{
+	struct archive *a = archive_write_new();
+	if (!a)
+	{
+		RING_API_ERROR("Failed to create archive writer");
+		return;
+	}
+	if (!archive_handle_set_shared(a, 1))
+	{
+		archive_write_free(a);
+		RING_API_ERROR("Failed to create archive writer");
+		return;
+	}
+	RING_API_RETMANAGEDCPOINTER(a, "archive_write", free_archive_write);
+}
+
+/*
+ * archive_write_set_format(pArchive, nFormat) -> nResult
+ *
+ * Set archive format.
+ */
+RING_FUNC(ring_archive_write_set_format)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int format = (int)RING_API_GETNUMBER(2);
+	int result = ARCHIVE_OK;
+
+	switch (format)
+	{
+	case RING_ARCHIVE_FORMAT_TAR:
+		result = archive_write_set_format_pax_restricted(a);
+		break;
+	case RING_ARCHIVE_FORMAT_ZIP:
+		result = archive_write_set_format_zip(a);
+		break;
+	case RING_ARCHIVE_FORMAT_7ZIP:
+		result = archive_write_set_format_7zip(a);
+		break;
+	case RING_ARCHIVE_FORMAT_CPIO:
+		result = archive_write_set_format_cpio(a);
+		break;
+	case RING_ARCHIVE_FORMAT_ISO9660:
+		result = archive_write_set_format_iso9660(a);
+		break;
+	case RING_ARCHIVE_FORMAT_XAR:
+		result = archive_write_set_format_xar(a);
+		break;
+	case RING_ARCHIVE_FORMAT_RAW:
+		result = archive_write_set_format_raw(a);
+		break;
+	default:
+		result = archive_write_set_format_pax_restricted(a);
+	}
+
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_set_format_zip(pArchive) -> nResult
+ *
+ * Set ZIP format for archive.
+ */
+RING_FUNC(ring_archive_write_set_format_zip)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_write_set_format_zip(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_set_format_pax(pArchive) -> nResult
+ *
+ * Set PAX (POSIX tar) format.
+ */
+RING_FUNC(ring_archive_write_set_format_pax)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_write_set_format_pax_restricted(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_set_format_7zip(pArchive) -> nResult
+ *
+ * Set 7-Zip format.
+ */
+RING_FUNC(ring_archive_write_set_format_7zip)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_write_set_format_7zip(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_add_filter(pArchive, nFilter) -> nResult
+ *
+ * Add compression filter.
+ */
+RING_FUNC(ring_archive_write_add_filter)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int filter = (int)RING_API_GETNUMBER(2);
+	int result = ARCHIVE_OK;
+
+	switch (filter)
+	{
+	case RING_COMPRESSION_NONE:
+		result = archive_write_add_filter_none(a);
+		break;
+	case RING_COMPRESSION_GZIP:
+		result = archive_write_add_filter_gzip(a);
+		break;
+	case RING_COMPRESSION_BZIP2:
+		result = archive_write_add_filter_bzip2(a);
+		break;
+	case RING_COMPRESSION_XZ:
+		result = archive_write_add_filter_xz(a);
+		break;
+	case RING_COMPRESSION_LZMA:
+		result = archive_write_add_filter_lzma(a);
+		break;
+	case RING_COMPRESSION_ZSTD:
+		result = archive_write_add_filter_zstd(a);
+		break;
+	case RING_COMPRESSION_LZ4:
+		result = archive_write_add_filter_lz4(a);
+		break;
+	case RING_COMPRESSION_BROTLI:
+		/* libarchive has no Brotli filter; see archive_compress() */
+		archive_set_error(a, EINVAL, "Brotli is not supported as an archive filter");
+		result = ARCHIVE_FAILED;
+		break;
+	default:
+		result = archive_write_add_filter_none(a);
+	}
+
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_add_filter_gzip(pArchive) -> nResult
+ */
+RING_FUNC(ring_archive_write_add_filter_gzip)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_write_add_filter_gzip(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_add_filter_bzip2(pArchive) -> nResult
+ */
+RING_FUNC(ring_archive_write_add_filter_bzip2)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_write_add_filter_bzip2(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_add_filter_xz(pArchive) -> nResult
+ */
+RING_FUNC(ring_archive_write_add_filter_xz)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_write_add_filter_xz(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_add_filter_zstd(pArchive) -> nResult
+ */
+RING_FUNC(ring_archive_write_add_filter_zstd)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_write_add_filter_zstd(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_add_filter_lz4(pArchive) -> nResult
+ */
+RING_FUNC(ring_archive_write_add_filter_lz4)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_write_add_filter_lz4(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_add_filter_none(pArchive) -> nResult
+ */
+RING_FUNC(ring_archive_write_add_filter_none)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_write_add_filter_none(a);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_open_filename(pArchive, cFilename) -> nResult
+ *
+ * Open file for writing archive.
+ */
+RING_FUNC(ring_archive_write_open_filename)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	const char *filename = RING_API_GETSTRING(2);
+	int result = archive_write_open_filename(a, filename);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_open_append(pArchive, cFilename) -> nResult
+ *
+ * Open an existing uncompressed TAR or ZIP archive and continue writing
+ * after its last entry. Set the format (and no compression) first.
+ * A missing file is created as a new archive.
+ *
+ * New ZIP entries are written over the old central directory, which is
+ * kept in memory and written again in front of the new records on
+ * close, so the file only grows by the new entries. ZIP64 archives are
+ * supported and ZIP64 end records are added once the entry count or
+ * offsets need them; the archive comment is kept. An append that fails
+ * restores the original bytes. A process killed mid-append leaves the
+ * entries without a central directory.
+ */
+RING_FUNC(ring_archive_write_open_append)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	const char *filename = RING_API_GETSTRING(2);
+	int format = archive_format(a) & ARCHIVE_FORMAT_BASE_MASK;
+	int lCompressed = 0;
+	for (int i = 0; i < archive_filter_count(a); i++)
+	{
+		if (archive_filter_code(a, i) != ARCHIVE_FILTER_NONE)
+			lCompressed = 1;
+	}
+	if ((format != ARCHIVE_FORMAT_TAR && format != ARCHIVE_FORMAT_ZIP) || lCompressed)
+	{
+		archive_set_error(a, EINVAL, "Append requires an uncompressed TAR or ZIP writer");
+		RING_API_RETNUMBER((double)ARCHIVE_FATAL);
+		return;
+	}
+
+	ArchiveAppend *pAppend = (ArchiveAppend *)calloc(1, sizeof(ArchiveAppend));
+	if (!pAppend)
+	{
+		RING_API_ERROR("Failed to allocate append state");
+		return;
+	}
+	pAppend->lZip = (format == ARCHIVE_FORMAT_ZIP);
+	pAppend->fd = open(filename, O_RDWR | O_CREAT | O_BINARY, 0644);
+	if (pAppend->fd < 0)
+	{
+		free(pAppend);
+		archive_set_error(a, errno, "Failed to open %s", filename);
+		RING_API_RETNUMBER((double)ARCHIVE_FATAL);
+		return;
+	}
+
+	int ok = 1;
+	la_int64_t file_size = lseek(pAppend->fd, 0, SEEK_END);
+	pAppend->nOriginalSize = file_size;
+	if (file_size > 0)
+	{
+		if (pAppend->lZip)
+		{
+			ok = archive_zip_load_central(a, pAppend);
+		}
+		else
+		{
+			pAppend->nBase = archive_tar_find_end(pAppend->fd);
+			if (pAppend->nBase < 0)
+			{
+				archive_set_error(a, EINVAL, "Not an uncompressed TAR archive");
+				ok = 0;
+			}
+		}
+	}
+	else if (pAppend->lZip)
+	{
+		/* Empty file: nothing to merge, libarchive writes a complete ZIP */
+		pAppend->lZip = 0;
+	}
+
+	if (!ok || lseek(pAppend->fd, pAppend->nBase, SEEK_SET) < 0)
+	{
+		archive_append_free(pAppend);
+		RING_API_RETNUMBER((double)ARCHIVE_FATAL);
+		return;
+	}
+	if (!archive_append_register(a, pAppend))
+	{
+		archive_append_free(pAppend);
+		archive_set_error(a, EINVAL, "Archive writer is already open for appending");
+		RING_API_RETNUMBER((double)ARCHIVE_FATAL);
+		return;
+	}
+
+	/* Don't pad the tail; the file is rewritten in place */
+	archive_write_set_bytes_in_last_block(a, 1);
+	int result = archive_write_open(a, pAppend, NULL, archive_append_write, archive_append_close);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_open_memory(pArchive [, nMaxSize]) -> aMemBuffer [pBuffer, pUsed]
+ * archive_write_open_memory(pArchive, pMemory) -> nResult
+ *
+ * Open a growable memory buffer for writing archive. Writing fails once
+ * the archive would exceed nMaxSize bytes (default: no limit).
+ * Call archive_memory_get_data() to get data, then archive_memory_free() to free.
+ *
+ * Given a pMemory from archive_memory_new(), the archive is written into
+ * it instead (after a reset) and the open result is returned.
+ */
+RING_FUNC(ring_archive_write_open_memory)
+{
+	if (RING_API_PARACOUNT < 1 || RING_API_PARACOUNT > 2)
+	{
+		RING_API_ERROR(RING_API_BADPARACOUNT);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (RING_API_PARACOUNT == 2 && !RING_API_ISNUMBER(2) && !RING_API_ISCPOINTER(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	if (RING_API_PARACOUNT == 2 && RING_API_ISCPOINTER(2))
+	{
+		ArchiveMemory *pMemory = (ArchiveMemory *)RING_API_GETCPOINTER(2, "archive_memory");
+		if (!pMemory)
+		{
+			RING_API_ERROR(RING_API_NULLPOINTER);
+			return;
+		}
+		if (archive_memory_busy(pMemory))
+		{
+			RING_API_ERROR("Memory buffer is in use by another writer or reader");
+			return;
+		}
+		pMemory->nSize = 0;
+		int result = archive_write_open(a, pMemory, archive_memory_open, archive_memory_write, archive_memory_close);
+		RING_API_RETNUMBER((double)result);
+		return;
+	}
+
+	VM *pVM = (VM *)pPointer;
+
+	size_t nMaxSize = 0;
+	if (RING_API_PARACOUNT == 2 && RING_API_GETNUMBER(2) > 0)
+	{
+		nMaxSize = (size_t)RING_API_GETNUMBER(2);
+	}
+	ArchiveMemory *pMemory = archive_memory_create(nMaxSize);
+	if (!pMemory)
+	{
+		RING_API_ERROR("Failed to allocate memory buffer");
+		return;
+	}
+
+	int result = archive_write_open(a, pMemory, archive_memory_open, archive_memory_write, archive_memory_close);
+
+	if (result != ARCHIVE_OK)
+	{
+		archive_memory_release(pMemory, RING_ARCHIVE_MEMORY_OWNER_RING);
+		RING_API_ERROR("Failed to open memory for writing");
+		return;
+	}
+
+	List *pList = RING_API_NEWLIST;
+	ring_list_addcpointer_gc(pVM->pRingState, pList, pMemory, "buffer");
+	ring_list_addcpointer_gc(pVM->pRingState, pList, &pMemory->nSize, "size_ptr");
+	RING_API_RETLIST(pList);
+}
+
+/*
+ * archive_write_open_fd(pArchive, nFd) -> nResult
+ *
+ * Write archive to an already open file descriptor (e.g. 1 for stdout or
+ * a socket). The descriptor is not closed.
+ */
+RING_FUNC(ring_archive_write_open_fd)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int result = archive_write_open_fd(a, (int)RING_API_GETNUMBER(2));
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_open_callback(pArchive, cCode) -> nResult
+ *
+ * Write archive by running cCode for each output block. Inside cCode,
+ * archive_callback_data() returns the block; it is empty on the final call
+ * when the archive is closed. archive_callback_abort() fails the write.
+ */
+RING_FUNC(ring_archive_write_open_callback)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	ArchiveCallback *pCallback = archive_callback_new((VM *)pPointer, RING_API_GETSTRING(2));
+	if (!pCallback)
+	{
+		RING_API_ERROR("Failed to allocate callback");
+		return;
+	}
+
+	int result = archive_write_open2(a, pCallback, archive_callback_write_open, archive_callback_write,
+									 archive_callback_write_close, archive_callback_write_free);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_callback_data() -> cData
+ *
+ * Get the current block inside an archive callback.
+ */
+RING_FUNC(ring_archive_callback_data)
+{
+	if (!g_pArchiveCallback || !g_pArchiveCallback->nBlock)
+	{
+		RING_API_RETSTRING("");
+		return;
+	}
+	RING_API_RETSTRING2(g_pArchiveCallback->pBlock, g_pArchiveCallback->nBlock);
+}
+
+/*
+ * archive_callback_abort()
+ *
+ * Make the operation running the current archive callback fail.
+ */
+RING_FUNC(ring_archive_callback_abort)
+{
+	if (g_pArchiveCallback)
+	{
+		g_pArchiveCallback->lAbort = 1;
+	}
+}
+
+/*
+ * archive_memory_new([nMaxSize]) -> pMemory
+ *
+ * Create a reusable, garbage-collected memory buffer for
+ * archive_write_open_memory(). Its storage comes from a shared pool and
+ * goes back to it when the buffer is freed.
+ */
+RING_FUNC(ring_archive_memory_new)
+{
+	if (RING_API_PARACOUNT > 1)
+	{
+		RING_API_ERROR(RING_API_BADPARACOUNT);
+		return;
+	}
+	if (RING_API_PARACOUNT == 1 && !RING_API_ISNUMBER(1))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	size_t nMaxSize = 0;
+	if (RING_API_PARACOUNT == 1 && RING_API_GETNUMBER(1) > 0)
+	{
+		nMaxSize = (size_t)RING_API_GETNUMBER(1);
+	}
+
+	ArchiveMemory *pMemory = archive_memory_create(nMaxSize);
+	if (!pMemory)
+	{
+		RING_API_ERROR("Failed to allocate memory buffer");
+		return;
+	}
+	RING_API_RETMANAGEDCPOINTER(pMemory, "archive_memory", free_archive_memory);
+}
+
+/*
+ * archive_memory_from_string(cData) -> pMemory
+ *
+ * Create a memory buffer holding a copy of cData. It can be opened by any
+ * number of readers without further copies.
+ */
+RING_FUNC(ring_archive_memory_from_string)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISSTRING(1))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	ArchiveMemory *pMemory = archive_memory_copy(RING_API_GETSTRING(1), RING_API_GETSTRINGSIZE(1));
+	if (!pMemory)
+	{
+		RING_API_ERROR("Failed to allocate memory buffer");
+		return;
+	}
+	RING_API_RETMANAGEDCPOINTER(pMemory, "archive_memory", free_archive_memory);
+}
+
+/*
+ * archive_memory_reset(pMemory)
+ *
+ * Empty the buffer, keeping its storage for the next archive.
+ */
+RING_FUNC(ring_archive_memory_reset)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	ArchiveMemory *pMemory = (ArchiveMemory *)RING_API_GETCPOINTER(1, "archive_memory");
+	if (!pMemory)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+	if (archive_memory_busy(pMemory))
+	{
+		RING_API_ERROR("Close the writer and readers before resetting the memory buffer");
+		return;
+	}
+	pMemory->nSize = 0;
+}
+
+/*
+ * archive_memory_size(pMemory | aMemBuffer) -> nSize
+ *
+ * Get the number of bytes written to a memory buffer.
+ */
+RING_FUNC(ring_archive_memory_size)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+
+	ArchiveMemory *pMemory = archive_memory_from_param(pPointer, 1);
+	if (!pMemory)
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+	RING_API_RETNUMBER((double)pMemory->nSize);
+}
+
+/*
+ * archive_memory_get_data(pMemory | aMemBuffer) -> cData
+ *
+ * Get archive data from memory buffer as a string.
+ */
+RING_FUNC(ring_archive_memory_get_data)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISLIST(1) && !RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	ArchiveMemory *pMemory = archive_memory_from_param(pPointer, 1);
+	if (!pMemory)
+	{
+		RING_API_ERROR("Invalid memory buffer");
+		return;
+	}
+
+	if (pMemory->nSize == 0)
+	{
+		RING_API_RETSTRING("");
+		return;
+	}
+	RING_API_RETSTRING2(pMemory->pData, pMemory->nSize);
+}
+
+/*
+ * archive_memory_free(aMemBuffer | pMemory)
+ *
+ * Free memory buffer created by archive_write_open_memory().
+ * A managed pMemory stays valid; its storage is returned to the pool now
+ * rather than when it is garbage collected.
+ */
+RING_FUNC(ring_archive_memory_free)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+
+	if (RING_API_ISCPOINTER(1))
+	{
+		ArchiveMemory *pMemory = (ArchiveMemory *)RING_API_GETCPOINTER(1, "archive_memory");
+		if (pMemory && !archive_memory_busy(pMemory))
+		{
+			archive_memory_clear(pMemory);
+		}
+		return;
+	}
+	if (!RING_API_ISLIST(1))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	List *pList = RING_API_GETLIST(1);
+	if (ring_list_getsize(pList) != 2)
+	{
+		RING_API_ERROR("Invalid memory buffer list");
+		return;
+	}
+
+	archive_memory_release(archive_memory_from_param(pPointer, 1), RING_ARCHIVE_MEMORY_OWNER_RING);
+
+	/* Clear the pointers so a second free is harmless */
+	ring_list_setpointer_gc(((VM *)pPointer)->pRingState, ring_list_getlist(pList, 1), RING_CPOINTER_POINTER, NULL);
+	ring_list_setpointer_gc(((VM *)pPointer)->pRingState, ring_list_getlist(pList, 2), RING_CPOINTER_POINTER, NULL);
+}
+
+/*
+ * archive_memory_trim() -> nBytes
+ *
+ * Free the buffers the pool keeps for reuse, for example after a burst
+ * of large in-memory archives. Returns how many bytes were released.
+ */
+RING_FUNC(ring_archive_memory_trim)
+{
+	RING_API_RETNUMBER((double)archive_pool_trim());
+}
+
+/*
+ * archive_write_header(pArchive, pEntry) -> nResult
+ *
+ * Write entry header.
+ */
+RING_FUNC(ring_archive_write_header)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(2))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(2, "archive_entry");
+
+	if (!a || !entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	ArchiveHandleLock *pLock = archive_handle_lock(a);
+	int result = archive_write_header(a, entry);
+	archive_handle_hold_entry(pLock, result >= ARCHIVE_WARN);
+	if (result >= ARCHIVE_WARN)
+	{
+		archive_handle_throttle(a, 0, 1);
+	}
+	archive_handle_unlock(pLock);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_data(pArchive, cData) -> nBytesWritten
+ *
+ * Write data for current entry.
+ */
+RING_FUNC(ring_archive_write_data)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	const char *data = RING_API_GETSTRING(2);
+	size_t size = RING_API_GETSTRINGSIZE(2);
+
+	ArchiveHandleLock *pLock = archive_handle_lock(a);
+	la_ssize_t written = archive_write_data(a, data, size);
+	if (written > 0)
+	{
+		archive_handle_throttle(a, written, 0);
+	}
+	archive_handle_unlock(pLock);
+	RING_API_RETNUMBER((double)written);
+}
+
+/*
+ * archive_write_set_rate_limit(pArchive, nBytesPerSec [, nFilesPerSec]) -> nResult
+ *
+ * Slow the writer down to at most nBytesPerSec of entry data and
+ * nFilesPerSec entries; 0 means no limit for that rate. Calls that write
+ * past the limit sleep before returning.
+ */
+RING_FUNC(ring_archive_write_set_rate_limit)
+{
+	archive_handle_rate_param(pPointer, "archive_write");
+}
+
+/*
+ * archive_write_finish_entry(pArchive) -> nResult
+ *
+ * Finish writing current entry.
+ */
+RING_FUNC(ring_archive_write_finish_entry)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	ArchiveHandleLock *pLock = archive_handle_lock(a);
+	int result = archive_write_finish_entry(a);
+	archive_handle_hold_entry(pLock, 0);
+	archive_handle_unlock(pLock);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_entries(pArchive, aEntries) -> nCount
+ *
+ * Write many in-memory entries in one call. Each row is
+ * [cPath, cData, nPerm, nMtime, nType, cLinkTarget]; all but cPath and
+ * cData are optional. nType is ARCHIVE_ENTRY_FILE (default),
+ * ARCHIVE_ENTRY_DIR or ARCHIVE_ENTRY_SYMLINK, which takes cLinkTarget;
+ * cData is ignored for the last two. nPerm defaults to 0644, 0755 and
+ * 0777 respectively. Stops at the first failed entry and returns the
+ * number of entries written.
+ */
+RING_FUNC(ring_archive_write_entries)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISLIST(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	List *pEntries = RING_API_GETLIST(2);
+	int nSize = ring_list_getsize(pEntries);
+	int nCount = 0;
+	int lBadRow = 0;
+	struct archive_entry *entry = archive_entry_new();
+	ArchiveHandleLock *pLock = archive_handle_lock(a);
+
+	for (int i = 1; i <= nSize; i++)
+	{
+		if (!ring_list_islist(pEntries, i))
+		{
+			lBadRow = 1;
+			break;
+		}
+		List *pRow = ring_list_getlist(pEntries, i);
+		int nCols = ring_list_getsize(pRow);
+		if (nCols < 2 || !ring_list_isstring(pRow, 1) || !ring_list_isstring(pRow, 2))
+		{
+			lBadRow = 1;
+			break;
+		}
+
+		int nRingType = (nCols >= 5 && ring_list_isnumber(pRow, 5)) ? (int)ring_list_getdouble(pRow, 5) : RING_ENTRY_FILE;
+		unsigned int nType;
+		switch (nRingType)
+		{
+		case RING_ENTRY_FILE:
+			nType = AE_IFREG;
+			break;
+		case RING_ENTRY_DIR:
+			nType = AE_IFDIR;
+			break;
+		case RING_ENTRY_SYMLINK:
+			nType = AE_IFLNK;
+			break;
+		default:
+			nType = 0;
+			break;
+		}
+		if (!nType || (nType == AE_IFLNK && !(nCols >= 6 && ring_list_isstring(pRow, 6))))
+		{
+			lBadRow = 1;
+			break;
+		}
+
+		const char *data = ring_list_getstring(pRow, 2);
+		size_t size = nType == AE_IFREG ? ring_list_getstringsize(pRow, 2) : 0;
+
+		archive_entry_clear(entry);
+		archive_entry_set_pathname(entry, ring_list_getstring(pRow, 1));
+		archive_entry_set_size(entry, (la_int64_t)size);
+		archive_entry_set_filetype(entry, nType);
+		mode_t nPerm = nType == AE_IFDIR ? 0755 : nType == AE_IFLNK ? 0777 : 0644;
+		if (nCols >= 3 && ring_list_isnumber(pRow, 3))
+		{
+			nPerm = (mode_t)ring_list_getdouble(pRow, 3);
+		}
+		archive_entry_set_perm(entry, nPerm);
+		if (nType == AE_IFLNK)
+		{
+			archive_entry_set_symlink(entry, ring_list_getstring(pRow, 6));
+		}
+		if (nCols >= 4 && ring_list_isnumber(pRow, 4))
+		{
+			archive_entry_set_mtime(entry, (time_t)ring_list_getdouble(pRow, 4), 0);
+		}
+
+		if (archive_write_header(a, entry) < ARCHIVE_WARN)
+		{
+			break;
+		}
+		if (size > 0 && archive_write_data(a, data, size) < 0)
+		{
+			break;
+		}
+		if (archive_write_finish_entry(a) < ARCHIVE_WARN)
+		{
+			break;
+		}
+		archive_handle_throttle(a, (la_int64_t)size, 1);
+		nCount++;
+	}
+
+	archive_handle_hold_entry(pLock, 0);
+	archive_handle_unlock(pLock);
+	archive_entry_free(entry);
+	if (lBadRow)
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+	RING_API_RETNUMBER((double)nCount);
+}
+
+/*
+ * archive_write_file_from_disk(pArchive, cArchivePath, cDiskPath) -> nResult
+ *
+ * Add a file from disk, taking metadata from stat() and streaming the
+ * data in fixed-size chunks so memory use does not depend on file size.
+ */
+RING_FUNC(ring_archive_write_file_from_disk)
+{
+	if (RING_API_PARACOUNT != 3)
+	{
+		RING_API_ERROR(RING_API_MISS3PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2) || !RING_API_ISSTRING(3))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	const char *archive_path = RING_API_GETSTRING(2);
+	const char *disk_path = RING_API_GETSTRING(3);
+
+	struct stat st;
+	if (stat(disk_path, &st) != 0)
+	{
+		archive_set_error(a, errno, "Failed to stat %s", disk_path);
+		RING_API_RETNUMBER((double)ARCHIVE_FAILED);
+		return;
+	}
+
+	struct archive_entry *entry = archive_entry_new();
+	archive_entry_copy_stat(entry, &st);
+	archive_entry_set_pathname(entry, archive_path);
+	if (!S_ISREG(st.st_mode))
+	{
+		archive_entry_set_size(entry, 0);
+	}
+
+	ArchiveHandleLock *pLock = archive_handle_lock(a);
+	int result = archive_write_header(a, entry);
+	if (result >= ARCHIVE_WARN)
+	{
+		archive_handle_throttle(a, 0, 1);
+	}
+	if (result >= ARCHIVE_WARN && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		VM *pVM = (VM *)pPointer;
+		char *buff = (char *)ring_state_malloc(pVM->pRingState, RING_ARCHIVE_COPY_BUFFER_SIZE);
+		if (!buff)
+		{
+			archive_handle_hold_entry(pLock, 0);
+			archive_handle_unlock(pLock);
+			archive_entry_free(entry);
+			RING_API_ERROR("Failed to allocate copy buffer");
+			return;
+		}
+		if (archive_copy_file_data(a, disk_path, buff, RING_ARCHIVE_COPY_BUFFER_SIZE, NULL, NULL) < 0)
+		{
+			result = ARCHIVE_FAILED;
+		}
+		ring_state_free(pVM->pRingState, buff);
+	}
+	if (result >= ARCHIVE_WARN)
+	{
+		int finish = archive_write_finish_entry(a);
+		if (finish < result)
+		{
+			result = finish;
+		}
+	}
+	archive_handle_hold_entry(pLock, 0);
+	archive_handle_unlock(pLock);
+
+	archive_entry_free(entry);
+	RING_API_RETNUMBER((double)result);
+}
+
+/*
+ * archive_write_close(pArchive) -> nResult
+ *
+ * Close archive writer.
+ */
+RING_FUNC(ring_archive_write_close)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	ArchiveHandleLock *pLock = archive_handle_lock(a);
+	int result = archive_write_close(a);
+	ArchiveAppend *pAppend = archive_append_take(a);
+	if (pAppend && pAppend->fd >= 0)
+	{
+		/* Not closed yet; the handle still writes through it */
+		archive_append_register(a, pAppend);
+	}
+	else if (pAppend)
+	{
+		if (pAppend->nResult < result)
+		{
+			result = pAppend->nResult;
+		}
+		archive_append_free(pAppend);
+	}
+	archive_handle_hold_entry(pLock, 0);
+	archive_handle_unlock(pLock);
+	RING_API_RETNUMBER((double)result);
+}
+
+RING_FUNC(ring_archive_write_set_passphrase)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	const char *passphrase = RING_API_GETSTRING(2);
+	int result = archive_write_set_passphrase(a, passphrase);
+	RING_API_RETNUMBER((double)result);
+}
+
+RING_FUNC(ring_archive_write_set_options)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	if (!a)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	const char *options = RING_API_GETSTRING(2);
+	int result = archive_write_set_options(a, options);
+	RING_API_RETNUMBER((double)result);
+}
+
+/* ============================================================================
+ * Ring Functions - Archive Entry
+ * ============================================================================
+ */
+
+/*
+ * archive_entry_new() -> pEntry
+ *
+ * Create a new archive entry.
+ */
+RING_FUNC(ring_archive_entry_new)
+{
+	struct archive_entry *entry = archive_entry_new();
+	if (!entry)
+	{
+		RING_API_ERROR("Failed to create archive entry");
+		return;
+	}
+	RING_API_RETMANAGEDCPOINTER(entry, "archive_entry", free_archive_entry);
+}
+
+/*
+ * archive_entry_clear(pEntry) -> pEntry
+ *
+ * Clear an archive entry for reuse.
+ */
+RING_FUNC(ring_archive_entry_clear)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	archive_entry_clear(entry);
+	RING_API_RETCPOINTER(entry, "archive_entry");
+}
+
+/*
+ * archive_entry_clone(pEntry) -> pNewEntry
+ *
+ * Clone an archive entry.
+ */
+RING_FUNC(ring_archive_entry_clone)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	struct archive_entry *clone = archive_entry_clone(entry);
+	if (!clone)
+	{
+		RING_API_ERROR("Failed to clone archive entry");
+		return;
+	}
+	RING_API_RETMANAGEDCPOINTER(clone, "archive_entry", free_archive_entry);
+}
+
+/*
+ * archive_entry_pathname(pEntry) -> cPathname
+ *
+ * Get entry pathname.
+ */
+RING_FUNC(ring_archive_entry_pathname)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	const char *pathname = archive_entry_pathname(entry);
+	RING_API_RETSTRING(pathname);
+}
+
+/*
+ * archive_entry_set_pathname(pEntry, cPathname)
+ *
+ * Set entry pathname.
+ */
+RING_FUNC(ring_archive_entry_set_pathname)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	archive_entry_set_pathname(entry, RING_API_GETSTRING(2));
+}
+
+/*
+ * archive_entry_size(pEntry) -> nSize
+ *
+ * Get entry size.
+ */
+RING_FUNC(ring_archive_entry_size)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	la_int64_t size = archive_entry_size(entry);
+	RING_API_RETNUMBER((double)size);
+}
+
+/*
+ * archive_entry_set_size(pEntry, nSize)
+ *
+ * Set entry size.
+ */
+RING_FUNC(ring_archive_entry_set_size)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	archive_entry_set_size(entry, (la_int64_t)RING_API_GETNUMBER(2));
+}
+
+/*
+ * archive_entry_filetype(pEntry) -> nType
+ *
+ * Get entry file type.
+ */
+RING_FUNC(ring_archive_entry_filetype)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	mode_t type = archive_entry_filetype(entry);
+	int ring_type = RING_ENTRY_FILE;
+
+	if (S_ISDIR(type))
+	{
+		ring_type = RING_ENTRY_DIR;
+	}
+	else if (S_ISLNK(type))
+	{
+		ring_type = RING_ENTRY_SYMLINK;
+	}
+
+	RING_API_RETNUMBER((double)ring_type);
+}
+
+/*
+ * archive_entry_set_filetype(pEntry, nType)
+ *
+ * Set entry file type.
+ */
+RING_FUNC(ring_archive_entry_set_filetype)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	int type = (int)RING_API_GETNUMBER(2);
+	mode_t mode;
+
+	switch (type)
+	{
+	case RING_ENTRY_DIR:
+		mode = AE_IFDIR;
+		break;
+	case RING_ENTRY_SYMLINK:
+		mode = AE_IFLNK;
+		break;
+	case RING_ENTRY_FILE:
+	default:
+		mode = AE_IFREG;
+		break;
+	}
+
+	archive_entry_set_filetype(entry, mode);
+}
+
+/*
+ * archive_entry_perm(pEntry) -> nPerm
+ *
+ * Get entry permissions.
+ */
+RING_FUNC(ring_archive_entry_perm)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	RING_API_RETNUMBER((double)archive_entry_perm(entry));
+}
+
+/*
+ * archive_entry_set_perm(pEntry, nPerm)
+ *
+ * Set entry permissions.
+ */
+RING_FUNC(ring_archive_entry_set_perm)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	archive_entry_set_perm(entry, (mode_t)RING_API_GETNUMBER(2));
+}
+
+/*
+ * archive_entry_mtime(pEntry) -> nTime
+ *
+ * Get entry modification time.
+ */
+RING_FUNC(ring_archive_entry_mtime)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	RING_API_RETNUMBER((double)archive_entry_mtime(entry));
+}
+
+/*
+ * archive_entry_set_mtime(pEntry, nTime, nNsec)
+ *
+ * Set entry modification time.
+ */
+RING_FUNC(ring_archive_entry_set_mtime)
+{
+	if (RING_API_PARACOUNT != 3)
+	{
+		RING_API_ERROR(RING_API_MISS3PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2) || !RING_API_ISNUMBER(3))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	archive_entry_set_mtime(entry, (time_t)RING_API_GETNUMBER(2), (long)RING_API_GETNUMBER(3));
+}
+
+/*
+ * archive_entry_symlink(pEntry) -> cTarget
+ *
+ * Get symlink target.
+ */
+RING_FUNC(ring_archive_entry_symlink)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	const char *symlink = archive_entry_symlink(entry);
+	RING_API_RETSTRING(symlink);
+}
+
+/*
+ * archive_entry_set_symlink(pEntry, cTarget)
+ *
+ * Set symlink target.
+ */
+RING_FUNC(ring_archive_entry_set_symlink)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISSTRING(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	archive_entry_set_symlink(entry, RING_API_GETSTRING(2));
+}
+
+/*
+ * archive_entry_is_directory(pEntry) -> lIsDir
+ *
+ * Check if entry is a directory.
+ */
+RING_FUNC(ring_archive_entry_is_directory)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	mode_t type = archive_entry_filetype(entry);
+	RING_API_RETNUMBER(S_ISDIR(type) ? 1.0 : 0.0);
+}
+
+/*
+ * archive_entry_is_file(pEntry) -> lIsFile
+ *
+ * Check if entry is a regular file.
+ */
+RING_FUNC(ring_archive_entry_is_file)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	mode_t type = archive_entry_filetype(entry);
+	RING_API_RETNUMBER(S_ISREG(type) ? 1.0 : 0.0);
+}
+
+/*
+ * archive_entry_is_symlink(pEntry) -> lIsSymlink
+ *
+ * Check if entry is a symbolic link.
+ */
+RING_FUNC(ring_archive_entry_is_symlink)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
+	if (!entry)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+
+	mode_t type = archive_entry_filetype(entry);
+	RING_API_RETNUMBER(S_ISLNK(type) ? 1.0 : 0.0);
+}
+
+/* ============================================================================
+ * Ring Functions - Utility Functions
+ * ============================================================================
+ */
+
+/*
+ * archive_error_string(pArchive) -> cErrorMessage
+ *
+ * Get last error message.
+ */
+RING_FUNC(ring_archive_error_string)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	/* Works for both read and write archives - check type first */
+	List *pList = RING_API_GETLIST(1);
+	const char *ptype = ring_list_getstring(pList, RING_CPOINTER_TYPE);
+	struct archive *a = NULL;
+	if (strcmp(ptype, "archive_read") == 0)
+	{
+		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	}
+	else if (strcmp(ptype, "archive_write") == 0)
+	{
+		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	}
+	if (!a)
+	{
+		return;
+	}
+
+	const char *err = archive_error_string(a);
+	if (err)
+	{
+		RING_API_RETSTRING(err);
+	}
+}
+
+/*
+ * archive_errno(pArchive) -> nErrno
+ *
+ * Get last error number.
+ */
+RING_FUNC(ring_archive_errno)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	List *pList = RING_API_GETLIST(1);
+	const char *ptype = ring_list_getstring(pList, RING_CPOINTER_TYPE);
+	struct archive *a = NULL;
+	if (strcmp(ptype, "archive_read") == 0)
+	{
+		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	}
+	else if (strcmp(ptype, "archive_write") == 0)
+	{
+		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	}
+	if (!a)
+	{
+		RING_API_RETNUMBER(0);
+		return;
+	}
+
+	RING_API_RETNUMBER((double)archive_errno(a));
+}
+
+/*
+ * archive_version_string() -> cVersion
+ *
+ * Get libarchive version string.
+ */
+RING_FUNC(ring_archive_version_string)
+{
+	RING_API_RETSTRING(archive_version_string());
+}
+
+/*
+ * archive_format_name(pArchive) -> cFormatName
+ *
+ * Get archive format name.
+ */
+RING_FUNC(ring_archive_format_name)
+{
+	if (RING_API_PARACOUNT != 1)
+	{
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+
+	List *pList = RING_API_GETLIST(1);
+	const char *ptype = ring_list_getstring(pList, RING_CPOINTER_TYPE);
+	struct archive *a = NULL;
+	if (strcmp(ptype, "archive_read") == 0)
+	{
+		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	}
+	else if (strcmp(ptype, "archive_write") == 0)
+	{
+		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	}
+	if (!a)
+	{
+		return;
+	}
+
+	const char *name = archive_format_name(a);
+	if (name)
+	{
+		RING_API_RETSTRING(name);
+	}
+}
+
+/*
+ * archive_filter_name(pArchive, nFilter) -> cFilterName
+ *
+ * Get filter name. Readers decoding xz or zstd in parallel report that
+ * filter at index 0, ahead of the filters libarchive itself applies.
+ */
+RING_FUNC(ring_archive_filter_name)
+{
+	if (RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_MISS2PARA);
+		return;
+	}
+	if (!RING_API_ISCPOINTER(1))
+	{
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return;
+	}
+	if (!RING_API_ISNUMBER(2))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	List *pList = RING_API_GETLIST(1);
+	const char *ptype = ring_list_getstring(pList, RING_CPOINTER_TYPE);
+	struct archive *a = NULL;
+	if (strcmp(ptype, "archive_read") == 0)
+	{
+		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+	}
+	else if (strcmp(ptype, "archive_write") == 0)
+	{
+		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	}
+	if (!a)
+	{
+		return;
+	}
+
+	int nFilter = (int)RING_API_GETNUMBER(2);
+	const char *name = NULL;
+	if (strcmp(ptype, "archive_read") == 0 && nFilter >= 0 && archive_parallel_filter(a))
+	{
+		name = nFilter == 0 ? archive_parallel_filter(a) : archive_filter_name(a, nFilter - 1);
+	}
+	else
+	{
+		name = archive_filter_name(a, nFilter);
+	}
+	if (name)
+	{
+		RING_API_RETSTRING(name);
+	}
+}
+
+/* ============================================================================
+ * Ring Functions - High-Level Utilities
+ * ============================================================================
+ */
+
+static ArchiveJob *archive_job_new(int nKind, const char *cArchivePath)
+{
+	ArchiveJob *pJob = (ArchiveJob *)calloc(1, sizeof(ArchiveJob));
+	if (!pJob)
+	{
+		return NULL;
+	}
+	archive_mutex_init(&pJob->mutex);
+	archive_cond_init(&pJob->done);
+	pJob->nKind = nKind;
+	pJob->nRefs = 1;
+	pJob->cArchivePath = strdup(cArchivePath);
+	return pJob;
+}
+
+static void archive_job_release(ArchiveJob *pJob)
+{
+	archive_mutex_lock(&pJob->mutex);
+	int nRefs = --pJob->nRefs;
+	archive_mutex_unlock(&pJob->mutex);
+	if (nRefs > 0)
+	{
+		return;
+	}
+
+	free(pJob->cArchivePath);
+	free(pJob->cDestPath);
+	for (int i = 0; i < pJob->nFiles; i++)
+	{
+		free(pJob->aFiles[i]);
+	}
+	free(pJob->aFiles);
+	free((char *)pJob->options.cManifest);
+	archive_dict_release(pJob->options.pDict);
+	for (int i = 0; i < pJob->nRows; i++)
+	{
+		free(pJob->aRows[i].cPath);
+	}
+	free(pJob->aRows);
+	if (pJob->pToken)
+	{
+		archive_job_release(pJob->pToken);
+	}
+	archive_rate_free(pJob->pRate);
+	archive_cond_destroy(&pJob->done);
+	archive_mutex_destroy(&pJob->mutex);
+	free(pJob);
+}
+
+/*
+ * Make pJob obey the :cancel (an archive_token), :deadline (milliseconds
+ * from now), :bytes_per_sec and :files_per_sec options.
+ */
+static void archive_job_set_limits(ArchiveJob *pJob, List *pOptions)
+{
+	ArchiveJob *pToken = (ArchiveJob *)archive_option_pointer(pOptions, "cancel", "archive_token");
+	double nDeadline = archive_option_number(pOptions, "deadline", 0);
+	if (!pJob->pRate)
+	{
+		pJob->pRate = archive_rate_new(archive_option_number(pOptions, "bytes_per_sec", 0),
+									   archive_option_number(pOptions, "files_per_sec", 0));
+	}
+	if (pToken && !pJob->pToken)
+	{
+		archive_mutex_lock(&pToken->mutex);
+		pToken->nRefs++;
+		archive_mutex_unlock(&pToken->mutex);
+		pJob->pToken = pToken;
+	}
+	if (nDeadline > 0)
+	{
+		pJob->nDeadline = archive_clock_ms() + nDeadline;
+	}
+}
+
+/*
+ * Job that applies the limits of archive_job_set_limits() to a
+ * synchronous call, or NULL when none are given.
+ */
+static ArchiveJob *archive_job_for_options(int nKind, const char *cArchivePath, List *pOptions)
+{
+	if (!archive_option_find(pOptions, "cancel") && !archive_option_find(pOptions, "deadline") &&
+		!archive_option_find(pOptions, "bytes_per_sec") && !archive_option_find(pOptions, "files_per_sec"))
+	{
+		return NULL;
+	}
+	ArchiveJob *pJob = archive_job_new(nKind, cArchivePath);
+	if (pJob)
+	{
+		archive_job_set_limits(pJob, pOptions);
+	}
+	return pJob;
+}
+
+/*
+ * Release the job of a synchronous call. Returns 1 after raising the
+ * cancellation error if the call was stopped.
+ */
+static int archive_job_finish(void *pPointer, ArchiveJob *pJob)
+{
+	if (!pJob)
+	{
+		return 0;
+	}
+	const char *cError = pJob->lCancel ? archive_job_cancel_error(pJob) : NULL;
+	archive_job_release(pJob);
+	if (cError)
+	{
+		RING_API_ERROR(cError);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Extract entire archive to dest_path, reporting to pJob if given.
+ * Returns 1 when every entry was extracted.
+ */
+static int archive_extract_run(const char *archive_path, const char *dest_path, ArchiveJob *pJob)
+{
+	struct archive *a = archive_read_new();
+	struct archive *ext = archive_write_disk_new();
+	struct archive_entry *entry;
+	int flags = ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_SECURE_NODOTDOT;
+	int result = ARCHIVE_OK;
+
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	archive_write_disk_set_options(ext, flags);
+
+	if (archive_read_open_path(a, archive_path, 10240) != ARCHIVE_OK)
+	{
+		archive_read_free(a);
+		archive_write_free(ext);
+		return 0;
+	}
+
+	size_t dest_len = strlen(dest_path);
+	int is_zip = 0;
+	ArchiveCodec dict_codec;
+	ArchiveMemory dict_out;
+	int has_dict = 0;
+	int dict_failed = 0;
+	la_int64_t nIndex = -1;
+	memset(&dict_out, 0, sizeof(dict_out));
+
+	while (!archive_job_cancelled(pJob) && (result = archive_read_next_header(a, &entry)) == ARCHIVE_OK)
+	{
+		int lHeld;
+		if (archive_dict_open_entry(a, entry, ++nIndex, &dict_codec, &has_dict, &dict_out, &lHeld))
+		{
+			dict_failed = !has_dict;
+			continue;
+		}
+
+		/* Check format on first entry */
+		if (!is_zip && (archive_format(a) & ARCHIVE_FORMAT_BASE_MASK) == ARCHIVE_FORMAT_ZIP)
+		{
+			is_zip = 1;
+		}
+
+		const char *current_path = archive_entry_pathname(entry);
+
+		/* Construct full path */
+		size_t new_path_len = dest_len + 1 + strlen(current_path) + 1;
+		char *new_path = (char *)malloc(new_path_len);
+		if (!new_path)
+		{
+			result = ARCHIVE_FATAL;
+			break;
+		}
+		snprintf(new_path, new_path_len, "%s/%s", dest_path, current_path);
+		archive_entry_set_pathname(entry, new_path);
+
+		/* Hardlink targets are archive paths too */
+		const char *link_path = archive_entry_hardlink(entry);
+		if (link_path)
+		{
+			size_t new_link_len = dest_len + 1 + strlen(link_path) + 1;
+			char *new_link = (char *)malloc(new_link_len);
+			if (new_link)
+			{
+				snprintf(new_link, new_link_len, "%s/%s", dest_path, link_path);
+				archive_entry_set_hardlink(entry, new_link);
+				free(new_link);
+			}
+		}
+
+		/* Fix permissions for ZIP - it doesn't store Unix perms correctly */
+		if (is_zip)
+		{
+			__LA_MODE_T filetype = archive_entry_filetype(entry);
+			if (filetype == AE_IFDIR)
+			{
+				archive_entry_set_perm(entry, 0755);
+			}
+			else if (filetype == AE_IFREG)
+			{
+				archive_entry_set_perm(entry, 0644);
+			}
+		}
+
+		/* Entries of a dictionary archive are read through the codec */
+		unsigned char head[RING_ARCHIVE_DICTIONARY_MARK_SIZE];
+		la_ssize_t head_size = 0;
+		la_int64_t dict_size = has_dict ? archive_dict_peek(a, entry, head, &head_size) : -1;
+		if (dict_size >= 0)
+		{
+			archive_entry_set_size(entry, dict_size);
+		}
+
+		la_int64_t entry_bytes = 0;
+		result = archive_write_header(ext, entry);
+		if (result == ARCHIVE_OK)
+		{
+			const void *buff;
+			size_t size;
+			la_int64_t offset;
+
+			if (has_dict)
+			{
+				if (!archive_dict_read_data(a, &dict_codec, dict_size >= 0, head, head_size, &dict_out, ext, pJob))
+				{
+					dict_failed = 1;
+				}
+				entry_bytes = archive_entry_size(entry);
+			}
+			else if (lHeld)
+			{
+				archive_write_data(ext, dict_out.pData, dict_out.nSize);
+				archive_job_advance(pJob, a, 0, (la_int64_t)dict_out.nSize);
+			}
+			else
+			{
+				while (!archive_job_cancelled(pJob) && archive_read_data_block(a, &buff, &size, &offset) == ARCHIVE_OK)
+				{
+					archive_write_data_block(ext, buff, size, offset);
+					archive_job_advance(pJob, a, 0, (la_int64_t)size);
+				}
+			}
+			archive_write_finish_entry(ext);
+		}
+		archive_job_advance(pJob, a, 1, entry_bytes);
+
+		free(new_path);
+	}
+
+	if (has_dict)
+	{
+		archive_codec_end(&dict_codec);
+	}
+	archive_memory_clear(&dict_out);
+	archive_read_close(a);
+	archive_read_free(a);
+	archive_write_close(ext);
+	archive_write_free(ext);
+
+	return result == ARCHIVE_EOF && !dict_failed && !archive_job_cancelled(pJob);
+}
+
+/*
+ * archive_extract(cArchivePath, cDestPath [, aOptions]) -> lSuccess
+ *
+ * Extract entire archive to destination directory.
+ *
+ * Options:
+ *   :cancel = pToken   Stop when the archive_token_new() token is
+ *                      cancelled or its deadline passes.
+ *   :deadline = nMs    Stop once nMs milliseconds have passed.
+ *   :bytes_per_sec = nBytes, :files_per_sec = nFiles
+ *                      Sleep as needed to stay under these rates of
+ *                      entry data and entries.
+ * A stopped call closes its handles and raises "Operation cancelled" or
+ * "Deadline exceeded"; entries already written stay on disk and the
+ * token's progress tells how far it got.
+ */
+RING_FUNC(ring_archive_extract)
+{
+	if (RING_API_PARACOUNT != 2 && RING_API_PARACOUNT != 3)
+	{
+		RING_API_ERROR(RING_API_BADPARACOUNT);
+		return;
+	}
+	if (!RING_API_ISSTRING(1) || !RING_API_ISSTRING(2) || (RING_API_PARACOUNT == 3 && !RING_API_ISLIST(3)))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	const char *cArchivePath = RING_API_GETSTRING(1);
+	ArchiveJob *pJob = archive_job_for_options(RING_ARCHIVE_JOB_EXTRACT, cArchivePath,
+											   RING_API_PARACOUNT == 3 ? RING_API_GETLIST(3) : NULL);
+	archive_job_measure(pJob, cArchivePath);
+	int lSuccess = archive_extract_run(cArchivePath, RING_API_GETSTRING(2), pJob);
+	if (archive_job_finish(pPointer, pJob))
+	{
+		return;
+	}
+	RING_API_RETNUMBER(lSuccess);
+}
+
+/* Receives archive_list() rows one at a time */
+typedef int (*ArchiveListFunc)(void *pContext, const char *cPath, la_int64_t nSize, int nType, la_int64_t nMtime);
+
+/*
+ * List all entries of an archive through pfRow.
+ * Returns 1 on success, 0 if the archive can not be opened and -1 if
+ * pfRow failed.
+ */
+static int archive_list_run(const char *archive_path, ArchiveListFunc pfRow, void *pContext, ArchiveJob *pJob)
+{
+	struct archive *a = archive_read_new();
+	struct archive_entry *entry;
+
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+
+	if (archive_read_open_path(a, archive_path, 10240) != ARCHIVE_OK)
+	{
+		archive_read_free(a);
+		return 0;
+	}
+
+	int has_dict = 0;
+	int result = 1;
+	la_int64_t nIndex = -1;
+
+	while (!archive_job_cancelled(pJob) && archive_read_next_header(a, &entry) == ARCHIVE_OK)
+	{
+		if (archive_dict_is_entry(entry, ++nIndex) && archive_dict_peek_magic(a))
+		{
+			has_dict = 1;
+			archive_read_data_skip(a);
+			continue;
+		}
+
+		const char *pathname = archive_entry_pathname(entry);
+		unsigned char head[RING_ARCHIVE_DICTIONARY_MARK_SIZE];
+		la_ssize_t head_size;
+		la_int64_t dict_size = has_dict ? archive_dict_peek(a, entry, head, &head_size) : -1;
+
+		if (!pfRow(pContext, pathname ? pathname : "", dict_size >= 0 ? dict_size : archive_entry_size(entry),
+				   archive_entry_ring_type(entry), (la_int64_t)archive_entry_mtime(entry)))
+		{
+			result = -1;
+			break;
+		}
+
+		archive_read_data_skip(a);
+		archive_job_advance(pJob, a, 1, 0);
+	}
+
+	archive_read_close(a);
+	archive_read_free(a);
+
+	return result;
+}
+
+/*
+ * archive_list(cArchivePath [, aOptions]) -> aEntries
+ *
+ * List all entries in an archive.
+ * Returns list of [pathname, size, type, mtime]
+ * Takes the :cancel, :deadline and rate options of archive_extract().
+ */
+RING_FUNC(ring_archive_list)
+{
+	if (RING_API_PARACOUNT != 1 && RING_API_PARACOUNT != 2)
+	{
+		RING_API_ERROR(RING_API_BADPARACOUNT);
+		return;
+	}
+	if (!RING_API_ISSTRING(1) || (RING_API_PARACOUNT == 2 && !RING_API_ISLIST(2)))
+	{
+		RING_API_ERROR(RING_API_BADPARATYPE);
+		return;
+	}
+
+	VM *pVM = (VM *)pPointer;
+	ArchiveListTarget target;
+	target.pRingState = pVM->pRingState;
+	target.pList = RING_API_NEWLIST;
+
+	const char *cArchivePath = RING_API_GETSTRING(1);
+	ArchiveJob *pJob = archive_job_for_options(RING_ARCHIVE_JOB_LIST, cArchivePath,
+											   RING_API_PARACOUNT == 2 ? RING_API_GETLIST(2) : NULL);
+	archive_job_measure(pJob, cArchivePath);
+	int nResult = archive_list_run(cArchivePath, archive_list_add_row, &target, pJob);
+	if (archive_job_finish(pPointer, pJob))
+	{
+		return;
+	}
+	if (!nResult)
+	{
+		RING_API_ERROR("Failed to open archive");
+		return;
+	}
+
+	RING_API_RETLIST(target.pList);
+}
+
+/* Read the archive_create() options list */
+static void archive_create_options(List *pOptions, ArchiveCreateOptions *pOut)
+{
+	pOut->lDedup = archive_option_number(pOptions, "dedup", 0) != 0;
+	pOut->cManifest = archive_option_string(pOptions, "incremental");
+	pOut->pDict = (ArchiveDict *)archive_option_pointer(pOptions, "dictionary", "archive_zstd_dict");
+}
+
+/*
+ * Create archive_path from the files and directories in aFiles, reporting
+ * to pJob if given. Returns 1 on success and 0 on failure, with *pcError
+ * set when the failure should be raised as a Ring error.
+ */
+static int archive_create_run(const char *archive_path, char *const *aFiles, int nFiles, int format, int compression,
+							  const ArchiveCreateOptions *pOptions, ArchiveJob *pJob, const char **pcError)
+{
+	*pcError = NULL;
+
+	/* libarchive has no Brotli filter; see archive_compress() */
+	if (compression == RING_COMPRESSION_BROTLI)
+	{
+		return 0;
+	}
+
+	/* Hardlink entries with a link name are only available in TAR */
+	if (pOptions->lDedup && format != RING_ARCHIVE_FORMAT_TAR)
+	{
+		*pcError = "Deduplication requires ARCHIVE_FORMAT_TAR";
+		return 0;
+	}
+
+	/* Readers only accept a stored dictionary that carries the zstd magic */
+	if (pOptions->pDict && (!archive_dict_has_magic(pOptions->pDict->pData, pOptions->pDict->nSize) ||
+							pOptions->pDict->nSize > RING_ARCHIVE_DICTIONARY_MAX_SIZE))
+	{
+		*pcError = "The archive dictionary must be a zstd dictionary of at most 16 MB";
+		return 0;
+	}
+
+	struct archive *a = archive_write_new();
+	struct archive *disk = archive_read_disk_new();
+	struct archive_entry *entry;
+	int r;
+
+	/* Set format */
+	switch (format)
+	{
+	case RING_ARCHIVE_FORMAT_TAR:
+		archive_write_set_format_pax_restricted(a);
+		break;
+	case RING_ARCHIVE_FORMAT_ZIP:
+		archive_write_set_format_zip(a);
+		break;
+	case RING_ARCHIVE_FORMAT_7ZIP:
+		archive_write_set_format_7zip(a);
+		break;
+	case RING_ARCHIVE_FORMAT_CPIO:
+		archive_write_set_format_cpio(a);
+		break;
+	default:
+		archive_write_set_format_pax_restricted(a);
+	}
+
+	/* Set compression */
+	switch (compression)
+	{
+	case RING_COMPRESSION_NONE:
+		archive_write_add_filter_none(a);
+		break;
+	case RING_COMPRESSION_GZIP:
+		archive_write_add_filter_gzip(a);
+		break;
+	case RING_COMPRESSION_BZIP2:
+		archive_write_add_filter_bzip2(a);
+		break;
+	case RING_COMPRESSION_XZ:
+		archive_write_add_filter_xz(a);
+		break;
+	case RING_COMPRESSION_LZMA:
+		archive_write_add_filter_lzma(a);
+		break;
+	case RING_COMPRESSION_ZSTD:
+		archive_write_add_filter_zstd(a);
+		break;
+	case RING_COMPRESSION_LZ4:
+		archive_write_add_filter_lz4(a);
+		break;
+	default:
+		archive_write_add_filter_none(a);
+	}
+
+	/* Entries packed with a dictionary are compressed already */
+	ArchiveDict *pDict = pOptions->pDict;
+	if (pDict && format == RING_ARCHIVE_FORMAT_ZIP)
+	{
+		archive_write_set_format_option(a, "zip", "compression", "store");
+	}
+
+	/* Configure disk reader to not cross mount points and handle symlinks */
+	archive_read_disk_set_standard_lookup(disk);
+	archive_read_disk_set_behavior(disk, ARCHIVE_READDISK_NO_TRAVERSE_MOUNTS);
+
+	if (archive_write_open_filename(a, archive_path) != ARCHIVE_OK)
+	{
+		archive_read_free(disk);
+		archive_write_free(a);
+		return 0;
+	}
+
+	char *buff = (char *)malloc(RING_ARCHIVE_COPY_BUFFER_SIZE);
+	if (!buff)
+	{
+		archive_read_free(disk);
+		archive_write_free(a);
+		*pcError = "Failed to allocate copy buffer";
+		return 0;
+	}
+
+	ArchiveDedup dedup;
+	ArchiveDedup *pDedup = NULL;
+	if (pOptions->lDedup)
+	{
+		if (archive_map_init(&dedup.sizes, 1024) && archive_map_init(&dedup.digests, 1024))
+		{
+			pDedup = &dedup;
+		}
+		else
+		{
+			archive_map_free(&dedup.sizes, NULL);
+		}
+	}
+
+	ArchiveIncremental inc;
+	ArchiveIncremental *pInc = NULL;
+	if (pOptions->cManifest)
+	{
+		pInc = &inc;
+		if (!archive_incremental_begin(pInc, pOptions->cManifest))
+		{
+			archive_incremental_end(pInc, 0);
+			if (pDedup)
+			{
+				archive_map_free(&pDedup->sizes, NULL);
+				archive_map_free(&pDedup->digests, free);
+			}
+			free(buff);
+			archive_read_free(disk);
+			archive_write_free(a);
+			*pcError = "Failed to open incremental manifest";
+			return 0;
+		}
+	}
+
+	ArchiveCodec dict_codec;
+	ArchiveMemory dict_out;
+	int has_dict = 0;
+	memset(&dict_out, 0, sizeof(dict_out));
+	if (pDict && archive_codec_init(&dict_codec, RING_COMPRESSION_ZSTD, 1, -1))
+	{
+		has_dict = archive_codec_use_dict(&dict_codec, pDict) && archive_dict_write_entry(a, pDict);
+		if (!has_dict)
+		{
+			archive_codec_end(&dict_codec);
+		}
+	}
+
+	int failed = 0;
+	for (int i = 0; i < nFiles && !archive_job_cancelled(pJob); i++)
+	{
+		const char *filepath = aFiles[i];
+
+		r = archive_read_disk_open(disk, filepath);
+		if (r != ARCHIVE_OK)
+			continue;
+
+		while (!archive_job_cancelled(pJob))
+		{
+			entry = archive_entry_new();
+			r = archive_read_next_header2(disk, entry);
+
+			if (r == ARCHIVE_EOF)
+			{
+				archive_entry_free(entry);
+				break;
+			}
+
+			/* A file that cannot be opened fails alone; keep walking */
+			if (r == ARCHIVE_FAILED)
+			{
+				failed = 1;
+				archive_entry_free(entry);
+				continue;
+			}
+
+			if (r < ARCHIVE_WARN)
+			{
+				failed = 1;
+				archive_entry_free(entry);
+				break;
+			}
+
+			/* Let libarchive read file metadata from disk */
+			archive_read_disk_descend(disk);
+
+			if (pInc && archive_incremental_is_tombstone(archive_entry_pathname(entry)))
+			{
+				failed = 1;
+				*pcError = "The path " RING_ARCHIVE_TOMBSTONE_PATH " is reserved in incremental archives";
+				archive_entry_free(entry);
+				continue;
+			}
+
+			ArchiveManifestRecord cur;
+			if (pInc && archive_incremental_unchanged(pInc, entry, &cur))
+			{
+				archive_incremental_record(pInc, archive_entry_pathname(entry), &cur);
+				archive_entry_free(entry);
+				continue;
+			}
+
+			unsigned char digest[32];
+			int lHashed = 0;
+			int lLinked = 0;
+			int lHashData = 0;
+			if (pDedup && archive_entry_filetype(entry) == AE_IFREG && archive_entry_size(entry) > 0)
+			{
+				lLinked = archive_dedup_link(pDedup, entry, digest, buff, RING_ARCHIVE_COPY_BUFFER_SIZE, &lHashed);
+				lHashData = !lLinked && !lHashed;
+			}
+
+			int lPacked = 0;
+			if (has_dict && !lLinked && archive_entry_filetype(entry) == AE_IFREG && archive_entry_size(entry) > 0)
+			{
+				la_int64_t original = archive_dict_compress_file(&dict_codec, archive_entry_sourcepath(entry), buff,
+																 RING_ARCHIVE_COPY_BUFFER_SIZE, &dict_out);
+				if (original >= 0 && (la_int64_t)dict_out.nSize < original)
+				{
+					archive_entry_set_size(entry, (la_int64_t)dict_out.nSize);
+					archive_job_advance(pJob, NULL, 0, original);
+					lPacked = 1;
+				}
+			}
+
+			/* Write header; a warning still leaves the entry usable */
+			r = archive_write_header(a, entry);
+			if (r < ARCHIVE_WARN)
+			{
+				failed = 1;
+				archive_entry_free(entry);
+				continue;
+			}
+
+			int lStored = 1;
+			if (lPacked)
+			{
+				lStored = archive_write_data(a, dict_out.pData, dict_out.nSize) >= 0;
+			}
+			/* Write file data if it's a regular file with content */
+			else if (!lLinked && archive_entry_size(entry) > 0)
+			{
+				mbedtls_md_context_t hash;
+				mbedtls_md_init(&hash);
+				if (lHashData && (mbedtls_md_setup(&hash, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) != 0 ||
+								  mbedtls_md_starts(&hash) != 0))
+				{
+					lHashData = 0;
+				}
+
+				la_int64_t copied = archive_copy_file_data(a, archive_entry_sourcepath(entry), buff,
+														   RING_ARCHIVE_COPY_BUFFER_SIZE, lHashData ? &hash : NULL, pJob);
+				if (copied < 0)
+				{
+					lStored = 0;
+				}
+				else if (lHashData && copied == archive_entry_size(entry) && mbedtls_md_finish(&hash, digest) == 0)
+				{
+					lHashed = 1;
+				}
+				mbedtls_md_free(&hash);
+
+				if (pDedup && lHashed)
+				{
+					archive_dedup_remember(pDedup, entry, digest);
+				}
+			}
+
+			if (!lStored)
+			{
+				failed = 1;
+			}
+			else if (pInc)
+			{
+				/* The writer may have added a slash to the pathname */
+				archive_incremental_record(pInc, archive_entry_sourcepath(entry), &cur);
+			}
+
+			archive_job_advance(pJob, a, 1, 0);
+			archive_entry_free(entry);
+		}
+
+		archive_read_close(disk);
+	}
+
+	int cancelled = archive_job_cancelled(pJob);
+	if (pInc && !cancelled && !archive_incremental_write_tombstones(pInc, a))
+	{
+		failed = 1;
+	}
+	if (has_dict)
+	{
+		archive_codec_end(&dict_codec);
+	}
+	archive_memory_clear(&dict_out);
+	if (pDedup)
+	{
+		archive_map_free(&pDedup->sizes, NULL);
+		archive_map_free(&pDedup->digests, free);
+	}
+	free(buff);
+	archive_read_free(disk);
+	r = archive_write_close(a);
+	archive_job_advance(pJob, a, 0, 0);
+	archive_write_free(a);
+
+	if (pInc)
+	{
+		/* Only advance the manifest once the archive is complete */
+		archive_incremental_end(pInc, r == ARCHIVE_OK && !cancelled && !failed);
+	}
+
+	return !cancelled && !failed;
+}
+
+/*
+ * archive_create(cArchivePath, aFiles, nFormat, nCompression [, aOptions]) -> lSuccess
+ *
+ * Create an archive from list of files/directories (recursive).
+ * Uses libarchive's archive_read_disk API for proper handling.
+ *
+ * Options:
+ *   :dedup = true  Store byte-identical files once; later copies become
+ *                  hardlink entries pointing at the first copy. Raises an
+ *                  error for formats other than ARCHIVE_FORMAT_TAR.
+ *   :incremental = cManifest
+ *                  Only store entries that are new or changed since the
+ *                  manifest was written, list deleted paths in a
+ *                  ".archive-deleted" entry, then rewrite the manifest.
+ *                  The manifest is kept as it was if any file could not
+ *                  be stored, and the call then returns 0. A file named
+ *                  ".archive-deleted" raises an error.
+ *   :dictionary = pDict
+ *                  Compress each file on its own with a zstd dictionary
+ *                  from archive_zstd_dict_new(), which is stored in the
+ *                  archive as its first entry. It must be a trained
+ *                  dictionary (starting with the zstd dictionary magic),
+ *                  not raw content. Best with ZIP and ARCHIVE_COMPRESSION_NONE,
+ *                  since TAR pads every entry to 512 bytes. Files that
+ *                  do not get smaller are stored as is.
+ *   :cancel = pToken, :deadline = nMs
+ *                  Stop early as archive_extract() does. The archive is
+ *                  closed but incomplete, and an incremental manifest is
+ *                  left unchanged.
+ *   :bytes_per_sec = nBytes, :files_per_sec = nFiles
+ *                  Throttle as archive_extract() does.
+ */
+RING_FUNC(ring_archive_create)
+{
+	if (RING_API_PARACOUNT != 4 && RING_API_PARACOUNT != 5)
+	{
+		RING_API_ERROR(RING_API_BADPARACOUNT);
+		return;
+	}
+	if (!RING_API_ISSTRING(1) || !RING_API_ISLIST(2) || !RING_API_ISNUMBER(3) || !RING_API_ISNUMBER(4))
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (RING_API_PARACOUNT == 5 && !RING_API_ISLIST(5))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	List *pFilesList = RING_API_GETLIST(2);
+	List *pOptions = RING_API_PARACOUNT == 5 ? RING_API_GETLIST(5) : NULL;
+	ArchiveCreateOptions options;
+	archive_create_options(pOptions, &options);
+
+	/* Strings stay owned by the Ring list for the duration of the call */
+	int nSize = ring_list_getsize(pFilesList);
+	char **aFiles = (char **)malloc(sizeof(char *) * (nSize + 1));
+	if (!aFiles)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		RING_API_ERROR("Failed to allocate file list");
 		return;
 	}
+	int nFiles = 0;
+	for (int i = 1; i <= nSize; i++)
+	{
+		if (ring_list_isstring(pFilesList, i))
+		{
+			aFiles[nFiles++] = (char *)ring_list_getstring(pFilesList, i);
+		}
+	}
 
-	int result = archive_write_set_format_pax_restricted(a);
-	RING_API_RETNUMBER((double)result);
-}
-
-/*
- * archive_write_set_format_7zip(pArchive) -> nResult
- *
- * Set 7-Zip format.
- */
-RING_FUNC(ring_archive_write_set_format_7zip)
-{
-	if (RING_API_PARACOUNT != 1)
+	const char *cError;
+	ArchiveJob *pJob = archive_job_for_options(RING_ARCHIVE_JOB_CREATE, RING_API_GETSTRING(1), pOptions);
+	int success = archive_create_run(RING_API_GETSTRING(1), aFiles, nFiles, (int)RING_API_GETNUMBER(3),
+									 (int)RING_API_GETNUMBER(4), &options, pJob, &cError);
+	free(aFiles);
+	if (archive_job_finish(pPointer, pJob))
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (cError)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(cError);
 		return;
 	}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	RING_API_RETNUMBER(success);
+}
+
+/*
+ * State shared by the runners of one archive_extract_many() call. Each
+ * runner claims the next unstarted item until none are left, so at most
+ * nRunners archives are extracted at a time.
+ */
+typedef struct ArchiveExtractItem
+{
+	const char *cArchivePath;
+	const char *cDestPath;
+	ArchiveJob job;
+	int nResult;
+	double nDuration;
+} ArchiveExtractItem;
+
+typedef struct ArchiveExtractBatch
+{
+	ArchiveMutex mutex;
+	ArchiveExtractItem *aItems;
+	int nItems;
+	int nNext;
+} ArchiveExtractBatch;
+
+static void archive_extract_many_runner(void *pArg)
+{
+	ArchiveExtractBatch *pBatch = (ArchiveExtractBatch *)pArg;
+	for (;;)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
-	}
+		archive_mutex_lock(&pBatch->mutex);
+		int nItem = pBatch->nNext < pBatch->nItems ? pBatch->nNext++ : -1;
+		archive_mutex_unlock(&pBatch->mutex);
+		if (nItem < 0)
+		{
+			return;
+		}
 
-	int result = archive_write_set_format_7zip(a);
-	RING_API_RETNUMBER((double)result);
+		ArchiveExtractItem *pItem = &pBatch->aItems[nItem];
+		if (!pItem->cArchivePath)
+		{
+			continue;
+		}
+		double nStart = archive_clock_ms();
+		pItem->nResult = archive_extract_run(pItem->cArchivePath, pItem->cDestPath, &pItem->job);
+		pItem->nDuration = archive_clock_ms() - nStart;
+	}
 }
 
 /*
- * archive_write_add_filter(pArchive, nFilter) -> nResult
+ * archive_extract_many(aJobs [, nConcurrency]) -> aResults
  *
- * Add compression filter.
+ * Extract many archives concurrently on the worker pool. aJobs holds
+ * [cArchivePath, cDestPath] or [cArchivePath, cDestPath, aOptions] rows,
+ * where aOptions takes the :cancel, :deadline and rate options of
+ * archive_extract(); deadlines count from the start of the call. At most
+ * nConcurrency archives are extracted at once, by default (or when < 1)
+ * the pool size.
+ *
+ * Returns one [lSuccess, nEntries, nBytes, nDurationMs] row per job, in
+ * the order of aJobs. Malformed rows are skipped and report failure.
  */
-RING_FUNC(ring_archive_write_add_filter)
+RING_FUNC(ring_archive_extract_many)
 {
-	if (RING_API_PARACOUNT != 2)
+	if (RING_API_PARACOUNT != 1 && RING_API_PARACOUNT != 2)
 	{
-		RING_API_ERROR(RING_API_MISS2PARA);
+		RING_API_ERROR(RING_API_BADPARACOUNT);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (!RING_API_ISLIST(1) || (RING_API_PARACOUNT == 2 && !RING_API_ISNUMBER(2)))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
-	if (!RING_API_ISNUMBER(2))
+
+	List *pJobs = RING_API_GETLIST(1);
+	int nItems = ring_list_getsize(pJobs);
+	int nRunners = RING_API_PARACOUNT == 2 ? (int)RING_API_GETNUMBER(2) : 0;
+	if (nRunners < 1)
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		nRunners = archive_workers_size();
+	}
+	if (nRunners > nItems)
+	{
+		nRunners = nItems;
 	}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	ArchiveExtractBatch batch;
+	batch.aItems = (ArchiveExtractItem *)calloc(nItems ? nItems : 1, sizeof(ArchiveExtractItem));
+	if (!batch.aItems)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		RING_API_ERROR("Failed to allocate job list");
 		return;
 	}
+	archive_mutex_init(&batch.mutex);
+	batch.nItems = nItems;
+	batch.nNext = 0;
 
-	int filter = (int)RING_API_GETNUMBER(2);
-	int result = ARCHIVE_OK;
+	/* Rows stay owned by the Ring list for the duration of the call */
+	for (int i = 1; i <= nItems; i++)
+	{
+		ArchiveExtractItem *pItem = &batch.aItems[i - 1];
+		archive_mutex_init(&pItem->job.mutex);
+		if (!ring_list_islist(pJobs, i))
+		{
+			continue;
+		}
+		List *pRow = ring_list_getlist(pJobs, i);
+		if (ring_list_getsize(pRow) >= 2 && ring_list_isstring(pRow, 1) && ring_list_isstring(pRow, 2))
+		{
+			pItem->cArchivePath = ring_list_getstring(pRow, 1);
+			pItem->cDestPath = ring_list_getstring(pRow, 2);
+			if (ring_list_getsize(pRow) >= 3 && ring_list_islist(pRow, 3))
+			{
+				archive_job_set_limits(&pItem->job, ring_list_getlist(pRow, 3));
+			}
+		}
+	}
 
-	switch (filter)
+	ArchiveTaskGroup group;
+	archive_group_init(&group);
+	/* The caller is the last runner and also takes what the pool could not */
+	for (int i = 1; i < nRunners; i++)
 	{
-	case RING_COMPRESSION_NONE:
-		result = archive_write_add_filter_none(a);
-		break;
-	case RING_COMPRESSION_GZIP:
-		result = archive_write_add_filter_gzip(a);
-		break;
-	case RING_COMPRESSION_BZIP2:
-		result = archive_write_add_filter_bzip2(a);
-		break;
-	case RING_COMPRESSION_XZ:
-		result = archive_write_add_filter_xz(a);
-		break;
-	case RING_COMPRESSION_LZMA:
-		result = archive_write_add_filter_lzma(a);
-		break;
-	case RING_COMPRESSION_ZSTD:
-		result = archive_write_add_filter_zstd(a);
-		break;
-	case RING_COMPRESSION_LZ4:
-		result = archive_write_add_filter_lz4(a);
-		break;
-	default:
-		result = archive_write_add_filter_none(a);
+		if (!archive_task_submit(archive_extract_many_runner, &batch, &group))
+		{
+			break;
+		}
 	}
+	archive_extract_many_runner(&batch);
+	archive_group_wait(&group);
+	archive_group_destroy(&group);
 
-	RING_API_RETNUMBER((double)result);
+	VM *pVM = (VM *)pPointer;
+	List *pResults = RING_API_NEWLIST;
+	for (int i = 0; i < nItems; i++)
+	{
+		ArchiveExtractItem *pItem = &batch.aItems[i];
+		List *pRow = ring_list_newlist_gc(pVM->pRingState, pResults);
+		ring_list_adddouble_gc(pVM->pRingState, pRow, (double)pItem->nResult);
+		ring_list_adddouble_gc(pVM->pRingState, pRow, (double)pItem->job.nEntries);
+		ring_list_adddouble_gc(pVM->pRingState, pRow, (double)pItem->job.nBytes);
+		ring_list_adddouble_gc(pVM->pRingState, pRow, pItem->nDuration);
+		if (pItem->job.pToken)
+		{
+			archive_job_release(pItem->job.pToken);
+		}
+		archive_rate_free(pItem->job.pRate);
+		archive_mutex_destroy(&pItem->job.mutex);
+	}
+	archive_mutex_destroy(&batch.mutex);
+	free(batch.aItems);
+
+	RING_API_RETLIST(pResults);
 }
 
 /*
- * archive_write_add_filter_gzip(pArchive) -> nResult
+ * State shared by the readers of one archive_checksum_entries() or
+ * archive_verify() call. Every reader walks the whole archive and takes
+ * the regular-file entries nobody has claimed yet, so for ZIP, where
+ * skipping an entry is a seek, several readers decode different entries
+ * at the same time. Solid 7z folders would be decoded again by every
+ * reader, so 7z is scanned by one. Without pInfo entries are only decoded and
+ * checked, and only the failures are recorded.
  */
-RING_FUNC(ring_archive_write_add_filter_gzip)
+typedef struct ArchiveScanEntry
 {
-	if (RING_API_PARACOUNT != 1)
-	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
+	int nIndex;
+	char *cPath;
+	char *cError;
+	unsigned char aDigest[MBEDTLS_MD_MAX_SIZE];
+} ArchiveScanEntry;
+
+typedef struct ArchiveScan
+{
+	const char *cArchivePath;
+	const mbedtls_md_info_t *pInfo;
+	ArchiveMutex mutex;
+	int nNext;
+	ArchiveScanEntry *aEntries;
+	int nEntries;
+	int nCapacity;
+	int lOpened;
+	volatile int lFailed;
+	char *cError;
+} ArchiveScan;
+
+/* Record an error that ends the scan; the first one wins */
+static void archive_scan_fail(ArchiveScan *pScan, const char *cError)
+{
+	archive_mutex_lock(&pScan->mutex);
+	if (!pScan->lFailed)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		pScan->cError = strdup(cError);
+		pScan->lFailed = 1;
 	}
+	archive_mutex_unlock(&pScan->mutex);
+}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+static int archive_scan_add(ArchiveScan *pScan, int nIndex, const char *cPath, const unsigned char *pDigest,
+							const char *cError)
+{
+	int lAdded = 0;
+	archive_mutex_lock(&pScan->mutex);
+	if (pScan->nEntries == pScan->nCapacity)
+	{
+		int nCapacity = pScan->nCapacity ? pScan->nCapacity * 2 : 256;
+		ArchiveScanEntry *aEntries =
+			(ArchiveScanEntry *)realloc(pScan->aEntries, sizeof(ArchiveScanEntry) * nCapacity);
+		if (aEntries)
+		{
+			pScan->aEntries = aEntries;
+			pScan->nCapacity = nCapacity;
+		}
+	}
+	if (pScan->nEntries < pScan->nCapacity)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		ArchiveScanEntry *pEntry = &pScan->aEntries[pScan->nEntries];
+		pEntry->nIndex = nIndex;
+		pEntry->cPath = strdup(cPath);
+		pEntry->cError = cError ? strdup(cError) : NULL;
+		if (pEntry->cPath && (pEntry->cError || !cError))
+		{
+			if (pDigest)
+			{
+				memcpy(pEntry->aDigest, pDigest, mbedtls_md_get_size(pScan->pInfo));
+			}
+			pScan->nEntries++;
+			lAdded = 1;
+		}
+		else
+		{
+			free(pEntry->cPath);
+			free(pEntry->cError);
+		}
 	}
-
-	int result = archive_write_add_filter_gzip(a);
-	RING_API_RETNUMBER((double)result);
+	archive_mutex_unlock(&pScan->mutex);
+	return lAdded;
 }
 
 /*
- * archive_write_add_filter_bzip2(pArchive) -> nResult
+ * Decode the data of the current entry, feeding it to pHash if set, and
+ * check it against the size in the header. Returns NULL on success or
+ * the reason the entry is bad.
  */
-RING_FUNC(ring_archive_write_add_filter_bzip2)
+static const char *archive_scan_entry(struct archive *a, struct archive_entry *entry, ArchiveCodec *pDictCodec,
+									  ArchiveMemory *pDictOut, int lHeld, mbedtls_md_context_t *pHash)
 {
-	if (RING_API_PARACOUNT != 1)
+	la_int64_t nExpected = archive_entry_size_is_set(entry) ? archive_entry_size(entry) : -1;
+	la_int64_t nBytes = 0;
+	if (pHash && mbedtls_md_starts(pHash) != 0)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
+		return "Failed to set up checksum";
 	}
-	if (!RING_API_ISCPOINTER(1))
+
+	if (lHeld)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		/* Read ahead by archive_dict_open_entry() */
+		nBytes = (la_int64_t)pDictOut->nSize;
+		if (pHash)
+		{
+			mbedtls_md_update(pHash, (const unsigned char *)pDictOut->pData, pDictOut->nSize);
+		}
 	}
-
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	else if (pDictCodec)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		unsigned char head[RING_ARCHIVE_DICTIONARY_MARK_SIZE];
+		la_ssize_t head_size = 0;
+		la_int64_t dict_size = archive_dict_peek(a, entry, head, &head_size);
+		pDictOut->nSize = 0;
+		if (!archive_dict_read_data(a, pDictCodec, dict_size >= 0, head, head_size, pDictOut, NULL, NULL))
+		{
+			return archive_error_string(a) ? archive_error_string(a) : "Failed to decode entry data";
+		}
+		if (dict_size >= 0)
+		{
+			nExpected = dict_size;
+		}
+		nBytes = (la_int64_t)pDictOut->nSize;
+		if (pHash)
+		{
+			mbedtls_md_update(pHash, (const unsigned char *)pDictOut->pData, pDictOut->nSize);
+		}
+	}
+	else
+	{
+		const void *buff;
+		size_t size;
+		la_int64_t offset;
+		int r;
+		while ((r = archive_read_data_block(a, &buff, &size, &offset)) == ARCHIVE_OK)
+		{
+			/* Sparse files report holes through the offset */
+			nBytes = offset + (la_int64_t)size;
+			if (pHash)
+			{
+				mbedtls_md_update(pHash, (const unsigned char *)buff, size);
+			}
+		}
+		if (r != ARCHIVE_EOF)
+		{
+			return archive_error_string(a) ? archive_error_string(a) : "Failed to read entry data";
+		}
 	}
 
-	int result = archive_write_add_filter_bzip2(a);
-	RING_API_RETNUMBER((double)result);
+	if (nExpected >= 0 && nBytes != nExpected)
+	{
+		return "Entry size does not match its header";
+	}
+	return NULL;
 }
 
-/*
- * archive_write_add_filter_xz(pArchive) -> nResult
- */
-RING_FUNC(ring_archive_write_add_filter_xz)
+static void archive_scan_reader(void *pArg)
 {
-	if (RING_API_PARACOUNT != 1)
+	ArchiveScan *pScan = (ArchiveScan *)pArg;
+	struct archive *a = archive_read_new();
+	struct archive_entry *entry;
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	if (archive_read_open_path(a, pScan->cArchivePath, 10240) != ARCHIVE_OK)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
+		archive_read_free(a);
+		archive_scan_fail(pScan, "Failed to open archive");
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	archive_mutex_lock(&pScan->mutex);
+	pScan->lOpened = 1;
+	archive_mutex_unlock(&pScan->mutex);
+
+	mbedtls_md_context_t hash;
+	mbedtls_md_init(&hash);
+	ArchiveCodec dict_codec;
+	ArchiveMemory dict_out;
+	int has_dict = 0;
+	memset(&dict_out, 0, sizeof(dict_out));
+	unsigned char digest[MBEDTLS_MD_MAX_SIZE];
+	int nIndex = -1;
+	la_int64_t nEntry = -1;
+	int r = ARCHIVE_EOF;
+
+	if (pScan->pInfo && mbedtls_md_setup(&hash, pScan->pInfo, 0) != 0)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		archive_scan_fail(pScan, "Failed to set up checksum");
 	}
+	while (!pScan->lFailed)
+	{
+		r = archive_read_next_header(a, &entry);
+		if (r != ARCHIVE_OK && r != ARCHIVE_WARN)
+		{
+			break;
+		}
+		int lHeld;
+		if (archive_dict_open_entry(a, entry, ++nEntry, &dict_codec, &has_dict, &dict_out, &lHeld))
+		{
+			continue;
+		}
+		if (archive_entry_filetype(entry) != AE_IFREG)
+		{
+			continue;
+		}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+		nIndex++;
+		archive_mutex_lock(&pScan->mutex);
+		int lMine = nIndex >= pScan->nNext;
+		if (lMine)
+		{
+			pScan->nNext = nIndex + 1;
+		}
+		archive_mutex_unlock(&pScan->mutex);
+		if (!lMine)
+		{
+			continue;
+		}
+
+		const char *pathname = archive_entry_pathname(entry);
+		const char *cError = archive_scan_entry(a, entry, has_dict ? &dict_codec : NULL, &dict_out, lHeld,
+												pScan->pInfo ? &hash : NULL);
+		if (pScan->pInfo && !cError && mbedtls_md_finish(&hash, digest) != 0)
+		{
+			cError = "Failed to finish checksum";
+		}
+		if (pScan->pInfo && cError)
+		{
+			archive_scan_fail(pScan, cError);
+			break;
+		}
+		if ((pScan->pInfo || cError) &&
+			!archive_scan_add(pScan, nIndex, pathname ? pathname : "", pScan->pInfo ? digest : NULL, cError))
+		{
+			archive_scan_fail(pScan, "Failed to allocate entry list");
+			break;
+		}
+	}
+	if (r != ARCHIVE_EOF && r != ARCHIVE_OK && r != ARCHIVE_WARN)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		archive_scan_fail(pScan, archive_error_string(a) ? archive_error_string(a) : "Failed to read archive");
 	}
 
-	int result = archive_write_add_filter_xz(a);
-	RING_API_RETNUMBER((double)result);
+	mbedtls_md_free(&hash);
+	if (has_dict)
+	{
+		archive_codec_end(&dict_codec);
+	}
+	archive_memory_clear(&dict_out);
+	archive_read_close(a);
+	archive_read_free(a);
 }
 
-/*
- * archive_write_add_filter_zstd(pArchive) -> nResult
- */
-RING_FUNC(ring_archive_write_add_filter_zstd)
+static int archive_scan_compare(const void *pLeft, const void *pRight)
 {
-	if (RING_API_PARACOUNT != 1)
+	return ((const ArchiveScanEntry *)pLeft)->nIndex - ((const ArchiveScanEntry *)pRight)->nIndex;
+}
+
+/* Whether the archive at path is ZIP, whose entries can be skipped cheaply */
+static int archive_path_is_seekable(const char *path)
+{
+	struct archive *a = archive_read_new();
+	struct archive_entry *entry;
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	int lSeekable = 0;
+	if (archive_read_open_filename(a, path, 10240) == ARCHIVE_OK && archive_read_next_header(a, &entry) == ARCHIVE_OK)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
+		int nFormat = archive_format(a) & ARCHIVE_FORMAT_BASE_MASK;
+		lSeekable = archive_filter_count(a) == 1 && nFormat == ARCHIVE_FORMAT_ZIP;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	archive_read_free(a);
+	return lSeekable;
+}
+
+/* Run the scan with one reader per pool thread for ZIP, one otherwise */
+static void archive_scan_run(ArchiveScan *pScan)
+{
+	archive_mutex_init(&pScan->mutex);
+	int nReaders = archive_path_is_seekable(pScan->cArchivePath) ? archive_workers_size() : 1;
+	ArchiveTaskGroup group;
+	archive_group_init(&group);
+	for (int i = 1; i < nReaders; i++)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		if (!archive_task_submit(archive_scan_reader, pScan, &group))
+		{
+			break;
+		}
 	}
+	archive_scan_reader(pScan);
+	archive_group_wait(&group);
+	archive_group_destroy(&group);
+	archive_mutex_destroy(&pScan->mutex);
+	qsort(pScan->aEntries, pScan->nEntries, sizeof(ArchiveScanEntry), archive_scan_compare);
+}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+static void archive_scan_free(ArchiveScan *pScan)
+{
+	for (int i = 0; i < pScan->nEntries; i++)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		free(pScan->aEntries[i].cPath);
+		free(pScan->aEntries[i].cError);
 	}
-
-	int result = archive_write_add_filter_zstd(a);
-	RING_API_RETNUMBER((double)result);
+	free(pScan->aEntries);
+	free(pScan->cError);
 }
 
 /*
- * archive_write_add_filter_lz4(pArchive) -> nResult
+ * archive_checksum_entries(cArchivePath [, cAlgorithm]) -> aDigests
+ *
+ * Hash the data of every regular file in an archive. cAlgorithm is one of
+ * "md5", "sha1", "sha224", "sha256" (default), "sha384" or "sha512".
+ * Returns [[cPath, cHexDigest], ...] in archive order, so digests can be
+ * looked up as aDigests[cPath]. ZIP archives are hashed by several readers
+ * at once on the worker pool.
  */
-RING_FUNC(ring_archive_write_add_filter_lz4)
+RING_FUNC(ring_archive_checksum_entries)
 {
-	if (RING_API_PARACOUNT != 1)
+	if (RING_API_PARACOUNT != 1 && RING_API_PARACOUNT != 2)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
+		RING_API_ERROR(RING_API_BADPARACOUNT);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (!RING_API_ISSTRING(1) || (RING_API_PARACOUNT == 2 && !RING_API_ISSTRING(2)))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	/* mbedTLS names its digests in upper case */
+	char cName[16];
+	const char *cAlgorithm = RING_API_PARACOUNT == 2 ? RING_API_GETSTRING(2) : "sha256";
+	size_t nName = 0;
+	while (cAlgorithm[nName] && nName < sizeof(cName) - 1)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		cName[nName] = (char)toupper((unsigned char)cAlgorithm[nName]);
+		nName++;
+	}
+	cName[nName] = '\0';
+	const mbedtls_md_info_t *pInfo = cAlgorithm[nName] ? NULL : mbedtls_md_info_from_string(cName);
+	if (!pInfo)
+	{
+		RING_API_ERROR("Unsupported checksum algorithm");
 		return;
 	}
 
-	int result = archive_write_add_filter_lz4(a);
-	RING_API_RETNUMBER((double)result);
+	ArchiveScan scan;
+	memset(&scan, 0, sizeof(scan));
+	scan.cArchivePath = RING_API_GETSTRING(1);
+	scan.pInfo = pInfo;
+	archive_scan_run(&scan);
+	if (scan.lFailed)
+	{
+		RING_API_ERROR(scan.cError ? scan.cError : "Failed to read archive");
+		archive_scan_free(&scan);
+		return;
+	}
+
+	VM *pVM = (VM *)pPointer;
+	List *pResults = RING_API_NEWLIST;
+	int nSize = mbedtls_md_get_size(pInfo);
+	for (int i = 0; i < scan.nEntries; i++)
+	{
+		char cHex[MBEDTLS_MD_MAX_SIZE * 2 + 1];
+		for (int j = 0; j < nSize; j++)
+		{
+			snprintf(cHex + j * 2, 3, "%02x", scan.aEntries[i].aDigest[j]);
+		}
+		List *pRow = ring_list_newlist_gc(pVM->pRingState, pResults);
+		ring_list_addstring_gc(pVM->pRingState, pRow, scan.aEntries[i].cPath);
+		ring_list_addstring_gc(pVM->pRingState, pRow, cHex);
+	}
+	archive_scan_free(&scan);
+	RING_API_RETLIST(pResults);
 }
 
 /*
- * archive_write_add_filter_none(pArchive) -> nResult
+ * archive_verify(cArchivePath) -> aFailures
+ *
+ * Decode every regular file in an archive and discard the data, so the
+ * format's CRCs and the sizes in the headers are checked without writing
+ * anything to disk. Returns [[cPath, cError], ...] for the entries that
+ * failed, in archive order; an empty list means the archive is intact.
+ * A failure that stops the walk itself, such as a truncated archive, is
+ * reported last with an empty path. ZIP archives are checked by several
+ * readers at once on the worker pool.
  */
-RING_FUNC(ring_archive_write_add_filter_none)
+RING_FUNC(ring_archive_verify)
 {
 	if (RING_API_PARACOUNT != 1)
 	{
 		RING_API_ERROR(RING_API_MISS1PARA);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (!RING_API_ISSTRING(1))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	ArchiveScan scan;
+	memset(&scan, 0, sizeof(scan));
+	scan.cArchivePath = RING_API_GETSTRING(1);
+	archive_scan_run(&scan);
+	if (!scan.lOpened)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		RING_API_ERROR("Failed to open archive");
+		archive_scan_free(&scan);
 		return;
 	}
 
-	int result = archive_write_add_filter_none(a);
-	RING_API_RETNUMBER((double)result);
+	VM *pVM = (VM *)pPointer;
+	List *pResults = RING_API_NEWLIST;
+	for (int i = 0; i < scan.nEntries; i++)
+	{
+		List *pRow = ring_list_newlist_gc(pVM->pRingState, pResults);
+		ring_list_addstring_gc(pVM->pRingState, pRow, scan.aEntries[i].cPath);
+		ring_list_addstring_gc(pVM->pRingState, pRow, scan.aEntries[i].cError);
+	}
+	if (scan.lFailed)
+	{
+		List *pRow = ring_list_newlist_gc(pVM->pRingState, pResults);
+		ring_list_addstring_gc(pVM->pRingState, pRow, "");
+		ring_list_addstring_gc(pVM->pRingState, pRow, scan.cError ? scan.cError : "Failed to read archive");
+	}
+	archive_scan_free(&scan);
+	RING_API_RETLIST(pResults);
 }
 
 /*
- * archive_write_open_filename(pArchive, cFilename) -> nResult
+ * archive_read_add_passphrase(pArchive, cPassphrase) -> nResult
  *
- * Open file for writing archive.
+ * Add a passphrase for reading encrypted archives.
  */
-RING_FUNC(ring_archive_write_open_filename)
+RING_FUNC(ring_archive_read_add_passphrase)
 {
 	if (RING_API_PARACOUNT != 2)
 	{
@@ -871,436 +9274,698 @@ RING_FUNC(ring_archive_write_open_filename)
 		return;
 	}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
 	if (!a)
 	{
 		RING_API_ERROR(RING_API_NULLPOINTER);
 		return;
 	}
 
-	const char *filename = RING_API_GETSTRING(2);
-	int result = archive_write_open_filename(a, filename);
+	const char *passphrase = RING_API_GETSTRING(2);
+	int result = archive_read_add_passphrase(a, passphrase);
 	RING_API_RETNUMBER((double)result);
 }
 
 /*
- * archive_write_open_memory(pArchive) -> aMemBuffer [pBuffer, pUsed]
+ * archive_read_file(cArchivePath, cEntryPath) -> cData
  *
- * Open memory buffer for writing archive.
- * Returns list with buffer and used pointers.
- * Call archive_memory_get_data() to get data, then archive_memory_free() to free.
+ * Read a single file from an archive. With archive_set_cache_size() set,
+ * repeated reads of an unchanged archive are served from memory.
  */
-RING_FUNC(ring_archive_write_open_memory)
+RING_FUNC(ring_archive_read_file)
 {
-	if (RING_API_PARACOUNT != 1)
+	if (RING_API_PARACOUNT != 2)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
+		RING_API_ERROR(RING_API_MISS2PARA);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (!RING_API_ISSTRING(1) || !RING_API_ISSTRING(2))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	const char *archive_path = RING_API_GETSTRING(1);
+	const char *entry_path = RING_API_GETSTRING(2);
+
+	struct stat st;
+	char *cKey = NULL;
+	size_t nKeySize = 0;
+	if (g_tArchiveCache.nLimit && stat(archive_path, &st) == 0)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		cKey = archive_cache_key(archive_path, &st, entry_path, (size_t)RING_API_GETSTRINGSIZE(2), &nKeySize);
+	}
+	if (cKey)
+	{
+		archive_mutex_lock(&g_tArchiveCache.mutex);
+		ArchiveCacheEntry *pHit = archive_cache_find(cKey, nKeySize, &st);
+		if (pHit && pHit->nSize)
+		{
+			RING_API_RETSTRING2(pHit->pData, pHit->nSize);
+		}
+		archive_mutex_unlock(&g_tArchiveCache.mutex);
+		if (pHit)
+		{
+			free(cKey);
+			return;
+		}
 	}
 
-	VM *pVM = (VM *)pPointer;
-
-	size_t buffer_size = 1024 * 1024; /* 1MB */
-	void *buffer = ring_state_malloc(pVM->pRingState, buffer_size);
-	size_t *used = (size_t *)ring_state_malloc(pVM->pRingState, sizeof(size_t));
-	*used = 0;
+	struct archive *a = archive_read_new();
+	struct archive_entry *entry;
 
-	int result = archive_write_open_memory(a, buffer, buffer_size, used);
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
 
-	if (result != ARCHIVE_OK)
+	if (archive_read_open_path(a, archive_path, 10240) != ARCHIVE_OK)
 	{
-		ring_state_free(pVM->pRingState, buffer);
-		ring_state_free(pVM->pRingState, used);
-		RING_API_ERROR("Failed to open memory for writing");
+		archive_read_free(a);
+		free(cKey);
 		return;
 	}
 
-	List *pList = RING_API_NEWLIST;
-	ring_list_addcpointer_gc(pVM->pRingState, pList, buffer, "buffer");
-	ring_list_addcpointer_gc(pVM->pRingState, pList, used, "size_ptr");
-	RING_API_RETLIST(pList);
-}
+	VM *pVM = (VM *)pPointer;
+	char *result_data = NULL;
+	size_t result_size = 0;
+	int found = 0;
+	ArchiveCodec dict_codec;
+	ArchiveMemory dict_out;
+	int has_dict = 0;
+	int dict_read = 0;
+	la_int64_t nIndex = -1;
+	memset(&dict_out, 0, sizeof(dict_out));
 
-/*
- * archive_memory_get_data(aMemBuffer) -> cData
- *
- * Get archive data from memory buffer as a string.
- */
-RING_FUNC(ring_archive_memory_get_data)
-{
-	if (RING_API_PARACOUNT != 1)
+	while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
+		int lHeld;
+		if (archive_dict_open_entry(a, entry, ++nIndex, &dict_codec, &has_dict, &dict_out, &lHeld))
+		{
+			continue;
+		}
+
+		const char *pathname = archive_entry_pathname(entry);
+		if (pathname && strcmp(pathname, entry_path) == 0)
+		{
+			found = 1;
+			if (lHeld)
+			{
+				/* An ordinary file read ahead by archive_dict_open_entry() */
+				dict_read = 1;
+				break;
+			}
+			if (has_dict)
+			{
+				unsigned char head[RING_ARCHIVE_DICTIONARY_MARK_SIZE];
+				la_ssize_t head_size;
+				la_int64_t dict_size = archive_dict_peek(a, entry, head, &head_size);
+				dict_read = archive_dict_read_data(a, &dict_codec, dict_size >= 0, head, head_size, &dict_out, NULL, NULL);
+				break;
+			}
+			la_int64_t size = archive_entry_size(entry);
+			if (size > 0)
+			{
+				result_data = (char *)ring_state_malloc(pVM->pRingState, size);
+				result_size = archive_read_data(a, result_data, size);
+			}
+			break;
+		}
+		archive_read_data_skip(a);
 	}
-	if (!RING_API_ISLIST(1))
+
+	if (has_dict)
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		archive_codec_end(&dict_codec);
 	}
+	archive_read_close(a);
+	archive_read_free(a);
 
-	List *pList = RING_API_GETLIST(1);
-	if (ring_list_getsize(pList) != 2)
+	if (cKey && found && (dict_read || (!has_dict && (la_ssize_t)result_size >= 0)))
 	{
-		RING_API_ERROR("Invalid memory buffer list");
-		return;
+		if (dict_read)
+		{
+			archive_cache_put(cKey, nKeySize, &st, dict_out.pData, dict_out.nSize);
+		}
+		else
+		{
+			archive_cache_put(cKey, nKeySize, &st, result_data, result_data ? result_size : 0);
+		}
 	}
+	free(cKey);
 
-	/* Get buffer pointer from first sublist */
-	List *pBufferList = ring_list_getlist(pList, 1);
-	void *buffer = ring_list_getpointer(pBufferList, RING_CPOINTER_POINTER);
-
-	/* Get used pointer from second sublist */
-	List *pUsedList = ring_list_getlist(pList, 2);
-	size_t *used = (size_t *)ring_list_getpointer(pUsedList, RING_CPOINTER_POINTER);
-
-	if (!buffer || !used)
+	if (dict_read && dict_out.nSize)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		RING_API_RETSTRING2(dict_out.pData, dict_out.nSize);
 	}
+	archive_memory_clear(&dict_out);
 
-	RING_API_RETSTRING2((const char *)buffer, *used);
+	if (result_data)
+	{
+		RING_API_RETSTRING2(result_data, result_size);
+		ring_state_free(pVM->pRingState, result_data);
+	}
 }
 
 /*
- * archive_memory_free(aMemBuffer)
+ * archive_set_cache_size(nMaxBytes) -> nMaxBytes
  *
- * Free memory buffer created by archive_write_open_memory().
+ * Give archive_read_file() a cache of decoded entries of up to nMaxBytes,
+ * shared by all threads. 0 (the default) turns it off and frees it;
+ * shrinking evicts the least recently used entries.
  */
-RING_FUNC(ring_archive_memory_free)
+RING_FUNC(ring_archive_set_cache_size)
 {
 	if (RING_API_PARACOUNT != 1)
 	{
 		RING_API_ERROR(RING_API_MISS1PARA);
 		return;
 	}
-	if (!RING_API_ISLIST(1))
+	if (!RING_API_ISNUMBER(1))
 	{
 		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	VM *pVM = (VM *)pPointer;
-	List *pList = RING_API_GETLIST(1);
-
-	if (ring_list_getsize(pList) != 2)
+	double nMaxBytes = RING_API_GETNUMBER(1);
+	archive_mutex_lock(&g_tArchiveCache.mutex);
+	g_tArchiveCache.nLimit = nMaxBytes > 0 ? (size_t)nMaxBytes : 0;
+	archive_cache_trim();
+	if (!g_tArchiveCache.nLimit)
 	{
-		RING_API_ERROR("Invalid memory buffer list");
-		return;
+		archive_map_free(&g_tArchiveCache.tEntries, NULL);
 	}
+	size_t nLimit = g_tArchiveCache.nLimit;
+	archive_mutex_unlock(&g_tArchiveCache.mutex);
+	RING_API_RETNUMBER((double)nLimit);
+}
 
-	/* Get buffer pointer from first sublist */
-	List *pBufferList = ring_list_getlist(pList, 1);
-	void *buffer = ring_list_getpointer(pBufferList, RING_CPOINTER_POINTER);
-
-	/* Get used pointer from second sublist */
-	List *pUsedList = ring_list_getlist(pList, 2);
-	size_t *used = (size_t *)ring_list_getpointer(pUsedList, RING_CPOINTER_POINTER);
+/*
+ * archive_cache_stats() -> [nHits, nMisses, nBytes, nEntries, nMaxBytes]
+ *
+ * Counters of the archive_read_file() cache. nBytes includes the
+ * bookkeeping charged against the budget.
+ */
+RING_FUNC(ring_archive_cache_stats)
+{
+	VM *pVM = (VM *)pPointer;
+	List *pList = RING_API_NEWLIST;
+	archive_mutex_lock(&g_tArchiveCache.mutex);
+	ring_list_adddouble_gc(pVM->pRingState, pList, g_tArchiveCache.nHits);
+	ring_list_adddouble_gc(pVM->pRingState, pList, g_tArchiveCache.nMisses);
+	ring_list_adddouble_gc(pVM->pRingState, pList, (double)g_tArchiveCache.nBytes);
+	ring_list_adddouble_gc(pVM->pRingState, pList, (double)g_tArchiveCache.tEntries.nCount);
+	ring_list_adddouble_gc(pVM->pRingState, pList, (double)g_tArchiveCache.nLimit);
+	archive_mutex_unlock(&g_tArchiveCache.mutex);
+	RING_API_RETLIST(pList);
+}
 
-	if (buffer)
-	{
-		ring_state_free(pVM->pRingState, buffer);
-	}
-	if (used)
+/*
+ * archive_cache_clear()
+ *
+ * Empty the archive_read_file() cache and reset its counters, keeping
+ * the budget.
+ */
+RING_FUNC(ring_archive_cache_clear)
+{
+	archive_mutex_lock(&g_tArchiveCache.mutex);
+	while (g_tArchiveCache.pTail)
 	{
-		ring_state_free(pVM->pRingState, used);
+		archive_cache_drop(g_tArchiveCache.pTail);
 	}
+	g_tArchiveCache.nHits = 0;
+	g_tArchiveCache.nMisses = 0;
+	archive_mutex_unlock(&g_tArchiveCache.mutex);
 }
 
+/* ============================================================================
+ * Ring Functions - Shared Indexes
+ * ============================================================================
+ */
+
 /*
- * archive_write_header(pArchive, pEntry) -> nResult
- *
- * Write entry header.
+ * archive_index_open() reads the headers of an archive once into an
+ * index that never changes afterwards, so threads can look entries up in
+ * it without locking. Entry data is read through cursors, each with its
+ * own libarchive reader: archive_index_read() borrows an idle cursor or
+ * makes a new one, so reads from several threads run side by side. A
+ * cursor keeps its place between reads and reopens the archive only to
+ * go backwards; in uncompressed TAR files it opens the archive right at
+ * the wanted header instead.
  */
-RING_FUNC(ring_archive_write_header)
+#define RING_ARCHIVE_INDEX_IDLE 16
+#define RING_ARCHIVE_INDEX_CHANGED "Archive changed since it was indexed"
+
+typedef struct ArchiveIndexEntry
 {
-	if (RING_API_PARACOUNT != 2)
+	char *cPath;
+	la_int64_t nSize;
+	int nType;
+	la_int64_t nMtime;
+	la_int64_t nHeader;
+} ArchiveIndexEntry;
+
+typedef struct ArchiveCursor
+{
+	struct archive *a;
+	int fd;
+	int nNext;
+	ArchiveCodec tCodec;
+	int lCodec;
+	ArchiveMemory tOut;
+	struct ArchiveCursor *pNext;
+} ArchiveCursor;
+
+typedef struct ArchiveIndex
+{
+	char *cArchivePath;
+	la_int64_t nFileSize;
+	la_int64_t nFileMtime;
+	long nFileMtimeNsec;
+	ArchiveIndexEntry *aEntries;
+	int nEntries;
+	int nDictEntry;
+	ArchiveDict *pDict;
+	int lDirect;
+	ArchiveMap tPaths;
+	ArchiveMutex mutex;
+	ArchiveCursor *pIdle;
+	int nIdle;
+} ArchiveIndex;
+
+static void archive_cursor_close(ArchiveCursor *pCursor)
+{
+	if (pCursor->a)
 	{
-		RING_API_ERROR(RING_API_MISS2PARA);
-		return;
+		archive_read_free(pCursor->a);
+		pCursor->a = NULL;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (pCursor->fd >= 0)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		close(pCursor->fd);
+		pCursor->fd = -1;
 	}
-	if (!RING_API_ISCPOINTER(2))
+}
+
+static void archive_cursor_free(ArchiveCursor *pCursor)
+{
+	archive_cursor_close(pCursor);
+	if (pCursor->lCodec)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		archive_codec_end(&pCursor->tCodec);
 	}
+	archive_memory_clear(&pCursor->tOut);
+	free(pCursor);
+}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(2, "archive_entry");
-
-	if (!a || !entry)
+static ArchiveCursor *archive_cursor_new(ArchiveIndex *pIndex)
+{
+	ArchiveCursor *pCursor = (ArchiveCursor *)calloc(1, sizeof(ArchiveCursor));
+	if (!pCursor)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		return NULL;
+	}
+	pCursor->fd = -1;
+	if (pIndex->pDict)
+	{
+		pCursor->lCodec = archive_dict_open_codec(&pCursor->tCodec, pIndex->pDict);
+		if (!pCursor->lCodec)
+		{
+			archive_cursor_free(pCursor);
+			return NULL;
+		}
 	}
+	return pCursor;
+}
 
-	int result = archive_write_header(a, entry);
-	RING_API_RETNUMBER((double)result);
+/* Whether the archive file still has the size and mtime it was indexed with */
+static int archive_index_unchanged(ArchiveIndex *pIndex, const struct stat *st)
+{
+	return (la_int64_t)st->st_size == pIndex->nFileSize && (la_int64_t)st->st_mtime == pIndex->nFileMtime &&
+		   archive_stat_mtime_nsec(st) == pIndex->nFileMtimeNsec;
 }
 
-/*
- * archive_write_data(pArchive, cData) -> nBytesWritten
- *
- * Write data for current entry.
- */
-RING_FUNC(ring_archive_write_data)
+/* Open a fresh reader for pCursor that returns entry nEntry next. Returns NULL or an error. */
+static const char *archive_cursor_open(ArchiveIndex *pIndex, ArchiveCursor *pCursor, int nEntry)
 {
-	if (RING_API_PARACOUNT != 2)
-	{
-		RING_API_ERROR(RING_API_MISS2PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
+	struct stat st;
+	archive_cursor_close(pCursor);
+	pCursor->a = archive_read_new();
+	if (!pCursor->a)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		return "Failed to create archive reader";
 	}
-	if (!RING_API_ISSTRING(2))
+
+	if (pIndex->lDirect)
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		pCursor->fd = open(pIndex->cArchivePath, O_RDONLY | O_BINARY);
+		if (pCursor->fd < 0)
+		{
+			return "Failed to open archive";
+		}
+		if (fstat(pCursor->fd, &st) != 0 || !archive_index_unchanged(pIndex, &st))
+		{
+			return RING_ARCHIVE_INDEX_CHANGED;
+		}
+		if (lseek(pCursor->fd, (off_t)pIndex->aEntries[nEntry].nHeader, SEEK_SET) < 0)
+		{
+			return "Failed to seek in archive";
+		}
+		archive_read_support_format_tar(pCursor->a);
+		if (archive_read_open_fd(pCursor->a, pCursor->fd, 10240) != ARCHIVE_OK)
+		{
+			return "Failed to open archive";
+		}
+		pCursor->nNext = nEntry;
+		return NULL;
 	}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	if (stat(pIndex->cArchivePath, &st) != 0 || !archive_index_unchanged(pIndex, &st))
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		return RING_ARCHIVE_INDEX_CHANGED;
 	}
-
-	const char *data = RING_API_GETSTRING(2);
-	size_t size = RING_API_GETSTRINGSIZE(2);
-
-	la_ssize_t written = archive_write_data(a, data, size);
-	RING_API_RETNUMBER((double)written);
+	archive_read_support_filter_all(pCursor->a);
+	archive_read_support_format_all(pCursor->a);
+	if (archive_read_open_path(pCursor->a, pIndex->cArchivePath, 10240) != ARCHIVE_OK)
+	{
+		return "Failed to open archive";
+	}
+	pCursor->nNext = 0;
+	return NULL;
 }
 
 /*
- * archive_write_finish_entry(pArchive) -> nResult
- *
- * Finish writing current entry.
+ * Read entry nEntry into pCursor->tOut, reopening or skipping ahead as
+ * needed. Returns NULL or an error; on error the cursor starts over on
+ * its next read.
  */
-RING_FUNC(ring_archive_write_finish_entry)
+static const char *archive_cursor_read(ArchiveIndex *pIndex, ArchiveCursor *pCursor, int nEntry)
 {
-	if (RING_API_PARACOUNT != 1)
+	ArchiveIndexEntry *pEntry = &pIndex->aEntries[nEntry];
+	struct archive_entry *entry = NULL;
+	const char *cError = NULL;
+	pCursor->tOut.nSize = 0;
+
+	if (!pCursor->a || pCursor->nNext > nEntry || (pIndex->lDirect && pCursor->nNext != nEntry))
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
+		cError = archive_cursor_open(pIndex, pCursor, nEntry);
 	}
-	if (!RING_API_ISCPOINTER(1))
+	while (!cError && pCursor->nNext <= nEntry)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		int r = archive_read_next_header(pCursor->a, &entry);
+		if (r != ARCHIVE_OK && r != ARCHIVE_WARN)
+		{
+			cError = r == ARCHIVE_EOF ? RING_ARCHIVE_INDEX_CHANGED : "Failed to read archive";
+		}
+		pCursor->nNext++;
+	}
+	if (!cError && (!archive_entry_pathname(entry) || strcmp(archive_entry_pathname(entry), pEntry->cPath) != 0))
+	{
+		cError = RING_ARCHIVE_INDEX_CHANGED;
 	}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	if (!cError && pCursor->lCodec)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		unsigned char head[RING_ARCHIVE_DICTIONARY_MARK_SIZE];
+		la_ssize_t head_size;
+		la_int64_t dict_size = archive_dict_peek(pCursor->a, entry, head, &head_size);
+		if (!archive_dict_read_data(pCursor->a, &pCursor->tCodec, dict_size >= 0, head, head_size, &pCursor->tOut,
+									NULL, NULL))
+		{
+			cError = "Failed to decode entry data";
+		}
+	}
+	else if (!cError)
+	{
+		size_t nExpected = pEntry->nSize > 0 ? (size_t)pEntry->nSize : 0;
+		if (!archive_memory_reserve(&pCursor->tOut, nExpected + 1))
+		{
+			cError = "Failed to allocate entry data";
+		}
+		while (!cError)
+		{
+			if (pCursor->tOut.nSize == pCursor->tOut.nCapacity &&
+				!archive_memory_reserve(&pCursor->tOut, pCursor->tOut.nCapacity + RING_ARCHIVE_CODEC_CHUNK))
+			{
+				cError = "Failed to allocate entry data";
+				break;
+			}
+			la_ssize_t len = archive_read_data(pCursor->a, pCursor->tOut.pData + pCursor->tOut.nSize,
+											   pCursor->tOut.nCapacity - pCursor->tOut.nSize);
+			if (len < 0)
+			{
+				cError = "Failed to read entry data";
+			}
+			else if (len == 0)
+			{
+				break;
+			}
+			else
+			{
+				pCursor->tOut.nSize += (size_t)len;
+			}
+		}
 	}
 
-	int result = archive_write_finish_entry(a);
-	RING_API_RETNUMBER((double)result);
+	if (cError)
+	{
+		archive_cursor_close(pCursor);
+	}
+	return cError;
 }
 
 /*
- * archive_write_close(pArchive) -> nResult
- *
- * Close archive writer.
+ * Take an idle cursor for entry nEntry, preferring one that can get
+ * there without reopening the archive, or make a new one.
  */
-RING_FUNC(ring_archive_write_close)
+static ArchiveCursor *archive_index_borrow(ArchiveIndex *pIndex, int nEntry)
 {
-	if (RING_API_PARACOUNT != 1)
-	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
-	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+	archive_mutex_lock(&pIndex->mutex);
+	ArchiveCursor **ppBest = NULL;
+	int lBestReady = 0;
+	for (ArchiveCursor **ppCursor = &pIndex->pIdle; *ppCursor; ppCursor = &(*ppCursor)->pNext)
+	{
+		ArchiveCursor *pCursor = *ppCursor;
+		int lReady = pCursor->a && (pIndex->lDirect ? pCursor->nNext == nEntry : pCursor->nNext <= nEntry);
+		if (!ppBest || (lReady && (!lBestReady || pCursor->nNext > (*ppBest)->nNext)))
+		{
+			ppBest = ppCursor;
+			lBestReady = lReady;
+		}
 	}
-
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	ArchiveCursor *pCursor = NULL;
+	if (ppBest)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		pCursor = *ppBest;
+		*ppBest = pCursor->pNext;
+		pIndex->nIdle--;
 	}
-
-	int result = archive_write_close(a);
-	RING_API_RETNUMBER((double)result);
+	archive_mutex_unlock(&pIndex->mutex);
+	return pCursor ? pCursor : archive_cursor_new(pIndex);
 }
 
-RING_FUNC(ring_archive_write_set_passphrase)
+static void archive_index_return(ArchiveIndex *pIndex, ArchiveCursor *pCursor)
 {
-	if (RING_API_PARACOUNT != 2)
+	archive_mutex_lock(&pIndex->mutex);
+	int lKeep = pIndex->nIdle < RING_ARCHIVE_INDEX_IDLE;
+	if (lKeep)
 	{
-		RING_API_ERROR(RING_API_MISS2PARA);
-		return;
+		pCursor->pNext = pIndex->pIdle;
+		pIndex->pIdle = pCursor;
+		pIndex->nIdle++;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	archive_mutex_unlock(&pIndex->mutex);
+	if (!lKeep)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		archive_cursor_free(pCursor);
 	}
-	if (!RING_API_ISSTRING(2))
+}
+
+static void archive_index_free(ArchiveIndex *pIndex)
+{
+	while (pIndex->pIdle)
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		ArchiveCursor *pCursor = pIndex->pIdle;
+		pIndex->pIdle = pCursor->pNext;
+		archive_cursor_free(pCursor);
 	}
-
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	for (int i = 0; i < pIndex->nEntries; i++)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		free(pIndex->aEntries[i].cPath);
 	}
+	free(pIndex->aEntries);
+	archive_map_free(&pIndex->tPaths, NULL);
+	archive_dict_release(pIndex->pDict);
+	archive_mutex_destroy(&pIndex->mutex);
+	free(pIndex->cArchivePath);
+	free(pIndex);
+}
 
-	const char *passphrase = RING_API_GETSTRING(2);
-	int result = archive_write_set_passphrase(a, passphrase);
-	RING_API_RETNUMBER((double)result);
+static void free_archive_index(void *pState, void *pPointer)
+{
+	archive_index_free((ArchiveIndex *)pPointer);
 }
 
-RING_FUNC(ring_archive_write_set_options)
+/* Read every header of the archive at path. Returns NULL with the reason in cError on failure. */
+static ArchiveIndex *archive_index_build(const char *path, char *cError, size_t nErrorSize)
 {
-	if (RING_API_PARACOUNT != 2)
+	struct stat st;
+	if (stat(path, &st) != 0)
 	{
-		RING_API_ERROR(RING_API_MISS2PARA);
-		return;
+		snprintf(cError, nErrorSize, "Failed to open archive");
+		return NULL;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	ArchiveIndex *pIndex = (ArchiveIndex *)calloc(1, sizeof(ArchiveIndex));
+	if (!pIndex || !(pIndex->cArchivePath = strdup(path)))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		free(pIndex);
+		snprintf(cError, nErrorSize, "Failed to allocate index");
+		return NULL;
 	}
-	if (!RING_API_ISSTRING(2))
+	archive_mutex_init(&pIndex->mutex);
+	pIndex->nFileSize = (la_int64_t)st.st_size;
+	pIndex->nFileMtime = (la_int64_t)st.st_mtime;
+	pIndex->nFileMtimeNsec = archive_stat_mtime_nsec(&st);
+	pIndex->nDictEntry = -1;
+
+	struct archive *a = archive_read_new();
+	struct archive_entry *entry;
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	if (archive_read_open_path(a, path, 10240) != ARCHIVE_OK)
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		archive_read_free(a);
+		archive_index_free(pIndex);
+		snprintf(cError, nErrorSize, "Failed to open archive");
+		return NULL;
 	}
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
-	if (!a)
+	const char *cFailure = NULL;
+	int nCapacity = 0;
+	int r;
+	while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK || r == ARCHIVE_WARN)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		if (pIndex->nEntries == nCapacity)
+		{
+			nCapacity = nCapacity ? nCapacity * 2 : 256;
+			ArchiveIndexEntry *aEntries =
+				(ArchiveIndexEntry *)realloc(pIndex->aEntries, sizeof(ArchiveIndexEntry) * nCapacity);
+			if (!aEntries)
+			{
+				cFailure = "Failed to allocate index";
+				break;
+			}
+			pIndex->aEntries = aEntries;
+		}
+		const char *pathname = archive_entry_pathname(entry);
+		ArchiveIndexEntry *pEntry = &pIndex->aEntries[pIndex->nEntries];
+		pEntry->cPath = strdup(pathname ? pathname : "");
+		if (!pEntry->cPath)
+		{
+			cFailure = "Failed to allocate index";
+			break;
+		}
+		pEntry->nSize = archive_entry_size(entry);
+		pEntry->nType = archive_entry_ring_type(entry);
+		pEntry->nMtime = (la_int64_t)archive_entry_mtime(entry);
+		pEntry->nHeader = archive_read_header_position(a);
+		if (archive_dict_is_entry(entry, pIndex->nEntries))
+		{
+			ArchiveMemory tData;
+			memset(&tData, 0, sizeof(tData));
+			if (archive_dict_load_entry(a, entry, &tData, &pIndex->pDict))
+			{
+				pIndex->nDictEntry = pIndex->nEntries;
+			}
+			archive_memory_clear(&tData);
+		}
+		else if (pIndex->pDict)
+		{
+			/* Report files packed with the dictionary at their original size */
+			unsigned char head[RING_ARCHIVE_DICTIONARY_MARK_SIZE];
+			la_ssize_t head_size;
+			la_int64_t dict_size = archive_dict_peek(a, entry, head, &head_size);
+			if (dict_size >= 0)
+			{
+				pEntry->nSize = dict_size;
+			}
+		}
+		pIndex->nEntries++;
 	}
-
-	const char *options = RING_API_GETSTRING(2);
-	int result = archive_write_set_options(a, options);
-	RING_API_RETNUMBER((double)result);
-}
-
-/* ============================================================================
- * Ring Functions - Archive Entry
- * ============================================================================
- */
-
-/*
- * archive_entry_new() -> pEntry
- *
- * Create a new archive entry.
- */
-RING_FUNC(ring_archive_entry_new)
-{
-	struct archive_entry *entry = archive_entry_new();
-	if (!entry)
+	if (!cFailure && r != ARCHIVE_EOF)
 	{
-		RING_API_ERROR("Failed to create archive entry");
-		return;
+		cFailure = archive_error_string(a) ? archive_error_string(a) : "Failed to read archive";
 	}
-	RING_API_RETMANAGEDCPOINTER(entry, "archive_entry", free_archive_entry);
-}
+	pIndex->lDirect = archive_filter_count(a) == 1 && !archive_parallel_filter(a) &&
+					  (archive_format(a) & ARCHIVE_FORMAT_BASE_MASK) == ARCHIVE_FORMAT_TAR;
 
-/*
- * archive_entry_clear(pEntry) -> pEntry
- *
- * Clear an archive entry for reuse.
- */
-RING_FUNC(ring_archive_entry_clear)
-{
-	if (RING_API_PARACOUNT != 1)
+	if (!cFailure && !archive_map_init(&pIndex->tPaths, (size_t)pIndex->nEntries))
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
+		cFailure = "Failed to allocate index";
 	}
-	if (!RING_API_ISCPOINTER(1))
+	for (int i = 0; !cFailure && i < pIndex->nEntries; i++)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		/* Like extraction, a later entry with the same path wins */
+		const char *cPath = pIndex->aEntries[i].cPath;
+		if (i != pIndex->nDictEntry && !archive_map_put(&pIndex->tPaths, cPath, strlen(cPath), &pIndex->aEntries[i]))
+		{
+			cFailure = "Failed to allocate index";
+		}
 	}
-
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	if (cFailure)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		snprintf(cError, nErrorSize, "%s", cFailure);
+	}
+	archive_read_free(a);
+	if (cFailure)
+	{
+		archive_index_free(pIndex);
+		return NULL;
 	}
+	return pIndex;
+}
 
-	archive_entry_clear(entry);
-	RING_API_RETCPOINTER(entry, "archive_entry");
+static void archive_index_add_row(ArchiveListTarget *pTarget, ArchiveIndexEntry *pEntry)
+{
+	archive_list_add_row(pTarget, pEntry->cPath, pEntry->nSize, pEntry->nType, pEntry->nMtime);
 }
 
 /*
- * archive_entry_clone(pEntry) -> pNewEntry
+ * archive_index_open(cArchivePath) -> pIndex
  *
- * Clone an archive entry.
+ * Read the headers of an archive into an index that any number of
+ * threads can share. Reads through the index fail with "Archive changed
+ * since it was indexed" once the file's size or mtime changes.
  */
-RING_FUNC(ring_archive_entry_clone)
+RING_FUNC(ring_archive_index_open)
 {
 	if (RING_API_PARACOUNT != 1)
 	{
 		RING_API_ERROR(RING_API_MISS1PARA);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
-	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
-	}
-
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	if (!RING_API_ISSTRING(1))
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	struct archive_entry *clone = archive_entry_clone(entry);
-	if (!clone)
+	char cError[256];
+	ArchiveIndex *pIndex = archive_index_build(RING_API_GETSTRING(1), cError, sizeof(cError));
+	if (!pIndex)
 	{
-		RING_API_ERROR("Failed to clone archive entry");
+		RING_API_ERROR(cError);
 		return;
 	}
-	RING_API_RETMANAGEDCPOINTER(clone, "archive_entry", free_archive_entry);
+	RING_API_RETMANAGEDCPOINTER(pIndex, "archive_index", free_archive_index);
 }
 
 /*
- * archive_entry_pathname(pEntry) -> cPathname
+ * archive_index_entries(pIndex) -> aEntries
  *
- * Get entry pathname.
+ * All entries as [pathname, size, type, mtime], like archive_list():
+ * an archive_create() dictionary is left out and files packed with it
+ * report their original size.
  */
-RING_FUNC(ring_archive_entry_pathname)
+RING_FUNC(ring_archive_index_entries)
 {
 	if (RING_API_PARACOUNT != 1)
 	{
@@ -1313,23 +9978,32 @@ RING_FUNC(ring_archive_entry_pathname)
 		return;
 	}
 
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	ArchiveIndex *pIndex = (ArchiveIndex *)RING_API_GETCPOINTER(1, "archive_index");
+	if (!pIndex)
 	{
 		RING_API_ERROR(RING_API_NULLPOINTER);
 		return;
 	}
 
-	const char *pathname = archive_entry_pathname(entry);
-	RING_API_RETSTRING(pathname);
+	VM *pVM = (VM *)pPointer;
+	ArchiveListTarget target = {pVM->pRingState, RING_API_NEWLIST};
+	for (int i = 0; i < pIndex->nEntries; i++)
+	{
+		if (i != pIndex->nDictEntry)
+		{
+			archive_index_add_row(&target, &pIndex->aEntries[i]);
+		}
+	}
+	RING_API_RETLIST(target.pList);
 }
 
 /*
- * archive_entry_set_pathname(pEntry, cPathname)
+ * archive_index_find(pIndex, cEntryPath) -> aEntry
  *
- * Set entry pathname.
+ * The [pathname, size, type, mtime] row of an entry, or an empty list if
+ * the archive has no such entry.
  */
-RING_FUNC(ring_archive_entry_set_pathname)
+RING_FUNC(ring_archive_index_find)
 {
 	if (RING_API_PARACOUNT != 2)
 	{
@@ -1347,51 +10021,35 @@ RING_FUNC(ring_archive_entry_set_pathname)
 		return;
 	}
 
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	ArchiveIndex *pIndex = (ArchiveIndex *)RING_API_GETCPOINTER(1, "archive_index");
+	if (!pIndex)
 	{
 		RING_API_ERROR(RING_API_NULLPOINTER);
 		return;
 	}
 
-	archive_entry_set_pathname(entry, RING_API_GETSTRING(2));
-}
-
-/*
- * archive_entry_size(pEntry) -> nSize
- *
- * Get entry size.
- */
-RING_FUNC(ring_archive_entry_size)
-{
-	if (RING_API_PARACOUNT != 1)
-	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
-	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
-	}
-
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	VM *pVM = (VM *)pPointer;
+	List *pList = RING_API_NEWLIST;
+	ArchiveIndexEntry *pEntry = (ArchiveIndexEntry *)archive_map_get(&pIndex->tPaths, RING_API_GETSTRING(2),
+																	   (size_t)RING_API_GETSTRINGSIZE(2));
+	if (pEntry)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		ring_list_addstring_gc(pVM->pRingState, pList, pEntry->cPath);
+		ring_list_adddouble_gc(pVM->pRingState, pList, (double)pEntry->nSize);
+		ring_list_adddouble_gc(pVM->pRingState, pList, (double)pEntry->nType);
+		ring_list_adddouble_gc(pVM->pRingState, pList, (double)pEntry->nMtime);
 	}
-
-	la_int64_t size = archive_entry_size(entry);
-	RING_API_RETNUMBER((double)size);
+	RING_API_RETLIST(pList);
 }
 
 /*
- * archive_entry_set_size(pEntry, nSize)
+ * archive_index_read(pIndex, cEntryPath) -> cData
  *
- * Set entry size.
+ * Read a single file through the index, like archive_read_file(). Safe to
+ * call from several threads at once; each call gets a cursor of its own.
+ * Returns nothing if the archive has no such entry.
  */
-RING_FUNC(ring_archive_entry_set_size)
+RING_FUNC(ring_archive_index_read)
 {
 	if (RING_API_PARACOUNT != 2)
 	{
@@ -1403,987 +10061,1095 @@ RING_FUNC(ring_archive_entry_set_size)
 		RING_API_ERROR(RING_API_NOTPOINTER);
 		return;
 	}
-	if (!RING_API_ISNUMBER(2))
+	if (!RING_API_ISSTRING(2))
 	{
 		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	ArchiveIndex *pIndex = (ArchiveIndex *)RING_API_GETCPOINTER(1, "archive_index");
+	if (!pIndex)
 	{
 		RING_API_ERROR(RING_API_NULLPOINTER);
 		return;
 	}
 
-	archive_entry_set_size(entry, (la_int64_t)RING_API_GETNUMBER(2));
+	ArchiveIndexEntry *pEntry = (ArchiveIndexEntry *)archive_map_get(&pIndex->tPaths, RING_API_GETSTRING(2),
+																	   (size_t)RING_API_GETSTRINGSIZE(2));
+	if (!pEntry)
+	{
+		return;
+	}
+	ArchiveCursor *pCursor = archive_index_borrow(pIndex, (int)(pEntry - pIndex->aEntries));
+	if (!pCursor)
+	{
+		RING_API_ERROR("Failed to allocate cursor");
+		return;
+	}
+	const char *cError = archive_cursor_read(pIndex, pCursor, (int)(pEntry - pIndex->aEntries));
+	if (!cError)
+	{
+		RING_API_RETSTRING2(pCursor->tOut.pData, pCursor->tOut.nSize);
+	}
+	archive_index_return(pIndex, pCursor);
+	if (cError)
+	{
+		RING_API_ERROR(cError);
+	}
 }
 
-/*
- * archive_entry_filetype(pEntry) -> nType
- *
- * Get entry file type.
+/* ============================================================================
+ * Ring Functions - Async Jobs
+ * ============================================================================
  */
-RING_FUNC(ring_archive_entry_filetype)
+
+/* Dropping the last Ring reference cancels a job that is still running */
+static void free_archive_job(void *pState, void *pPointer)
 {
-	if (RING_API_PARACOUNT != 1)
+	ArchiveJob *pJob = (ArchiveJob *)pPointer;
+	pJob->lCancel = 1;
+	archive_job_release(pJob);
+}
+
+static int archive_job_add_row(void *pContext, const char *cPath, la_int64_t nSize, int nType, la_int64_t nMtime)
+{
+	ArchiveJob *pJob = (ArchiveJob *)pContext;
+	if (pJob->nRows == pJob->nRowsCapacity)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
-		return;
+		int nCapacity = pJob->nRowsCapacity ? pJob->nRowsCapacity * 2 : 256;
+		ArchiveListRow *aRows = (ArchiveListRow *)realloc(pJob->aRows, sizeof(ArchiveListRow) * nCapacity);
+		if (!aRows)
+		{
+			return 0;
+		}
+		pJob->aRows = aRows;
+		pJob->nRowsCapacity = nCapacity;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	ArchiveListRow *pRow = &pJob->aRows[pJob->nRows];
+	pRow->cPath = strdup(cPath);
+	if (!pRow->cPath)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		return 0;
 	}
+	pRow->nSize = nSize;
+	pRow->nType = nType;
+	pRow->nMtime = nMtime;
+	pJob->nRows++;
+	return 1;
+}
 
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+/* Worker thread body: run the job, publish the result and wake waiters */
+static void archive_job_main(void *pArg)
+{
+	ArchiveJob *pJob = (ArchiveJob *)pArg;
+	const char *cError = NULL;
+	int nResult = 0;
+
+	if (pJob->nKind != RING_ARCHIVE_JOB_CREATE)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
+		archive_job_measure(pJob, pJob->cArchivePath);
 	}
 
-	mode_t type = archive_entry_filetype(entry);
-	int ring_type = RING_ENTRY_FILE;
-
-	if (S_ISDIR(type))
+	switch (pJob->nKind)
 	{
-		ring_type = RING_ENTRY_DIR;
+	case RING_ARCHIVE_JOB_EXTRACT:
+		nResult = archive_extract_run(pJob->cArchivePath, pJob->cDestPath, pJob);
+		break;
+	case RING_ARCHIVE_JOB_LIST:
+		nResult = archive_list_run(pJob->cArchivePath, archive_job_add_row, pJob, pJob);
+		if (nResult == 0)
+		{
+			cError = "Failed to open archive";
+		}
+		else if (nResult < 0)
+		{
+			cError = "Failed to allocate entry list";
+		}
+		nResult = nResult > 0;
+		break;
+	case RING_ARCHIVE_JOB_CREATE:
+		nResult = archive_create_run(pJob->cArchivePath, pJob->aFiles, pJob->nFiles, pJob->nFormat,
+									 pJob->nCompression, &pJob->options, pJob, &cError);
+		break;
 	}
-	else if (S_ISLNK(type))
+
+	if (pJob->lCancel)
 	{
-		ring_type = RING_ENTRY_SYMLINK;
+		nResult = 0;
+		cError = archive_job_cancel_error(pJob);
 	}
 
-	RING_API_RETNUMBER((double)ring_type);
+	archive_mutex_lock(&pJob->mutex);
+	pJob->nResult = nResult;
+	pJob->cError = cError;
+	pJob->lDone = 1;
+	archive_cond_broadcast(&pJob->done);
+	archive_mutex_unlock(&pJob->mutex);
+	archive_job_release(pJob);
 }
 
-/*
- * archive_entry_set_filetype(pEntry, nType)
- *
- * Set entry file type.
- */
-RING_FUNC(ring_archive_entry_set_filetype)
+/* Queue pJob on the worker pool and return its handle to Ring */
+static void archive_job_start(void *pPointer, ArchiveJob *pJob)
 {
-	if (RING_API_PARACOUNT != 2)
+	pJob->nRefs++;
+	if (!archive_task_submit(archive_job_main, pJob, NULL))
 	{
-		RING_API_ERROR(RING_API_MISS2PARA);
+		pJob->nRefs = 1;
+		archive_job_release(pJob);
+		RING_API_ERROR("Failed to start archive job");
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	RING_API_RETMANAGEDCPOINTER(pJob, "archive_job", free_archive_job);
+}
+
+/* Fetch the job handle (or token, by cType) from parameter 1, raising an error if it is invalid */
+static ArchiveJob *archive_job_typed_param(void *pPointer, const char *cType)
+{
+	if (RING_API_PARACOUNT < 1)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		RING_API_ERROR(RING_API_MISS1PARA);
+		return NULL;
 	}
-	if (!RING_API_ISNUMBER(2))
+	if (!RING_API_ISCPOINTER(1))
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		RING_API_ERROR(RING_API_NOTPOINTER);
+		return NULL;
 	}
-
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	ArchiveJob *pJob = (ArchiveJob *)RING_API_GETCPOINTER(1, cType);
+	if (!pJob)
 	{
 		RING_API_ERROR(RING_API_NULLPOINTER);
-		return;
 	}
+	return pJob;
+}
 
-	int type = (int)RING_API_GETNUMBER(2);
-	mode_t mode;
+static ArchiveJob *archive_job_param(void *pPointer)
+{
+	return archive_job_typed_param(pPointer, "archive_job");
+}
 
-	switch (type)
+/* Return [nEntries, nBytes, nArchiveBytes, nArchiveSize] for pJob */
+static void archive_job_return_progress(void *pPointer, ArchiveJob *pJob)
+{
+	archive_mutex_lock(&pJob->mutex);
+	double aProgress[4] = {(double)pJob->nEntries, (double)pJob->nBytes, (double)pJob->nArchiveBytes,
+						   (double)pJob->nArchiveSize};
+	archive_mutex_unlock(&pJob->mutex);
+
+	VM *pVM = (VM *)pPointer;
+	List *pList = RING_API_NEWLIST;
+	for (int i = 0; i < 4; i++)
 	{
-	case RING_ENTRY_DIR:
-		mode = AE_IFDIR;
-		break;
-	case RING_ENTRY_SYMLINK:
-		mode = AE_IFLNK;
-		break;
-	case RING_ENTRY_FILE:
-	default:
-		mode = AE_IFREG;
-		break;
+		ring_list_adddouble_gc(pVM->pRingState, pList, aProgress[i]);
 	}
-
-	archive_entry_set_filetype(entry, mode);
+	RING_API_RETLIST(pList);
 }
 
 /*
- * archive_entry_perm(pEntry) -> nPerm
+ * archive_set_threads(nThreads) -> nThreads
  *
- * Get entry permissions.
+ * Size the worker pool shared by all background and parallel work.
+ * nThreads < 1 means one thread per CPU, which is also the default.
+ * Returns the size in effect.
  */
-RING_FUNC(ring_archive_entry_perm)
+RING_FUNC(ring_archive_set_threads)
 {
 	if (RING_API_PARACOUNT != 1)
 	{
 		RING_API_ERROR(RING_API_MISS1PARA);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
-	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
-	}
-
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	if (!RING_API_ISNUMBER(1))
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
+	RING_API_RETNUMBER(archive_workers_resize((int)RING_API_GETNUMBER(1)));
+}
 
-	RING_API_RETNUMBER((double)archive_entry_perm(entry));
+/*
+ * archive_get_threads() -> nThreads
+ *
+ * Size of the worker pool.
+ */
+RING_FUNC(ring_archive_get_threads)
+{
+	RING_API_RETNUMBER(archive_workers_size());
 }
 
 /*
- * archive_entry_set_perm(pEntry, nPerm)
+ * archive_extract_async(cArchivePath, cDestPath [, aOptions]) -> pJob
  *
- * Set entry permissions.
+ * Start archive_extract() on the worker pool. A :cancel token or
+ * :deadline makes the job finish with the matching error.
  */
-RING_FUNC(ring_archive_entry_set_perm)
+RING_FUNC(ring_archive_extract_async)
 {
-	if (RING_API_PARACOUNT != 2)
+	if (RING_API_PARACOUNT != 2 && RING_API_PARACOUNT != 3)
 	{
-		RING_API_ERROR(RING_API_MISS2PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
-	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARACOUNT);
 		return;
 	}
-	if (!RING_API_ISNUMBER(2))
+	if (!RING_API_ISSTRING(1) || !RING_API_ISSTRING(2) || (RING_API_PARACOUNT == 3 && !RING_API_ISLIST(3)))
 	{
 		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	ArchiveJob *pJob = archive_job_new(RING_ARCHIVE_JOB_EXTRACT, RING_API_GETSTRING(1));
+	if (pJob)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		pJob->cDestPath = strdup(RING_API_GETSTRING(2));
+		archive_job_set_limits(pJob, RING_API_PARACOUNT == 3 ? RING_API_GETLIST(3) : NULL);
+	}
+	if (!pJob || !pJob->cArchivePath || !pJob->cDestPath)
+	{
+		if (pJob)
+		{
+			archive_job_release(pJob);
+		}
+		RING_API_ERROR("Failed to allocate archive job");
 		return;
 	}
-
-	archive_entry_set_perm(entry, (mode_t)RING_API_GETNUMBER(2));
+	archive_job_start(pPointer, pJob);
 }
 
 /*
- * archive_entry_mtime(pEntry) -> nTime
+ * archive_list_async(cArchivePath [, aOptions]) -> pJob
  *
- * Get entry modification time.
+ * Start archive_list() on the worker pool. Takes the options of
+ * archive_extract_async().
  */
-RING_FUNC(ring_archive_entry_mtime)
+RING_FUNC(ring_archive_list_async)
 {
-	if (RING_API_PARACOUNT != 1)
+	if (RING_API_PARACOUNT != 1 && RING_API_PARACOUNT != 2)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
+		RING_API_ERROR(RING_API_BADPARACOUNT);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (!RING_API_ISSTRING(1) || (RING_API_PARACOUNT == 2 && !RING_API_ISLIST(2)))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	ArchiveJob *pJob = archive_job_new(RING_ARCHIVE_JOB_LIST, RING_API_GETSTRING(1));
+	if (!pJob || !pJob->cArchivePath)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		if (pJob)
+		{
+			archive_job_release(pJob);
+		}
+		RING_API_ERROR("Failed to allocate archive job");
 		return;
 	}
-
-	RING_API_RETNUMBER((double)archive_entry_mtime(entry));
+	archive_job_set_limits(pJob, RING_API_PARACOUNT == 2 ? RING_API_GETLIST(2) : NULL);
+	archive_job_start(pPointer, pJob);
 }
 
 /*
- * archive_entry_set_mtime(pEntry, nTime, nNsec)
+ * archive_create_async(cArchivePath, aFiles, nFormat, nCompression [, aOptions]) -> pJob
  *
- * Set entry modification time.
+ * Start archive_create() on the worker pool. Takes the same options;
+ * a :dictionary and a :cancel token are kept alive until the job ends.
  */
-RING_FUNC(ring_archive_entry_set_mtime)
+RING_FUNC(ring_archive_create_async)
 {
-	if (RING_API_PARACOUNT != 3)
+	if (RING_API_PARACOUNT != 4 && RING_API_PARACOUNT != 5)
 	{
-		RING_API_ERROR(RING_API_MISS3PARA);
+		RING_API_ERROR(RING_API_BADPARACOUNT);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (!RING_API_ISSTRING(1) || !RING_API_ISLIST(2) || !RING_API_ISNUMBER(3) || !RING_API_ISNUMBER(4))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
-	if (!RING_API_ISNUMBER(2) || !RING_API_ISNUMBER(3))
+	if (RING_API_PARACOUNT == 5 && !RING_API_ISLIST(5))
 	{
 		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	List *pFilesList = RING_API_GETLIST(2);
+	ArchiveCreateOptions options;
+	archive_create_options(RING_API_PARACOUNT == 5 ? RING_API_GETLIST(5) : NULL, &options);
+
+	ArchiveJob *pJob = archive_job_new(RING_ARCHIVE_JOB_CREATE, RING_API_GETSTRING(1));
+	int nSize = ring_list_getsize(pFilesList);
+	int lFailed = !pJob || !pJob->cArchivePath;
+	if (!lFailed)
+	{
+		pJob->nFormat = (int)RING_API_GETNUMBER(3);
+		pJob->nCompression = (int)RING_API_GETNUMBER(4);
+		archive_job_set_limits(pJob, RING_API_PARACOUNT == 5 ? RING_API_GETLIST(5) : NULL);
+		pJob->options.lDedup = options.lDedup;
+		if (options.pDict)
+		{
+			archive_dict_retain(options.pDict);
+			pJob->options.pDict = options.pDict;
+		}
+		if (options.cManifest)
+		{
+			pJob->options.cManifest = strdup(options.cManifest);
+			lFailed = !pJob->options.cManifest;
+		}
+		pJob->aFiles = (char **)malloc(sizeof(char *) * (nSize + 1));
+		lFailed = lFailed || !pJob->aFiles;
+	}
+	for (int i = 1; i <= nSize && !lFailed; i++)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		if (ring_list_isstring(pFilesList, i))
+		{
+			pJob->aFiles[pJob->nFiles] = strdup(ring_list_getstring(pFilesList, i));
+			lFailed = !pJob->aFiles[pJob->nFiles++];
+		}
+	}
+	if (lFailed)
+	{
+		if (pJob)
+		{
+			archive_job_release(pJob);
+		}
+		RING_API_ERROR("Failed to allocate archive job");
 		return;
 	}
-
-	archive_entry_set_mtime(entry, (time_t)RING_API_GETNUMBER(2), (long)RING_API_GETNUMBER(3));
+	archive_job_start(pPointer, pJob);
 }
 
 /*
- * archive_entry_symlink(pEntry) -> cTarget
+ * archive_job_poll(pJob) -> lDone
  *
- * Get symlink target.
+ * Check whether a job has finished, without waiting.
  */
-RING_FUNC(ring_archive_entry_symlink)
+RING_FUNC(ring_archive_job_poll)
 {
-	if (RING_API_PARACOUNT != 1)
+	ArchiveJob *pJob = archive_job_param(pPointer);
+	if (!pJob)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	archive_mutex_lock(&pJob->mutex);
+	int lDone = pJob->lDone;
+	archive_mutex_unlock(&pJob->mutex);
+	RING_API_RETNUMBER(lDone);
+}
+
+/*
+ * archive_job_wait(pJob [, nTimeoutMs]) -> lDone
+ *
+ * Block until the job finishes or nTimeoutMs passes. Without a timeout
+ * (or with a negative one) wait for as long as it takes.
+ */
+RING_FUNC(ring_archive_job_wait)
+{
+	ArchiveJob *pJob = archive_job_param(pPointer);
+	if (!pJob)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
 		return;
 	}
-
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	if (RING_API_PARACOUNT > 2 || (RING_API_PARACOUNT == 2 && !RING_API_ISNUMBER(2)))
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
+	long nTimeoutMs = RING_API_PARACOUNT == 2 ? (long)RING_API_GETNUMBER(2) : -1;
 
-	const char *symlink = archive_entry_symlink(entry);
-	RING_API_RETSTRING(symlink);
+	archive_mutex_lock(&pJob->mutex);
+	while (!pJob->lDone)
+	{
+		if (!archive_cond_wait(&pJob->done, &pJob->mutex, nTimeoutMs))
+		{
+			break;
+		}
+	}
+	int lDone = pJob->lDone;
+	archive_mutex_unlock(&pJob->mutex);
+	RING_API_RETNUMBER(lDone);
 }
 
 /*
- * archive_entry_set_symlink(pEntry, cTarget)
+ * archive_job_cancel(pJob)
  *
- * Set symlink target.
+ * Ask a running job to stop. It stops at the next entry or data block,
+ * closes its handles and finishes with an "Operation cancelled" error.
+ * Has no effect on a job that has already finished.
  */
-RING_FUNC(ring_archive_entry_set_symlink)
+RING_FUNC(ring_archive_job_cancel)
 {
-	if (RING_API_PARACOUNT != 2)
-	{
-		RING_API_ERROR(RING_API_MISS2PARA);
-		return;
-	}
-	if (!RING_API_ISCPOINTER(1))
+	ArchiveJob *pJob = archive_job_param(pPointer);
+	if (!pJob)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
 		return;
 	}
-	if (!RING_API_ISSTRING(2))
+	archive_mutex_lock(&pJob->mutex);
+	if (!pJob->lDone)
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		pJob->lCancel = 1;
 	}
+	archive_mutex_unlock(&pJob->mutex);
+}
 
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+/*
+ * archive_job_progress(pJob) -> [nEntries, nBytes, nArchiveBytes, nArchiveSize]
+ *
+ * Entries done so far, entry data bytes processed, bytes read from (or
+ * written to) the archive file and the archive size, which is 0 for
+ * archive_create_async() jobs.
+ */
+RING_FUNC(ring_archive_job_progress)
+{
+	ArchiveJob *pJob = archive_job_param(pPointer);
+	if (!pJob)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
 		return;
 	}
-
-	archive_entry_set_symlink(entry, RING_API_GETSTRING(2));
+	archive_job_return_progress(pPointer, pJob);
 }
 
 /*
- * archive_entry_is_directory(pEntry) -> lIsDir
+ * archive_job_result(pJob) -> lSuccess | aEntries
  *
- * Check if entry is a directory.
+ * Wait for the job and return what the synchronous function would have:
+ * lSuccess for extract and create jobs, the entry list for list jobs.
+ * Errors, including cancellation, are raised as Ring errors.
  */
-RING_FUNC(ring_archive_entry_is_directory)
+RING_FUNC(ring_archive_job_result)
 {
-	if (RING_API_PARACOUNT != 1)
+	ArchiveJob *pJob = archive_job_param(pPointer);
+	if (!pJob)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	archive_mutex_lock(&pJob->mutex);
+	while (!pJob->lDone)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		archive_cond_wait(&pJob->done, &pJob->mutex, -1);
 	}
+	archive_mutex_unlock(&pJob->mutex);
 
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	if (pJob->cError)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		RING_API_ERROR(pJob->cError);
+		return;
+	}
+	if (pJob->nKind != RING_ARCHIVE_JOB_LIST)
+	{
+		RING_API_RETNUMBER(pJob->nResult);
 		return;
 	}
 
-	mode_t type = archive_entry_filetype(entry);
-	RING_API_RETNUMBER(S_ISDIR(type) ? 1.0 : 0.0);
+	VM *pVM = (VM *)pPointer;
+	ArchiveListTarget target;
+	target.pRingState = pVM->pRingState;
+	target.pList = RING_API_NEWLIST;
+	for (int i = 0; i < pJob->nRows; i++)
+	{
+		ArchiveListRow *pRow = &pJob->aRows[i];
+		archive_list_add_row(&target, pRow->cPath, pRow->nSize, pRow->nType, pRow->nMtime);
+	}
+	RING_API_RETLIST(target.pList);
+}
+
+/* A token lives on while a running call or job still holds it */
+static void free_archive_token(void *pState, void *pPointer)
+{
+	archive_job_release((ArchiveJob *)pPointer);
 }
 
 /*
- * archive_entry_is_file(pEntry) -> lIsFile
+ * archive_token_new([nTimeoutMs]) -> pToken
  *
- * Check if entry is a regular file.
+ * Cancellation token for the :cancel option of archive_extract(),
+ * archive_list(), archive_create(), their async variants and the rows of
+ * archive_extract_many(). With nTimeoutMs > 0 the token also expires
+ * that many milliseconds from now. One token may be shared by several
+ * calls, even on different threads; their progress is added up in it.
  */
-RING_FUNC(ring_archive_entry_is_file)
+RING_FUNC(ring_archive_token_new)
 {
-	if (RING_API_PARACOUNT != 1)
+	if (RING_API_PARACOUNT > 1)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
+		RING_API_ERROR(RING_API_BADPARACOUNT);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (RING_API_PARACOUNT == 1 && !RING_API_ISNUMBER(1))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+	ArchiveJob *pToken = archive_job_new(RING_ARCHIVE_JOB_TOKEN, "");
+	if (!pToken || !pToken->cArchivePath)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		if (pToken)
+		{
+			archive_job_release(pToken);
+		}
+		RING_API_ERROR("Failed to allocate cancellation token");
 		return;
 	}
-
-	mode_t type = archive_entry_filetype(entry);
-	RING_API_RETNUMBER(S_ISREG(type) ? 1.0 : 0.0);
+	double nTimeout = RING_API_PARACOUNT == 1 ? RING_API_GETNUMBER(1) : 0;
+	if (nTimeout > 0)
+	{
+		pToken->nDeadline = archive_clock_ms() + nTimeout;
+	}
+	RING_API_RETMANAGEDCPOINTER(pToken, "archive_token", free_archive_token);
 }
 
 /*
- * archive_entry_is_symlink(pEntry) -> lIsSymlink
+ * archive_token_cancel(pToken)
  *
- * Check if entry is a symbolic link.
+ * Stop every call and job using the token at its next entry or data
+ * block. A cancelled token stays cancelled.
  */
-RING_FUNC(ring_archive_entry_is_symlink)
+RING_FUNC(ring_archive_token_cancel)
 {
-	if (RING_API_PARACOUNT != 1)
+	ArchiveJob *pToken = archive_job_typed_param(pPointer, "archive_token");
+	if (!pToken)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	pToken->lCancel = 1;
+}
+
+/*
+ * archive_token_cancelled(pToken) -> lCancelled
+ *
+ * Whether the token was cancelled or has expired.
+ */
+RING_FUNC(ring_archive_token_cancelled)
+{
+	ArchiveJob *pToken = archive_job_typed_param(pPointer, "archive_token");
+	if (!pToken)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
 		return;
 	}
+	RING_API_RETNUMBER(archive_job_cancelled(pToken));
+}
 
-	struct archive_entry *entry = (struct archive_entry *)RING_API_GETCPOINTER(1, "archive_entry");
-	if (!entry)
+/*
+ * archive_token_progress(pToken) -> [nEntries, nBytes, nArchiveBytes, nArchiveSize]
+ *
+ * Progress of the calls using the token, as archive_job_progress()
+ * reports it. After a call stopped by the token this is how far it got.
+ */
+RING_FUNC(ring_archive_token_progress)
+{
+	ArchiveJob *pToken = archive_job_typed_param(pPointer, "archive_token");
+	if (!pToken)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
 		return;
 	}
-
-	mode_t type = archive_entry_filetype(entry);
-	RING_API_RETNUMBER(S_ISLNK(type) ? 1.0 : 0.0);
+	archive_job_return_progress(pPointer, pToken);
 }
 
 /* ============================================================================
- * Ring Functions - Utility Functions
+ * Ring Functions - Compression
  * ============================================================================
  */
 
 /*
- * archive_error_string(pArchive) -> cErrorMessage
+ * Attach the pDict parameter nParam to pCodec. On failure the codec is
+ * freed and a Ring error has been raised.
+ */
+static int archive_codec_dict_param(void *pPointer, int nParam, ArchiveCodec *pCodec)
+{
+	const char *cError = RING_API_NOTPOINTER;
+	if (RING_API_ISCPOINTER(nParam))
+	{
+		ArchiveDict *pDict = (ArchiveDict *)RING_API_GETCPOINTER(nParam, "archive_zstd_dict");
+		cError = RING_API_NULLPOINTER;
+		if (pDict)
+		{
+			if (archive_codec_use_dict(pCodec, pDict))
+			{
+				return 1;
+			}
+			cError = pCodec->cError;
+		}
+	}
+	archive_codec_end(pCodec);
+	RING_API_ERROR(cError);
+	return 0;
+}
+
+/*
+ * archive_compress(cData, nCodec [, nLevel [, pDict]]) -> cCompressed
  *
- * Get last error message.
+ * Compress a buffer with one of the ARCHIVE_COMPRESSION_* codecs, without
+ * any archive framing. The output is the codec's standard stream format
+ * (.gz, .bz2, .xz, .lzma, .zst, .lz4 frame, raw Brotli), so it can be read
+ * by the usual tools. nLevel defaults to the codec's own default.
+ * With a zstd pDict from archive_zstd_dict_new() the dictionary's level is
+ * used instead.
  */
-RING_FUNC(ring_archive_error_string)
+RING_FUNC(ring_archive_compress)
 {
-	if (RING_API_PARACOUNT != 1)
+	if (RING_API_PARACOUNT < 2 || RING_API_PARACOUNT > 4)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
+		RING_API_ERROR(RING_API_BADPARACOUNT);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (!RING_API_ISSTRING(1) || !RING_API_ISNUMBER(2) || (RING_API_PARACOUNT >= 3 && !RING_API_ISNUMBER(3)))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	/* Works for both read and write archives - check type first */
-	List *pList = RING_API_GETLIST(1);
-	const char *ptype = ring_list_getstring(pList, RING_CPOINTER_TYPE);
-	struct archive *a = NULL;
-	if (strcmp(ptype, "archive_read") == 0)
-	{
-		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	}
-	else if (strcmp(ptype, "archive_write") == 0)
+	int level = RING_API_PARACOUNT >= 3 ? (int)RING_API_GETNUMBER(3) : -1;
+	ArchiveCodec codec;
+	if (!archive_codec_init(&codec, (int)RING_API_GETNUMBER(2), 1, level))
 	{
-		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+		RING_API_ERROR(codec.cError);
+		return;
 	}
-	if (!a)
+	if (RING_API_PARACOUNT == 4 && !archive_codec_dict_param(pPointer, 4, &codec))
 	{
 		return;
 	}
 
-	const char *err = archive_error_string(a);
-	if (err)
+	ArchiveMemory out;
+	memset(&out, 0, sizeof(out));
+	if (!archive_codec_run(&codec, RING_API_GETSTRING(1), (size_t)RING_API_GETSTRINGSIZE(1), RING_ARCHIVE_CODEC_FINISH,
+						   &out))
 	{
-		RING_API_RETSTRING(err);
+		const char *cError = codec.cError;
+		archive_memory_clear(&out);
+		archive_codec_end(&codec);
+		RING_API_ERROR(cError);
+		return;
 	}
+	archive_codec_end(&codec);
+
+	RING_API_RETSTRING2(out.nSize ? out.pData : "", out.nSize);
+	archive_memory_clear(&out);
 }
 
 /*
- * archive_errno(pArchive) -> nErrno
+ * archive_decompress(cData, nCodec [, nMaxSize [, pDict]]) -> cData
  *
- * Get last error number.
+ * Decompress a buffer produced by archive_compress() or the matching
+ * command-line tool. Concatenated gzip members, bzip2 streams, xz streams
+ * and zstd/lz4 frames are all decoded. Decompressing more than nMaxSize
+ * bytes is an error (default or 0: no limit). zstd data compressed with a
+ * dictionary needs the same pDict.
  */
-RING_FUNC(ring_archive_errno)
+RING_FUNC(ring_archive_decompress)
 {
-	if (RING_API_PARACOUNT != 1)
+	if (RING_API_PARACOUNT < 2 || RING_API_PARACOUNT > 4)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
+		RING_API_ERROR(RING_API_BADPARACOUNT);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (!RING_API_ISSTRING(1) || !RING_API_ISNUMBER(2) || (RING_API_PARACOUNT >= 3 && !RING_API_ISNUMBER(3)))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	List *pList = RING_API_GETLIST(1);
-	const char *ptype = ring_list_getstring(pList, RING_CPOINTER_TYPE);
-	struct archive *a = NULL;
-	if (strcmp(ptype, "archive_read") == 0)
+	ArchiveCodec codec;
+	if (!archive_codec_init(&codec, (int)RING_API_GETNUMBER(2), 0, -1))
 	{
-		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+		RING_API_ERROR(codec.cError);
+		return;
 	}
-	else if (strcmp(ptype, "archive_write") == 0)
+	if (RING_API_PARACOUNT == 4 && !archive_codec_dict_param(pPointer, 4, &codec))
 	{
-		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+		return;
 	}
-	if (!a)
+
+	ArchiveMemory out;
+	memset(&out, 0, sizeof(out));
+	if (RING_API_PARACOUNT >= 3 && RING_API_GETNUMBER(3) > 0)
 	{
-		RING_API_RETNUMBER(0);
+		out.nMaxSize = (size_t)RING_API_GETNUMBER(3);
+	}
+	if (!archive_codec_run(&codec, RING_API_GETSTRING(1), (size_t)RING_API_GETSTRINGSIZE(1), RING_ARCHIVE_CODEC_FINISH,
+						   &out))
+	{
+		const char *cError = codec.cError;
+		archive_memory_clear(&out);
+		archive_codec_end(&codec);
+		RING_API_ERROR(cError);
 		return;
 	}
+	archive_codec_end(&codec);
 
-	RING_API_RETNUMBER((double)archive_errno(a));
-}
-
-/*
- * archive_version_string() -> cVersion
- *
- * Get libarchive version string.
- */
-RING_FUNC(ring_archive_version_string)
-{
-	RING_API_RETSTRING(archive_version_string());
+	RING_API_RETSTRING2(out.nSize ? out.pData : "", out.nSize);
+	archive_memory_clear(&out);
 }
 
-/*
- * archive_format_name(pArchive) -> cFormatName
- *
- * Get archive format name.
- */
-RING_FUNC(ring_archive_format_name)
+static void archive_stream_new(void *pPointer, int lEncode)
 {
-	if (RING_API_PARACOUNT != 1)
+	if (RING_API_PARACOUNT < 1 || RING_API_PARACOUNT > 3)
 	{
-		RING_API_ERROR(RING_API_MISS1PARA);
+		RING_API_ERROR(RING_API_BADPARACOUNT);
 		return;
 	}
-	if (!RING_API_ISCPOINTER(1))
+	if (!RING_API_ISNUMBER(1) || (RING_API_PARACOUNT >= 2 && !RING_API_ISNUMBER(2)))
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
+		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	List *pList = RING_API_GETLIST(1);
-	const char *ptype = ring_list_getstring(pList, RING_CPOINTER_TYPE);
-	struct archive *a = NULL;
-	if (strcmp(ptype, "archive_read") == 0)
+	double nArg = RING_API_PARACOUNT >= 2 ? RING_API_GETNUMBER(2) : -1;
+	ArchiveStream *pStream = (ArchiveStream *)calloc(1, sizeof(ArchiveStream));
+	if (!pStream)
 	{
-		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
+		RING_API_ERROR("Failed to allocate stream");
+		return;
 	}
-	else if (strcmp(ptype, "archive_write") == 0)
+	if (!archive_codec_init(&pStream->codec, (int)RING_API_GETNUMBER(1), lEncode, lEncode ? (int)nArg : -1))
 	{
-		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+		const char *cError = pStream->codec.cError;
+		free(pStream);
+		RING_API_ERROR(cError);
+		return;
 	}
-	if (!a)
+	if (RING_API_PARACOUNT == 3 && !archive_codec_dict_param(pPointer, 3, &pStream->codec))
 	{
+		free(pStream);
 		return;
 	}
-
-	const char *name = archive_format_name(a);
-	if (name)
+	if (!lEncode && nArg > 0)
 	{
-		RING_API_RETSTRING(name);
+		pStream->nMaxSize = (size_t)nArg;
 	}
+	RING_API_RETMANAGEDCPOINTER(pStream, "archive_stream", free_archive_stream);
 }
 
-/*
- * archive_filter_name(pArchive, nFilter) -> cFilterName
- *
- * Get filter name.
- */
-RING_FUNC(ring_archive_filter_name)
+static void archive_stream_call(void *pPointer, int nMode)
 {
-	if (RING_API_PARACOUNT != 2)
+	/* feed needs data; flush and finish take it optionally */
+	if (nMode == RING_ARCHIVE_CODEC_CONTINUE && RING_API_PARACOUNT != 2)
 	{
 		RING_API_ERROR(RING_API_MISS2PARA);
 		return;
 	}
+	if (RING_API_PARACOUNT < 1 || RING_API_PARACOUNT > 2)
+	{
+		RING_API_ERROR(RING_API_BADPARACOUNT);
+		return;
+	}
+	int nParams = RING_API_PARACOUNT;
 	if (!RING_API_ISCPOINTER(1))
 	{
 		RING_API_ERROR(RING_API_NOTPOINTER);
 		return;
 	}
-	if (!RING_API_ISNUMBER(2))
+	if (nParams == 2 && !RING_API_ISSTRING(2))
 	{
 		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	List *pList = RING_API_GETLIST(1);
-	const char *ptype = ring_list_getstring(pList, RING_CPOINTER_TYPE);
-	struct archive *a = NULL;
-	if (strcmp(ptype, "archive_read") == 0)
-	{
-		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	}
-	else if (strcmp(ptype, "archive_write") == 0)
+	ArchiveStream *pStream = (ArchiveStream *)RING_API_GETCPOINTER(1, "archive_stream");
+	if (!pStream)
 	{
-		a = (struct archive *)RING_API_GETCPOINTER(1, "archive_write");
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
 	}
-	if (!a)
+
+	const char *pIn = nParams == 2 ? RING_API_GETSTRING(2) : "";
+	size_t nIn = nParams == 2 ? (size_t)RING_API_GETSTRINGSIZE(2) : 0;
+	if (!archive_stream_run(pStream, pIn, nIn, nMode))
 	{
+		RING_API_ERROR(pStream->cError);
 		return;
 	}
 
-	const char *name = archive_filter_name(a, (int)RING_API_GETNUMBER(2));
-	if (name)
+	RING_API_RETSTRING2(pStream->out.nSize ? pStream->out.pData : "", pStream->out.nSize);
+	if (pStream->lClosed || pStream->out.nCapacity > RING_ARCHIVE_STREAM_KEEP)
 	{
-		RING_API_RETSTRING(name);
+		archive_memory_clear(&pStream->out);
 	}
 }
 
-/* ============================================================================
- * Ring Functions - High-Level Utilities
- * ============================================================================
+/*
+ * archive_compressor_new(nCodec [, nLevel [, pDict]]) -> pStream
+ *
+ * Create an incremental compressor for one of the ARCHIVE_COMPRESSION_*
+ * codecs. Data given to archive_stream_feed() may be held back by the
+ * codec; archive_stream_flush() pushes it out and archive_stream_finish()
+ * ends the stream.
  */
+RING_FUNC(ring_archive_compressor_new)
+{
+	archive_stream_new(pPointer, 1);
+}
 
 /*
- * archive_extract(cArchivePath, cDestPath) -> lSuccess
+ * archive_decompressor_new(nCodec [, nMaxSize [, pDict]]) -> pStream
  *
- * Extract entire archive to destination directory.
+ * Create an incremental decompressor. Compressed data can be fed in
+ * chunks of any size; each call returns the bytes decoded so far.
+ * Producing more than nMaxSize bytes in total is an error.
  */
-RING_FUNC(ring_archive_extract)
+RING_FUNC(ring_archive_decompressor_new)
 {
-	if (RING_API_PARACOUNT != 2)
-	{
-		RING_API_ERROR(RING_API_MISS2PARA);
-		return;
-	}
-	if (!RING_API_ISSTRING(1) || !RING_API_ISSTRING(2))
-	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
-	}
-
-	const char *archive_path = RING_API_GETSTRING(1);
-	const char *dest_path = RING_API_GETSTRING(2);
-
-	struct archive *a = archive_read_new();
-	struct archive *ext = archive_write_disk_new();
-	struct archive_entry *entry;
-	int flags = ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_SECURE_NODOTDOT;
-	int result = ARCHIVE_OK;
-
-	archive_read_support_filter_all(a);
-	archive_read_support_format_all(a);
-	archive_write_disk_set_options(ext, flags);
-
-	if (archive_read_open_filename(a, archive_path, 10240) != ARCHIVE_OK)
-	{
-		archive_read_free(a);
-		archive_write_free(ext);
-		RING_API_RETNUMBER(0);
-		return;
-	}
-
-	VM *pVM = (VM *)pPointer;
-	size_t dest_len = strlen(dest_path);
-	int is_zip = 0;
-
-	while ((result = archive_read_next_header(a, &entry)) == ARCHIVE_OK)
-	{
-		/* Check format on first entry */
-		if (!is_zip && (archive_format(a) & ARCHIVE_FORMAT_BASE_MASK) == ARCHIVE_FORMAT_ZIP)
-		{
-			is_zip = 1;
-		}
-
-		const char *current_path = archive_entry_pathname(entry);
-
-		/* Construct full path */
-		size_t new_path_len = dest_len + 1 + strlen(current_path) + 1;
-		char *new_path = (char *)ring_state_malloc(pVM->pRingState, new_path_len);
-		snprintf(new_path, new_path_len, "%s/%s", dest_path, current_path);
-		archive_entry_set_pathname(entry, new_path);
-
-		/* Fix permissions for ZIP - it doesn't store Unix perms correctly */
-		if (is_zip)
-		{
-			__LA_MODE_T filetype = archive_entry_filetype(entry);
-			if (filetype == AE_IFDIR)
-			{
-				archive_entry_set_perm(entry, 0755);
-			}
-			else if (filetype == AE_IFREG)
-			{
-				archive_entry_set_perm(entry, 0644);
-			}
-		}
-
-		result = archive_write_header(ext, entry);
-		if (result == ARCHIVE_OK)
-		{
-			const void *buff;
-			size_t size;
-			la_int64_t offset;
-
-			while (archive_read_data_block(a, &buff, &size, &offset) == ARCHIVE_OK)
-			{
-				archive_write_data_block(ext, buff, size, offset);
-			}
-			archive_write_finish_entry(ext);
-		}
+	archive_stream_new(pPointer, 0);
+}
 
-		ring_state_free(pVM->pRingState, new_path);
-	}
+/*
+ * archive_stream_feed(pStream, cData) -> cOutput
+ *
+ * Pass the next chunk through the stream and return whatever output it
+ * produced, which may be empty.
+ */
+RING_FUNC(ring_archive_stream_feed)
+{
+	archive_stream_call(pPointer, RING_ARCHIVE_CODEC_CONTINUE);
+}
 
-	archive_read_close(a);
-	archive_read_free(a);
-	archive_write_close(ext);
-	archive_write_free(ext);
+/*
+ * archive_stream_flush(pStream [, cData]) -> cOutput
+ *
+ * Like archive_stream_feed(), then emit all pending output. For gzip, xz,
+ * zstd, lz4 and Brotli compressors the receiver can then decode everything
+ * fed so far. bzip2 blocks are not byte aligned and the legacy LZMA format
+ * has no flush marker, so with those the last bytes stay pending.
+ */
+RING_FUNC(ring_archive_stream_flush)
+{
+	archive_stream_call(pPointer, RING_ARCHIVE_CODEC_FLUSH);
+}
 
-	RING_API_RETNUMBER(result == ARCHIVE_EOF ? 1 : 0);
+/*
+ * archive_stream_finish(pStream [, cData]) -> cOutput
+ *
+ * Complete the stream and return the remaining output. A decompressor
+ * fails if the compressed data was cut short. The stream cannot be used
+ * afterwards.
+ */
+RING_FUNC(ring_archive_stream_finish)
+{
+	archive_stream_call(pPointer, RING_ARCHIVE_CODEC_FINISH);
 }
 
 /*
- * archive_list(cArchivePath) -> aEntries
+ * archive_stream_done(pStream) -> lDone
  *
- * List all entries in an archive.
- * Returns list of [pathname, size, type, mtime]
+ * For a decompressor: true once the end of the compressed stream has
+ * been decoded. xz input may hold further concatenated streams, so it
+ * only counts as done after archive_stream_finish(). For a compressor:
+ * true once it is finished.
  */
-RING_FUNC(ring_archive_list)
+RING_FUNC(ring_archive_stream_done)
 {
 	if (RING_API_PARACOUNT != 1)
 	{
 		RING_API_ERROR(RING_API_MISS1PARA);
 		return;
 	}
-	if (!RING_API_ISSTRING(1))
+	if (!RING_API_ISCPOINTER(1))
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
+		RING_API_ERROR(RING_API_NOTPOINTER);
 		return;
 	}
 
-	const char *archive_path = RING_API_GETSTRING(1);
+	ArchiveStream *pStream = (ArchiveStream *)RING_API_GETCPOINTER(1, "archive_stream");
+	if (!pStream)
+	{
+		RING_API_ERROR(RING_API_NULLPOINTER);
+		return;
+	}
+	RING_API_RETNUMBER(pStream->lClosed ? pStream->lDone : pStream->codec.lDone);
+}
+
+/*
+ * Collect training samples from the regular files of an archive. Files
+ * that no longer fit in the sample budget are skipped, so smaller ones
+ * later in the archive still count. Returns the number of samples, or -1
+ * if the archive cannot be read.
+ */
+#define RING_ARCHIVE_DICTIONARY_SAMPLE_LIMIT (128 * 1024 * 1024)
 
+static int archive_dict_collect_samples(const char *path, ArchiveMemory *pSamples, size_t **ppSizes)
+{
 	struct archive *a = archive_read_new();
 	struct archive_entry *entry;
-
 	archive_read_support_filter_all(a);
 	archive_read_support_format_all(a);
-
-	if (archive_read_open_filename(a, archive_path, 10240) != ARCHIVE_OK)
+	if (archive_read_open_path(a, path, 10240) != ARCHIVE_OK)
 	{
 		archive_read_free(a);
-		RING_API_ERROR("Failed to open archive");
-		return;
+		return -1;
 	}
 
-	VM *pVM = (VM *)pPointer;
-	List *pResultList = RING_API_NEWLIST;
-
+	int nSamples = 0;
+	int nCapacity = 0;
+	la_int64_t nIndex = -1;
 	while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
 	{
-		List *pEntryList = ring_list_newlist_gc(pVM->pRingState, pResultList);
-
-		const char *pathname = archive_entry_pathname(entry);
-		ring_list_addstring_gc(pVM->pRingState, pEntryList, pathname ? pathname : "");
-		ring_list_adddouble_gc(pVM->pRingState, pEntryList, (double)archive_entry_size(entry));
-
-		mode_t type = archive_entry_filetype(entry);
-		int ring_type = RING_ENTRY_FILE;
-		if (S_ISDIR(type))
-			ring_type = RING_ENTRY_DIR;
-		else if (S_ISLNK(type))
-			ring_type = RING_ENTRY_SYMLINK;
-		ring_list_adddouble_gc(pVM->pRingState, pEntryList, (double)ring_type);
-
-		ring_list_adddouble_gc(pVM->pRingState, pEntryList, (double)archive_entry_mtime(entry));
-
-		archive_read_data_skip(a);
+		la_int64_t size = archive_entry_size(entry);
+		int lDictCandidate = archive_dict_is_entry(entry, ++nIndex);
+		if (archive_entry_filetype(entry) != AE_IFREG || size <= 0)
+		{
+			continue;
+		}
+		if (pSamples->nSize + (size_t)size > RING_ARCHIVE_DICTIONARY_SAMPLE_LIMIT)
+		{
+			continue;
+		}
+		if (nSamples == nCapacity)
+		{
+			nCapacity = nCapacity ? nCapacity * 2 : 256;
+			size_t *pSizes = (size_t *)realloc(*ppSizes, sizeof(size_t) * nCapacity);
+			if (!pSizes)
+			{
+				break;
+			}
+			*ppSizes = pSizes;
+		}
+		if (!archive_memory_reserve(pSamples, pSamples->nSize + (size_t)size))
+		{
+			break;
+		}
+		la_ssize_t got = archive_read_data(a, pSamples->pData + pSamples->nSize, (size_t)size);
+		if (got <= 0 || archive_dict_get_mark((unsigned char *)pSamples->pData + pSamples->nSize,
+											  got < RING_ARCHIVE_DICTIONARY_MARK_SIZE ? 0 : RING_ARCHIVE_DICTIONARY_MARK_SIZE) >= 0)
+		{
+			/* Already packed with a dictionary */
+			continue;
+		}
+		if (lDictCandidate && archive_dict_has_magic(pSamples->pData + pSamples->nSize, (size_t)got))
+		{
+			/* The dictionary of a dictionary archive */
+			continue;
+		}
+		pSamples->nSize += (size_t)got;
+		(*ppSizes)[nSamples++] = (size_t)got;
 	}
 
 	archive_read_close(a);
 	archive_read_free(a);
-
-	RING_API_RETLIST(pResultList);
+	return nSamples;
 }
 
 /*
- * archive_create(cArchivePath, aFiles, nFormat, nCompression) -> lSuccess
+ * archive_zstd_train(aSamples | cArchivePath [, nDictSize]) -> cDict
  *
- * Create an archive from list of files/directories (recursive).
- * Uses libarchive's archive_read_disk API for proper handling.
+ * Train a zstd dictionary for many small, similar inputs. Samples are the
+ * strings in aSamples or the files inside cArchivePath (up to 128 MB).
+ * nDictSize defaults to 110 KB, as with zstd --train. Training needs a
+ * good number of samples, typically a few hundred.
  */
-RING_FUNC(ring_archive_create)
+RING_FUNC(ring_archive_zstd_train)
 {
-	if (RING_API_PARACOUNT != 4)
+	if (RING_API_PARACOUNT < 1 || RING_API_PARACOUNT > 2)
 	{
 		RING_API_ERROR(RING_API_BADPARACOUNT);
 		return;
 	}
-	if (!RING_API_ISSTRING(1) || !RING_API_ISLIST(2) || !RING_API_ISNUMBER(3) || !RING_API_ISNUMBER(4))
+	if ((!RING_API_ISLIST(1) && !RING_API_ISSTRING(1)) || (RING_API_PARACOUNT == 2 && !RING_API_ISNUMBER(2)))
 	{
 		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	const char *archive_path = RING_API_GETSTRING(1);
-	List *pFilesList = RING_API_GETLIST(2);
-	int format = (int)RING_API_GETNUMBER(3);
-	int compression = (int)RING_API_GETNUMBER(4);
-
-	struct archive *a = archive_write_new();
-	struct archive *disk = archive_read_disk_new();
-	struct archive_entry *entry;
-	int r;
-
-	/* Set format */
-	switch (format)
-	{
-	case RING_ARCHIVE_FORMAT_TAR:
-		archive_write_set_format_pax_restricted(a);
-		break;
-	case RING_ARCHIVE_FORMAT_ZIP:
-		archive_write_set_format_zip(a);
-		break;
-	case RING_ARCHIVE_FORMAT_7ZIP:
-		archive_write_set_format_7zip(a);
-		break;
-	case RING_ARCHIVE_FORMAT_CPIO:
-		archive_write_set_format_cpio(a);
-		break;
-	default:
-		archive_write_set_format_pax_restricted(a);
-	}
-
-	/* Set compression */
-	switch (compression)
+	size_t nDictSize = 112640;
+	if (RING_API_PARACOUNT == 2 && RING_API_GETNUMBER(2) > 0)
 	{
-	case RING_COMPRESSION_NONE:
-		archive_write_add_filter_none(a);
-		break;
-	case RING_COMPRESSION_GZIP:
-		archive_write_add_filter_gzip(a);
-		break;
-	case RING_COMPRESSION_BZIP2:
-		archive_write_add_filter_bzip2(a);
-		break;
-	case RING_COMPRESSION_XZ:
-		archive_write_add_filter_xz(a);
-		break;
-	case RING_COMPRESSION_LZMA:
-		archive_write_add_filter_lzma(a);
-		break;
-	case RING_COMPRESSION_ZSTD:
-		archive_write_add_filter_zstd(a);
-		break;
-	case RING_COMPRESSION_LZ4:
-		archive_write_add_filter_lz4(a);
-		break;
-	default:
-		archive_write_add_filter_none(a);
+		nDictSize = (size_t)RING_API_GETNUMBER(2);
 	}
 
-	/* Configure disk reader to not cross mount points and handle symlinks */
-	archive_read_disk_set_standard_lookup(disk);
-	archive_read_disk_set_behavior(disk, ARCHIVE_READDISK_NO_TRAVERSE_MOUNTS);
+	ArchiveMemory samples;
+	memset(&samples, 0, sizeof(samples));
+	size_t *pSizes = NULL;
+	int nSamples = 0;
 
-	if (archive_write_open_filename(a, archive_path) != ARCHIVE_OK)
+	if (RING_API_ISSTRING(1))
 	{
-		archive_read_free(disk);
-		archive_write_free(a);
-		RING_API_RETNUMBER(0);
-		return;
+		nSamples = archive_dict_collect_samples(RING_API_GETSTRING(1), &samples, &pSizes);
+		if (nSamples < 0)
+		{
+			RING_API_ERROR("Failed to open archive");
+			return;
+		}
 	}
-
-	int success = 1;
-	int nSize = ring_list_getsize(pFilesList);
-
-	for (int i = 1; i <= nSize; i++)
+	else
 	{
-		if (!ring_list_isstring(pFilesList, i))
-			continue;
-
-		const char *filepath = ring_list_getstring(pFilesList, i);
-
-		r = archive_read_disk_open(disk, filepath);
-		if (r != ARCHIVE_OK)
-			continue;
-
-		for (;;)
+		List *pList = RING_API_GETLIST(1);
+		int nItems = ring_list_getsize(pList);
+		pSizes = (size_t *)malloc(sizeof(size_t) * (nItems ? nItems : 1));
+		for (int i = 1; pSizes && i <= nItems; i++)
 		{
-			entry = archive_entry_new();
-			r = archive_read_next_header2(disk, entry);
-
-			if (r == ARCHIVE_EOF)
-			{
-				archive_entry_free(entry);
-				break;
-			}
-
-			if (r != ARCHIVE_OK)
-			{
-				archive_entry_free(entry);
-				break;
-			}
-
-			/* Let libarchive read file metadata from disk */
-			archive_read_disk_descend(disk);
-
-			/* Write header */
-			r = archive_write_header(a, entry);
-			if (r < ARCHIVE_OK)
-			{
-				archive_entry_free(entry);
+			if (!ring_list_isstring(pList, i))
 				continue;
-			}
-
-			/* Write file data if it's a regular file with content */
-			if (archive_entry_size(entry) > 0)
+			size_t nItem = (size_t)ring_list_getstringsize(pList, i);
+			if (nItem == 0)
+				continue;
+			if (!archive_memory_reserve(&samples, samples.nSize + nItem + 1))
 			{
-				int fd = open(archive_entry_sourcepath(entry), O_RDONLY);
-				if (fd >= 0)
-				{
-					char buff[8192];
-					ssize_t len;
-					while ((len = read(fd, buff, sizeof(buff))) > 0)
-					{
-						archive_write_data(a, buff, len);
-					}
-					close(fd);
-				}
+				break;
 			}
-
-			archive_entry_free(entry);
+			memcpy(samples.pData + samples.nSize, ring_list_getstring(pList, i), nItem);
+			samples.nSize += nItem;
+			pSizes[nSamples++] = nItem;
 		}
-
-		archive_read_close(disk);
 	}
 
-	archive_read_free(disk);
-	archive_write_close(a);
-	archive_write_free(a);
-
-	RING_API_RETNUMBER(success);
-}
-
-/*
- * archive_read_add_passphrase(pArchive, cPassphrase) -> nResult
- *
- * Add a passphrase for reading encrypted archives.
- */
-RING_FUNC(ring_archive_read_add_passphrase)
-{
-	if (RING_API_PARACOUNT != 2)
+	char *pDict = (char *)malloc(nDictSize);
+	const char *cError = NULL;
+	size_t r = 0;
+	if (nSamples == 0)
 	{
-		RING_API_ERROR(RING_API_MISS2PARA);
-		return;
+		cError = "No samples to train on";
 	}
-	if (!RING_API_ISCPOINTER(1))
+	else if (!pDict)
 	{
-		RING_API_ERROR(RING_API_NOTPOINTER);
-		return;
+		cError = "Out of memory";
 	}
-	if (!RING_API_ISSTRING(2))
+	else
 	{
-		RING_API_ERROR(RING_API_BADPARATYPE);
-		return;
+		r = ZDICT_trainFromBuffer(pDict, nDictSize, samples.pData, pSizes, (unsigned)nSamples);
+		cError = ZDICT_isError(r) ? ZDICT_getErrorName(r) : NULL;
 	}
+	free(pSizes);
+	archive_memory_clear(&samples);
 
-	struct archive *a = (struct archive *)RING_API_GETCPOINTER(1, "archive_read");
-	if (!a)
+	if (cError)
 	{
-		RING_API_ERROR(RING_API_NULLPOINTER);
+		free(pDict);
+		RING_API_ERROR(cError);
 		return;
 	}
-
-	const char *passphrase = RING_API_GETSTRING(2);
-	int result = archive_read_add_passphrase(a, passphrase);
-	RING_API_RETNUMBER((double)result);
+	RING_API_RETSTRING2(pDict, r);
+	free(pDict);
 }
 
 /*
- * archive_read_file(cArchivePath, cEntryPath) -> cData
+ * archive_zstd_dict_new(cDict [, nLevel]) -> pDict
  *
- * Read a single file from an archive.
+ * Prepare a dictionary from archive_zstd_train() (or zstd --train) for
+ * archive_compress(), archive_decompress(), the stream functions and the
+ * :dictionary option of archive_create(). Preparing is the costly part,
+ * so keep pDict around. nLevel is the zstd level used when compressing
+ * with it (default 3).
  */
-RING_FUNC(ring_archive_read_file)
+RING_FUNC(ring_archive_zstd_dict_new)
 {
-	if (RING_API_PARACOUNT != 2)
+	if (RING_API_PARACOUNT < 1 || RING_API_PARACOUNT > 2)
 	{
-		RING_API_ERROR(RING_API_MISS2PARA);
+		RING_API_ERROR(RING_API_BADPARACOUNT);
 		return;
 	}
-	if (!RING_API_ISSTRING(1) || !RING_API_ISSTRING(2))
+	if (!RING_API_ISSTRING(1) || (RING_API_PARACOUNT == 2 && !RING_API_ISNUMBER(2)))
 	{
 		RING_API_ERROR(RING_API_BADPARATYPE);
 		return;
 	}
 
-	const char *archive_path = RING_API_GETSTRING(1);
-	const char *entry_path = RING_API_GETSTRING(2);
-
-	struct archive *a = archive_read_new();
-	struct archive_entry *entry;
-
-	archive_read_support_filter_all(a);
-	archive_read_support_format_all(a);
-
-	if (archive_read_open_filename(a, archive_path, 10240) != ARCHIVE_OK)
+	int level = RING_API_PARACOUNT == 2 ? (int)RING_API_GETNUMBER(2) : 0;
+	ArchiveDict *pDict = archive_dict_create(RING_API_GETSTRING(1), (size_t)RING_API_GETSTRINGSIZE(1),
+											 level > 0 ? level : 0);
+	if (!pDict)
 	{
-		archive_read_free(a);
+		RING_API_ERROR("Failed to load dictionary");
 		return;
 	}
-
-	VM *pVM = (VM *)pPointer;
-	char *result_data = NULL;
-	size_t result_size = 0;
-
-	while (archive_read_next_header(a, &entry) == ARCHIVE_OK)
-	{
-		const char *pathname = archive_entry_pathname(entry);
-		if (pathname && strcmp(pathname, entry_path) == 0)
-		{
-			la_int64_t size = archive_entry_size(entry);
-			if (size > 0)
-			{
-				result_data = (char *)ring_state_malloc(pVM->pRingState, size);
-				result_size = archive_read_data(a, result_data, size);
-			}
-			break;
-		}
-		archive_read_data_skip(a);
-	}
-
-	archive_read_close(a);
-	archive_read_free(a);
-
-	if (result_data)
-	{
-		RING_API_RETSTRING2(result_data, result_size);
-		ring_state_free(pVM->pRingState, result_data);
-	}
+	RING_API_RETMANAGEDCPOINTER(pDict, "archive_zstd_dict", free_archive_dict);
 }
 
 /* ============================================================================
@@ -2448,6 +11214,10 @@ RING_FUNC(ring_get_archive_compression_lz4)
 {
 	RING_API_RETNUMBER((double)RING_COMPRESSION_LZ4);
 }
+RING_FUNC(ring_get_archive_compression_brotli)
+{
+	RING_API_RETNUMBER((double)RING_COMPRESSION_BROTLI);
+}
 
 RING_FUNC(ring_get_archive_entry_file)
 {
@@ -2500,14 +11270,21 @@ RING_LIBINIT
 	RING_API_REGISTER("archive_read_support_format_all", ring_archive_read_support_format_all);
 	RING_API_REGISTER("archive_read_open_filename", ring_archive_read_open_filename);
 	RING_API_REGISTER("archive_read_open_memory", ring_archive_read_open_memory);
+	RING_API_REGISTER("archive_read_open_fd", ring_archive_read_open_fd);
+	RING_API_REGISTER("archive_read_open_callback", ring_archive_read_open_callback);
+	RING_API_REGISTER("archive_callback_supply", ring_archive_callback_supply);
+	RING_API_REGISTER("archive_read_open_entry", ring_archive_read_open_entry);
 	RING_API_REGISTER("archive_read_next_header", ring_archive_read_next_header);
+	RING_API_REGISTER("archive_read_next_headers", ring_archive_read_next_headers);
 	RING_API_REGISTER("archive_read_data", ring_archive_read_data);
 	RING_API_REGISTER("archive_read_data_block", ring_archive_read_data_block);
 	RING_API_REGISTER("archive_read_data_skip", ring_archive_read_data_skip);
+	RING_API_REGISTER("archive_read_set_rate_limit", ring_archive_read_set_rate_limit);
 	RING_API_REGISTER("archive_read_close", ring_archive_read_close);
 
 	/* Archive Writing */
 	RING_API_REGISTER("archive_write_new", ring_archive_write_new);
+	RING_API_REGISTER("archive_write_new_shared", ring_archive_write_new_shared);
 	RING_API_REGISTER("archive_write_set_format", ring_archive_write_set_format);
 	RING_API_REGISTER("archive_write_set_format_zip", ring_archive_write_set_format_zip);
 	RING_API_REGISTER("archive_write_set_format_pax", ring_archive_write_set_format_pax);
@@ -2520,12 +11297,25 @@ RING_LIBINIT
 	RING_API_REGISTER("archive_write_add_filter_lz4", ring_archive_write_add_filter_lz4);
 	RING_API_REGISTER("archive_write_add_filter_none", ring_archive_write_add_filter_none);
 	RING_API_REGISTER("archive_write_open_filename", ring_archive_write_open_filename);
+	RING_API_REGISTER("archive_write_open_append", ring_archive_write_open_append);
 	RING_API_REGISTER("archive_write_open_memory", ring_archive_write_open_memory);
 	RING_API_REGISTER("archive_memory_get_data", ring_archive_memory_get_data);
 	RING_API_REGISTER("archive_memory_free", ring_archive_memory_free);
+	RING_API_REGISTER("archive_write_open_fd", ring_archive_write_open_fd);
+	RING_API_REGISTER("archive_write_open_callback", ring_archive_write_open_callback);
+	RING_API_REGISTER("archive_callback_data", ring_archive_callback_data);
+	RING_API_REGISTER("archive_callback_abort", ring_archive_callback_abort);
+	RING_API_REGISTER("archive_memory_new", ring_archive_memory_new);
+	RING_API_REGISTER("archive_memory_from_string", ring_archive_memory_from_string);
+	RING_API_REGISTER("archive_memory_reset", ring_archive_memory_reset);
+	RING_API_REGISTER("archive_memory_size", ring_archive_memory_size);
+	RING_API_REGISTER("archive_memory_trim", ring_archive_memory_trim);
 	RING_API_REGISTER("archive_write_header", ring_archive_write_header);
 	RING_API_REGISTER("archive_write_data", ring_archive_write_data);
+	RING_API_REGISTER("archive_write_set_rate_limit", ring_archive_write_set_rate_limit);
 	RING_API_REGISTER("archive_write_finish_entry", ring_archive_write_finish_entry);
+	RING_API_REGISTER("archive_write_file_from_disk", ring_archive_write_file_from_disk);
+	RING_API_REGISTER("archive_write_entries", ring_archive_write_entries);
 	RING_API_REGISTER("archive_write_close", ring_archive_write_close);
 	RING_API_REGISTER("archive_write_set_passphrase", ring_archive_write_set_passphrase);
 	RING_API_REGISTER("archive_write_set_options", ring_archive_write_set_options);
@@ -2561,9 +11351,49 @@ RING_LIBINIT
 	RING_API_REGISTER("archive_extract", ring_archive_extract);
 	RING_API_REGISTER("archive_list", ring_archive_list);
 	RING_API_REGISTER("archive_create", ring_archive_create);
+	RING_API_REGISTER("archive_extract_many", ring_archive_extract_many);
+	RING_API_REGISTER("archive_checksum_entries", ring_archive_checksum_entries);
+	RING_API_REGISTER("archive_verify", ring_archive_verify);
 	RING_API_REGISTER("archive_read_file", ring_archive_read_file);
+	RING_API_REGISTER("archive_set_cache_size", ring_archive_set_cache_size);
+	RING_API_REGISTER("archive_cache_stats", ring_archive_cache_stats);
+	RING_API_REGISTER("archive_cache_clear", ring_archive_cache_clear);
 	RING_API_REGISTER("archive_read_add_passphrase", ring_archive_read_add_passphrase);
 
+	/* Shared Indexes */
+	RING_API_REGISTER("archive_index_open", ring_archive_index_open);
+	RING_API_REGISTER("archive_index_entries", ring_archive_index_entries);
+	RING_API_REGISTER("archive_index_find", ring_archive_index_find);
+	RING_API_REGISTER("archive_index_read", ring_archive_index_read);
+
+	/* Async Jobs */
+	RING_API_REGISTER("archive_set_threads", ring_archive_set_threads);
+	RING_API_REGISTER("archive_get_threads", ring_archive_get_threads);
+	RING_API_REGISTER("archive_extract_async", ring_archive_extract_async);
+	RING_API_REGISTER("archive_list_async", ring_archive_list_async);
+	RING_API_REGISTER("archive_create_async", ring_archive_create_async);
+	RING_API_REGISTER("archive_job_poll", ring_archive_job_poll);
+	RING_API_REGISTER("archive_job_wait", ring_archive_job_wait);
+	RING_API_REGISTER("archive_job_cancel", ring_archive_job_cancel);
+	RING_API_REGISTER("archive_job_progress", ring_archive_job_progress);
+	RING_API_REGISTER("archive_job_result", ring_archive_job_result);
+	RING_API_REGISTER("archive_token_new", ring_archive_token_new);
+	RING_API_REGISTER("archive_token_cancel", ring_archive_token_cancel);
+	RING_API_REGISTER("archive_token_cancelled", ring_archive_token_cancelled);
+	RING_API_REGISTER("archive_token_progress", ring_archive_token_progress);
+
+	/* Compression */
+	RING_API_REGISTER("archive_compress", ring_archive_compress);
+	RING_API_REGISTER("archive_decompress", ring_archive_decompress);
+	RING_API_REGISTER("archive_compressor_new", ring_archive_compressor_new);
+	RING_API_REGISTER("archive_decompressor_new", ring_archive_decompressor_new);
+	RING_API_REGISTER("archive_stream_feed", ring_archive_stream_feed);
+	RING_API_REGISTER("archive_stream_flush", ring_archive_stream_flush);
+	RING_API_REGISTER("archive_stream_finish", ring_archive_stream_finish);
+	RING_API_REGISTER("archive_stream_done", ring_archive_stream_done);
+	RING_API_REGISTER("archive_zstd_train", ring_archive_zstd_train);
+	RING_API_REGISTER("archive_zstd_dict_new", ring_archive_zstd_dict_new);
+
 	/* Format Constants */
 	RING_API_REGISTER("get_archive_format_tar", ring_get_archive_format_tar);
 	RING_API_REGISTER("get_archive_format_zip", ring_get_archive_format_zip);
@@ -2581,6 +11411,7 @@ RING_LIBINIT
 	RING_API_REGISTER("get_archive_compression_lzma", ring_get_archive_compression_lzma);
 	RING_API_REGISTER("get_archive_compression_zstd", ring_get_archive_compression_zstd);
 	RING_API_REGISTER("get_archive_compression_lz4", ring_get_archive_compression_lz4);
+	RING_API_REGISTER("get_archive_compression_brotli", ring_get_archive_compression_brotli);
 
 	/* Entry Type Constants */
 	RING_API_REGISTER("get_archive_entry_file", ring_get_archive_entry_file);